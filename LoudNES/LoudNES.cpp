@@ -11,14 +11,23 @@ LoudNES::LoudNES(const InstanceInfo& info)
   GetParam(kParamGain)->InitDouble("Gain", 100., 0., 100.0, 0.01, "%");
   GetParam(kParamNoteGlideTime)->InitMilliseconds("Note Glide Time", 0., 0.0, 30.);
   GetParam(kParamOmniMode)->InitBool("Omni Mode Enabled", true);
+  GetParam(kParamTickRate)->InitEnum("Tick Rate", kTickRate60, kNumTickRates, "", IParam::kFlagsNone, "", "50 Hz", "60 Hz", "120 Hz", "240 Hz", "1/16", "1/16 T", "1/32", "1/32 T");
+  GetParam(kParamPolyVoices)->InitInt("Poly Voices", 1, 1, kMaxPolyVoices, "", IParam::kFlagStepped);
+  GetParam(kParamParaMode)->InitEnum("Paraphonic Mode", kParaOff, kNumParaModes, "", IParam::kFlagsNone, "", "Off", "Round Robin", "Oldest Steal", "Lowest Note");
+  GetParam(kParamMpe)->InitBool("MPE Mode", false);
+  GetParam(kParamNonlinearMix)->InitBool("Nonlinear Mix", false);
 
   char const* channelStrs[8] = {"Pulse 1", "Pulse 2", "Triangle", "Noise", "DPCM", "VRC6 Pulse 1", "VRC6 Pulse 2", "VRC6 Saw"};
   for (int i = 0; i < 8; i++) {
     string chStr = channelStrs[i];
+    bool isPulse = i == NesApu::Channel::Pulse1 || i == NesApu::Channel::Pulse2 ||
+                   i == NesApu::Channel::Vrc6Pulse1 || i == NesApu::Channel::Vrc6Pulse2;
     GetParam(ParamFromCh(i, kParamChEnabled    ))->InitBool((chStr + " Enabled"      ).c_str(), false);
     GetParam(ParamFromCh(i, kParamChKeyTrack   ))->InitBool((chStr + " Key Track"    ).c_str(), true);
     GetParam(ParamFromCh(i, kParamChVelSens    ))->InitBool((chStr + " Vel Sens"     ).c_str(), true);
     GetParam(ParamFromCh(i, kParamChLegato     ))->InitBool((chStr + " Legato"       ).c_str(), false);
+    GetParam(ParamFromCh(i, kParamChParaphonic ))->InitBool((chStr + " Paraphonic"   ).c_str(), isPulse);
+    GetParam(ParamFromCh(i, kParamChPan        ))->InitDouble((chStr + " Pan"        ).c_str(), 0., -100., 100., 1., "%");
     GetParam(ParamFromCh(i, kParamEnv1LoopPoint))->InitInt ((chStr + " Env 1 Loop"   ).c_str(), 15, 0, 64, "", IParam::kFlagStepped);
     GetParam(ParamFromCh(i, kParamEnv1RelPoint ))->InitInt ((chStr + " Env 1 Release").c_str(), 16, 0, 64, "", IParam::kFlagStepped);
     GetParam(ParamFromCh(i, kParamEnv1Length   ))->InitInt ((chStr + " Env 1 Length" ).c_str(), 16, 0, 64, "", IParam::kFlagStepped);
@@ -176,10 +185,12 @@ LoudNES::LoudNES(const InstanceInfo& info)
         control.Hide(isDpcm);
       });
 
-      // Reassign channel-specific toggles (Key track, Velocity sensitivity, Legato)
+      // Reassign channel-specific controls (Key track, Velocity sensitivity, Legato, Paraphonic, Pan)
       GetUI()->GetControlWithTag(kCtrlTagKeyTrack)->SetParamIdx(ParamFromCh(ch, kParamChKeyTrack));
       GetUI()->GetControlWithTag(kCtrlTagVelSens)->SetParamIdx(ParamFromCh(ch, kParamChVelSens));
       GetUI()->GetControlWithTag(kCtrlTagLegato)->SetParamIdx(ParamFromCh(ch, kParamChLegato));
+      GetUI()->GetControlWithTag(kCtrlTagParaphonic)->SetParamIdx(ParamFromCh(ch, kParamChParaphonic));
+      GetUI()->GetControlWithTag(kCtrlTagPan)->SetParamIdx(ParamFromCh(ch, kParamChPan));
 
       // Reassign all step sequencer knobs
       for (int i = 0; i < 16; i++) {
@@ -227,7 +238,8 @@ LoudNES::LoudNES(const InstanceInfo& info)
     auto keyboardParamTuples = vector<tuple<EControlTags, EChParams, string>>{
       {kCtrlTagKeyTrack, kParamChKeyTrack, "Key Track"},
       {kCtrlTagVelSens, kParamChVelSens, "Velocity Sens"},
-      {kCtrlTagLegato, kParamChLegato, "Legato"}
+      {kCtrlTagLegato, kParamChLegato, "Legato"},
+      {kCtrlTagParaphonic, kParamChParaphonic, "Paraphonic"}
     };
 
     for (auto keyboardParamTuple : keyboardParamTuples) {
@@ -242,6 +254,13 @@ LoudNES::LoudNES(const InstanceInfo& info)
       channelButtonRect.Translate(0, channelButtonRect.H());
     }
 
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth * 2), "Pan", keyboardControlLabelStyle));
+    auto panSlider = new IVSliderControl(channelButtonRect.GetFromRight(kToggleSwitchWidth * 2), ParamFromCh(0, kParamChPan), "", style, false, EDirection::Horizontal);
+    panSlider->SetTooltip("Where the channel sits between the left and right outputs. Centered, it plays on both "
+                          "at full level; panning turns the far side down.");
+    pGraphics->AttachControl(panSlider, kCtrlTagPan);
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
     channelButtonRect.Translate(0, channelButtonRect.H()); // Vertical space
 
     pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth), "Omni Mode", keyboardControlLabelStyle));
@@ -253,6 +272,45 @@ LoudNES::LoudNES(const InstanceInfo& info)
     pGraphics->AttachControl(omniButton, kNoTag, "NES");
     channelButtonRect.Translate(0, channelButtonRect.H());
 
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth * 2), "Tick Rate", keyboardControlLabelStyle));
+    auto tickRateMenu = new IVMenuButtonControl(channelButtonRect.GetFromRight(kToggleSwitchWidth * 2), kParamTickRate, "", style);
+    tickRateMenu->SetTooltip("How often envelopes step and channels update. 60 Hz is the NES frame rate; "
+                             "faster rates give snappier attacks and smoother pitch envelopes. "
+                             "Note divisions follow the host tempo and stay on its beat grid.");
+    pGraphics->AttachControl(tickRateMenu, kNoTag, "NES");
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth * 2), "Voices", keyboardControlLabelStyle));
+    auto polyVoicesMenu = new IVMenuButtonControl(channelButtonRect.GetFromRight(kToggleSwitchWidth * 2), kParamPolyVoices, "", style);
+    polyVoicesMenu->SetTooltip("Notes each channel can play at once. Above 1, every voice is another "
+                               "emulated NES, and legato and glide are off.");
+    pGraphics->AttachControl(polyVoicesMenu, kNoTag, "NES");
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth * 2), "Para", keyboardControlLabelStyle));
+    auto paraModeMenu = new IVMenuButtonControl(channelButtonRect.GetFromRight(kToggleSwitchWidth * 2), kParamParaMode, "", style);
+    paraModeMenu->SetTooltip("Plays chords on one NES by dealing the notes of one MIDI channel out to the "
+                             "channels with Paraphonic on. The notes come on the MIDI channel of the first of them, "
+                             "or any channel in Omni Mode. Only with 1 voice.");
+    pGraphics->AttachControl(paraModeMenu, kNoTag, "NES");
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth), "MPE", keyboardControlLabelStyle));
+    auto mpeButton = new ISVGSwitchControl(channelButtonRect.GetFromRight(kToggleSwitchWidth), { switchOffSvg, switchOnSvg }, kParamMpe);
+    mpeButton->SetTooltip("For MPE controllers. Notes from every MIDI channel play as in Omni Mode, and each "
+                          "note's own pitch bend and pressure move its pitch and volume. Use Voices or Para "
+                          "for chords. MIDI channel 1 is the master channel.");
+    pGraphics->AttachControl(mpeButton, kNoTag, "NES");
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    pGraphics->AttachControl(new IVLabelControl(channelButtonRect.GetReducedFromRight(kToggleSwitchWidth), "Nonlinear", keyboardControlLabelStyle));
+    auto nonlinearButton = new ISVGSwitchControl(channelButtonRect.GetFromRight(kToggleSwitchWidth), { switchOffSvg, switchOnSvg }, kParamNonlinearMix);
+    nonlinearButton->SetTooltip("Mixes the 2A03 channels the way the NES hardware does, where loud channels "
+                                "squash each other; a loud DPCM sample ducks the triangle and noise. "
+                                "Panned or split channels are still mixed linearly.");
+    pGraphics->AttachControl(nonlinearButton, kNoTag, "NES");
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
     channelButtonRect.B = channelButtonRect.T + 30.f;
     pGraphics->AttachControl(new IVButtonControl(channelButtonRect, [=](IControl *pCaller) {
       static bool hide = false;
@@ -323,13 +381,74 @@ LoudNES::LoudNES(const InstanceInfo& info)
       }
     }, "Load Preset", style.WithColor(kFG, COLOR_WHITE)));
 
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    // The capture is written once the audio thread lets go of it, see UpdateVgmCapture
+    pGraphics->AttachControl(new IVButtonControl(channelButtonRect, [=](IControl *pCaller) {
+      if (mVgmFinishing) return;
+      if (!mDSP.IsVgmCapturing()) {
+        if (mDSP.StartVgmCapture()) pCaller->As<IVButtonControl>()->SetLabelStr("Stop VGM");
+        return;
+      }
+
+      mDSP.StopVgmCapture();
+      WDL_String path;
+      WDL_String filename("LoudNES.vgm");
+      pGraphics->PromptForFile(filename, path, EFileAction::Save, "vgm");
+      mVgmPath = filename;
+      mVgmFinishing = true;
+      pCaller->As<IVButtonControl>()->SetLabelStr("Saving VGM");
+      UpdateVgmCapture();
+    }, "Record VGM", style.WithColor(kFG, COLOR_WHITE)), kCtrlTagRecordVgm);
+
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    pGraphics->AttachControl(new IVButtonControl(channelButtonRect, [=](IControl *pCaller) {
+      WDL_String path;
+      WDL_String filename("LoudNES-timing.csv");
+      pGraphics->PromptForFile(filename, path, EFileAction::Save, "csv");
+      if (filename.GetLength() > 0 && !mDeadlineMeter.WriteReport(filename.Get())) {
+        printf("Couldn't write timing report to %s\n", filename.Get());
+      }
+    }, "Export Timing", style.WithColor(kFG, COLOR_WHITE)));
+
+#if NES_TRACE
+    channelButtonRect.Translate(0, channelButtonRect.H());
+
+    // Timeline of audio thread work, for chrome://tracing or ui.perfetto.dev
+    pGraphics->AttachControl(new IVButtonControl(channelButtonRect, [=](IControl *pCaller) {
+      if (!nes_trace_recording()) {
+        nes_trace_start();
+        pCaller->As<IVButtonControl>()->SetLabelStr("Stop Trace");
+        return;
+      }
+
+      nes_trace_stop();
+      WDL_String path;
+      WDL_String filename("LoudNES-trace.json");
+      pGraphics->PromptForFile(filename, path, EFileAction::Save, "json");
+      if (filename.GetLength() > 0 && !nes_trace_write(filename.Get())) {
+        printf("Couldn't write trace to %s\n", filename.Get());
+      }
+      pCaller->As<IVButtonControl>()->SetLabelStr("Record Trace");
+    }, "Record Trace", style.WithColor(kFG, COLOR_WHITE)));
+#endif
+
     //TODO(montag): Make each section order-independent (use absolute positioning or positioning constants)
 #pragma mark - Presets
 
     //TODO(montag): Create factory presets
     MakeDefaultPreset(nullptr, 1); // kNumPresets);
 
-    pGraphics->AttachControl(new IVBakedPresetManagerControl(b.ReduceFromTop(40).GetFromRight(300), style.WithLabelText({15.f, EVAlign::Middle}))); // "./presets", "nesvst"));
+    const IRECT presetBar = b.ReduceFromTop(40);
+    pGraphics->AttachControl(new IVBakedPresetManagerControl(presetBar.GetFromRight(300), style.WithLabelText({15.f, EVAlign::Middle}))); // "./presets", "nesvst"));
+
+#pragma mark - Diagnostics
+
+    // CPU load, updated from OnIdle. Hover for the per-channel breakdown.
+    pGraphics->AttachControl(new ITextControl(presetBar.GetReducedFromRight(300).GetReducedFromLeft(136), "",
+                                              IText(12.f, IColor::FromColorCode(0x9A9A9A), nullptr, EAlign::Near, EVAlign::Middle)),
+                             kCtrlTagCpuStats);
 
 #pragma mark - Step Sequencers
 
@@ -456,7 +575,7 @@ void LoudNES::UpdateStepSequencers() {
     UpdateStepSequencerAndParamsFromEnv(seqGroup.idx, nesEnv, seq);
 
     seq->SetActionFunc([nesEnv](int stepIdx, float value) {
-      nesEnv->mValues[stepIdx] = round(iplug::Lerp((float)nesEnv->mMinVal, (float)nesEnv->mMaxVal, value));
+      nesEnv->SetValue(stepIdx, round(iplug::Lerp((float)nesEnv->mMinVal, (float)nesEnv->mMaxVal, value)));
     });
     seq->SetSlidersDirty();
   }
@@ -465,7 +584,15 @@ void LoudNES::UpdateStepSequencers() {
 #if IPLUG_DSP
 void LoudNES::ProcessBlock(iplug::sample** inputs, iplug::sample** outputs, int nFrames)
 {
-  mDSP.ProcessBlock(nullptr, outputs, 2, nFrames, mTimeInfo.mPPQPos, mTimeInfo.mTransportIsRunning);
+  NES_TRACE_THREAD("audio");
+  NES_TRACE_SCOPE("ProcessBlock");
+  auto start = std::chrono::steady_clock::now();
+  mDSP.ProcessBlock(nullptr, outputs, NOutChansConnected(), nFrames, mTimeInfo.mPPQPos, mTimeInfo.mTransportIsRunning, mTimeInfo.mTempo);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  bool stateLoaded = mStateLoaded.load(std::memory_order_relaxed) && mStateLoaded.exchange(false);
+  mDeadlineMeter.AddBlock(seconds, nFrames, GetSampleRate(), mBlockNoteOns, stateLoaded);
+  mBlockNoteOns = 0;
 
   // 1/60 sec = 735 samples @ 44100 hz
 
@@ -485,10 +612,10 @@ void LoudNES::ProcessBlock(iplug::sample** inputs, iplug::sample** outputs, int
 //  }
 
   // 6% cpu while 4 envs running @ 4096 buffer size
-  mEnvelopeVisSender.PushData({kCtrlTagEnvelope1, {mDSP.mNesEnvelope1->GetStep()}});
-  mEnvelopeVisSender.PushData({kCtrlTagEnvelope2, {mDSP.mNesEnvelope2->GetStep()}});
-  mEnvelopeVisSender.PushData({kCtrlTagEnvelope3, {mDSP.mNesEnvelope3->GetStep()}});
-  mEnvelopeVisSender.PushData({kCtrlTagEnvelope4, {mDSP.mNesEnvelope4->GetStep()}});
+  mEnvelopeVisSender.PushData({kCtrlTagEnvelope1, {mDSP.mActiveChannel->EnvStep(NesEnvelopes::kVolume)}});
+  mEnvelopeVisSender.PushData({kCtrlTagEnvelope2, {mDSP.mActiveChannel->EnvStep(NesEnvelopes::kDuty)}});
+  mEnvelopeVisSender.PushData({kCtrlTagEnvelope3, {mDSP.mActiveChannel->EnvStep(NesEnvelopes::kArp)}});
+  mEnvelopeVisSender.PushData({kCtrlTagEnvelope4, {mDSP.mActiveChannel->EnvStep(NesEnvelopes::kPitch)}});
 
   // Smoother display update, but more CPU usage, and bad to do from the DSP thread.
   // mEnvelopeVisSender.TransmitData(*this);
@@ -498,11 +625,90 @@ void LoudNES::OnIdle()
 {
   // More jittery display update (not smooth 60 fps), but less CPU usage.
   mEnvelopeVisSender.TransmitData(*this);
+
+  UpdateCpuStatsDisplay();
+  UpdateVgmCapture();
+}
+
+void LoudNES::UpdateVgmCapture()
+{
+  if (!mVgmFinishing || !mDSP.IsVgmStopped()) return;
+  mVgmFinishing = false;
+
+  if (!mDSP.FinishVgmCapture(mVgmPath.GetLength() > 0 ? mVgmPath.Get() : nullptr)) {
+    printf("VGM capture not written.\n");
+  }
+  IControl* button = GetUI() ? GetUI()->GetControlWithTag(kCtrlTagRecordVgm) : nullptr;
+  if (button) button->As<IVButtonControl>()->SetLabelStr("Record VGM");
+}
+
+void LoudNES::UpdateCpuStatsDisplay()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (now - mCpuStatsTime < std::chrono::milliseconds(500)) return;
+  mCpuStatsTime = now;
+
+  LoudNESCpuStats stats;
+  mDSP.GetCpuStats(stats);
+  LoudNESCpuStats d = stats.Since(mCpuStats);
+  mCpuStats = stats;
+
+  IControl* display = GetUI() ? GetUI()->GetControlWithTag(kCtrlTagCpuStats) : nullptr;
+  if (!display || !d.blocks) return;
+
+  auto pct = [&d](int counter) { return d.Load(counter) * 100.; };
+  double channels = 0, oscs = 0;
+  for (int i = 0; i < kNumChannels; i++) channels += pct(kCpuChannelBase + i);
+  for (int i = 0; i < Nes_Apu::osc_count; i++) oscs += pct(kCpuOscBase + i);
+
+  WDL_String text;
+  text.SetFormatted(128, "CPU %.2f%%  channels %.2f%%  2A03 %.2f%%  VRC6 %.2f%%  output %.2f%%  overruns %llu",
+                    pct(kCpuProcess), channels, oscs, pct(kCpuExpansion), pct(kCpuRead),
+                    (unsigned long long) mDeadlineMeter.GetOverrunCount());
+  display->As<ITextControl>()->SetStr(text.Get());
+
+  static const char* const kChannelNames[kNumChannels] = {"Pulse 1", "Pulse 2", "Triangle", "Noise", "DPCM", "VRC6 Pulse 1", "VRC6 Pulse 2", "VRC6 Saw"};
+  static const char* const kOscNames[Nes_Apu::osc_count] = {"square 1", "square 2", "triangle", "noise", "DMC"};
+  WDL_String tooltip;
+  for (int i = 0; i < kNumChannels; i++)
+    tooltip.AppendFormatted(64, "%s: %.3f%%\n", kChannelNames[i], pct(kCpuChannelBase + i));
+  for (int i = 0; i < Nes_Apu::osc_count; i++)
+    tooltip.AppendFormatted(64, "2A03 %s: %.3f%%\n", kOscNames[i], pct(kCpuOscBase + i));
+  tooltip.AppendFormatted(64, "%.0f samples per block\n", (double) d.samples / d.blocks);
+
+  // deadline histogram since the plugin was loaded, as a running percentile
+  uint64_t bins[LoudNESDeadlineMeter::kNumBins], total = 0, below = 0;
+  mDeadlineMeter.GetHistogram(bins);
+  for (uint64_t count : bins) total += count;
+  for (int i = 0, p = 0; i < LoudNESDeadlineMeter::kNumBins && total; i++) {
+    static const double kPercentiles[] = {0.5, 0.99, 0.999};
+    below += bins[i];
+    for (; p < 3 && below >= kPercentiles[p] * total; p++)
+      tooltip.AppendFormatted(64, "p%g of budget: < %d%%\n", kPercentiles[p] * 100., (i + 1) * 100 / LoudNESDeadlineMeter::kBinsPerUnit);
+  }
+
+  LoudNESOverrun last;
+  if (mDeadlineMeter.GetRecentOverruns(&last, 1))
+    tooltip.AppendFormatted(128, "last overrun: %.0f%% at %.1f s, %d note-ons%s",
+                            last.utilization * 100., last.seconds, last.noteOns, last.afterStateLoad ? ", after preset load" : "");
+  mCpuStatsTooltip.Set(tooltip.Get());
+  display->SetTooltip(mCpuStatsTooltip.Get());
+  display->SetDirty(false);
 }
 
 void LoudNES::OnReset()
 {
-  mDSP.Reset(GetSampleRate(), GetBlockSize());
+  mDSP.Reset(GetSampleRate(), GetBlockSize(), NOutChansConnected());
+}
+
+// Output buses after the main mix are one per NES channel
+void LoudNES::GetBusName(ERoute direction, int busIdx, int nBuses, WDL_String& str) const
+{
+  static const char* const kBusNames[kNumChannels] = {"Pulse 1", "Pulse 2", "Triangle", "Noise", "DPCM", "VRC6 Pulse 1", "VRC6 Pulse 2", "VRC6 Saw"};
+  if (direction == ERoute::kOutput && busIdx > 0 && busIdx <= kNumChannels)
+    str.Set(kBusNames[busIdx - 1]);
+  else
+    Plugin::GetBusName(direction, busIdx, nBuses, str);
 }
 
 void LoudNES::ProcessMidiMsg(const IMidiMsg& msg)
@@ -528,6 +734,8 @@ void LoudNES::ProcessMidiMsg(const IMidiMsg& msg)
   }
 
 handle:
+  NES_TRACE_SCOPE("ProcessMidiMsg");
+  if (status == IMidiMsg::kNoteOn && msg.Velocity() > 0) mBlockNoteOns++;
   mDSP.ProcessMidiMsg(msg);
   SendMidiMsg(msg);
 }
@@ -546,10 +754,12 @@ bool LoudNES::SerializeState(IByteChunk &chunk) const {
 }
 
 int LoudNES::UnserializeState(const IByteChunk &chunk, int startPos) {
+  NES_TRACE_SCOPE("UnserializeState");
   int pos = startPos;
   for (auto channel : mDSP.mNesChannels->allChannels) {
     pos = channel->Deserialize(chunk, pos);
   }
+  mStateLoaded = true;
   return UnserializeParams(chunk, pos);
 }
 
@@ -559,7 +769,7 @@ bool LoudNES::OnMessage(int msgTag, int ctrlTag, int dataSize, const void* pData
   if(ctrlTag == kCtrlTagBender && msgTag == IWheelControl::kMessageTagSetPitchBendRange)
   {
     const int bendRange = *static_cast<const int*>(pData);
-    for (auto synth : mDSP.mChannelSynths) synth->SetPitchBendRange(bendRange);
+    mDSP.SetPitchBendRange(bendRange);
   }
 
   return false;
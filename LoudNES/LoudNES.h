@@ -6,67 +6,12 @@
 class StepSequencer;
 
 const int kNumPresets = 8;
-const int kNumChannels = 8;
 const int kEnvelopeSteps = 64;
 //const int kNumEnvParams = 68;
 
-enum EEnvParams {
-  kParamEnvLoopPoint = 0,
-  kParamEnvRelPoint,
-  kParamEnvLength,
-  kParamEnvSpeedDiv,
-
-  kNumEnvParams
-};
-
-// Channel params must be used with ParamFromCh.
-enum EChParams {
-  kParamChEnabled = 0,
-  kParamChKeyTrack,
-  kParamChVelSens,
-  kParamChLegato,
-  // 16 envelope parameters, must be contiguous
-  kParamEnv1LoopPoint,
-  kParamEnv1RelPoint,
-  kParamEnv1Length,
-  kParamEnv1SpeedDiv,
-  kParamEnv2LoopPoint,
-  kParamEnv2RelPoint,
-  kParamEnv2Length,
-  kParamEnv2SpeedDiv,
-  kParamEnv3LoopPoint,
-  kParamEnv3RelPoint,
-  kParamEnv3Length,
-  kParamEnv3SpeedDiv,
-  kParamEnv4LoopPoint,
-  kParamEnv4RelPoint,
-  kParamEnv4Length,
-  kParamEnv4SpeedDiv,
-
-  kNumChParams
-};
-
-enum EParams
-{
-  kParamGain = 0,
-  kParamNoteGlideTime,
-  kParamOmniMode,
-  kParamChannelBase,
-
-  kNumParams = kParamChannelBase + kNumChParams * kNumChannels
-};
-
-std::pair<int, int> ResolveParamToChannelParam(int paramIdx) {
-  if (paramIdx >= kParamChannelBase) {
-    int ch = (paramIdx - kParamChannelBase) / kNumChParams;
-    int param = (paramIdx - kParamChannelBase) % kNumChParams;
-    return {ch, param};
-  }
-  return {-1, -1};
-}
+#include "LoudNES_Params.h"
 
 #if IPLUG_DSP
-// will use EParams in LoudNES_DSP.h
 #include "LoudNES_DSP.h"
 #endif
 
@@ -78,6 +23,8 @@ enum EControlTags
   kCtrlTagKeyTrack,
   kCtrlTagVelSens,
   kCtrlTagLegato,
+  kCtrlTagParaphonic,
+  kCtrlTagPan,
   kCtrlTagEnvelope1, // TODO: rename to StepSeq?
   kCtrlTagEnvelope2,
   kCtrlTagEnvelope3,
@@ -99,6 +46,8 @@ enum EControlTags
   kCtrlTagEnv4RelPoint,
   kCtrlTagEnv4Length,
   kCtrlTagEnv4SpeedDiv,
+  kCtrlTagCpuStats,
+  kCtrlTagRecordVgm,
 
   kNumCtrlTags
 };
@@ -116,6 +65,7 @@ public:
   void ProcessBlock(iplug::sample** inputs, iplug::sample** outputs, int nFrames) override;
   void ProcessMidiMsg(const IMidiMsg& msg) override;
   void OnReset() override;
+  void GetBusName(ERoute direction, int busIdx, int nBuses, WDL_String& str) const override;
   void OnParamChange(int paramIdx) override;
   void OnIdle() override;
   bool OnMessage(int msgTag, int ctrlTag, int dataSize, const void* pData) override;
@@ -126,15 +76,27 @@ public:
 
   int UnserializeState(const IByteChunk &chunk, int startPos) override;
 
-  static int ParamFromCh(int channelNum, int subParam) {
-    return kParamChannelBase + channelNum * kNumChParams + subParam;
-  }
-
 private:
   LoudNESDSP<iplug::sample> mDSP;
   // TODO: Figure out why ISender works best with queue size 8
   ISender<1, 8, int> mEnvelopeVisSender;
 
+  // Shows the audio thread's CPU load since the last update
+  void UpdateCpuStatsDisplay();
+  LoudNESCpuStats mCpuStats;
+  std::chrono::steady_clock::time_point mCpuStatsTime;
+  WDL_String mCpuStatsTooltip;
+
+  // Writes a stopped VGM capture to mVgmPath, once the audio thread has let go of it
+  void UpdateVgmCapture();
+  WDL_String mVgmPath;
+  bool mVgmFinishing = false;
+
+  // Per-block deadline telemetry, recorded in ProcessBlock
+  LoudNESDeadlineMeter mDeadlineMeter;
+  int mBlockNoteOns = 0;
+  std::atomic<bool> mStateLoaded{false};
+
 #endif
 
   void UpdateStepSequencers();
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include "LoudNES_Params.h"
+#include "NesSndEmu/Simple_Apu.h"
+
+// Where the audio thread spends its time. Counters are host ticks (see Host_Ticks.h).
+// Oscillator time is also counted in the channel or frame that made the APU catch up,
+// so the groups overlap; kCpuProcess is the whole of ProcessBlock.
+enum ECpuCounter
+{
+  kCpuProcess = 0,
+  kCpuChannelBase,                                   // NesChannel::UpdateAPU, per channel
+  kCpuOscBase = kCpuChannelBase + kNumChannels,      // 2A03 oscillators, per oscillator
+  kCpuExpansion = kCpuOscBase + Nes_Apu::osc_count,  // expansion chip end_frame
+  kCpuExpansionMix,                                  // VRC7/Sunsoft mixing in read_samples
+  kCpuRead,                                          // Simple_Apu::read_samples
+  kNumCpuCounters
+};
+
+struct LoudNESCpuStats
+{
+  uint64_t blocks = 0;
+  uint64_t samples = 0;
+  uint64_t audioNanos = 0;  // duration of the audio produced
+  uint64_t ticks[kNumCpuCounters] = {};
+  double ticksPerSecond = 0.;
+
+  // Fraction of real time spent on a counter, for the audio covered by these stats
+  double Load(int counter) const
+  {
+    if (!audioNanos || ticksPerSecond <= 0.) return 0.;
+    return ticks[counter] / ticksPerSecond / (audioNanos * 1e-9);
+  }
+
+  // Counters accumulated since an earlier snapshot
+  LoudNESCpuStats Since(const LoudNESCpuStats& earlier) const
+  {
+    LoudNESCpuStats d = *this;
+    d.blocks -= earlier.blocks;
+    d.samples -= earlier.samples;
+    d.audioNanos -= earlier.audioNanos;
+    for (int i = 0; i < kNumCpuCounters; i++) d.ticks[i] -= earlier.ticks[i];
+    return d;
+  }
+};
+
+// Accumulates per-block stats on the audio thread, for reading from any other thread
+class LoudNESCpuMeter
+{
+public:
+  LoudNESCpuMeter()
+  : mStartTicks(read_host_ticks())
+  , mStartTime(std::chrono::steady_clock::now())
+  {}
+
+  // Audio thread. Adds one block's ticks, and the APU's, which it clears.
+  void AddBlock(const uint64_t (&ticks)[kNumCpuCounters], Simple_Apu& apu, int nFrames, double sampleRate)
+  {
+    const Simple_Apu::cpu_stats_t& apuStats = apu.cpu_stats();
+    for (int i = 0; i < kNumCpuCounters; i++) {
+      uint64_t t = ticks[i];
+      if (i >= kCpuOscBase && i < kCpuExpansion) t += apuStats.osc[i - kCpuOscBase];
+      else if (i == kCpuExpansion) t += apuStats.expansion;
+      else if (i == kCpuExpansionMix) t += apuStats.expansion_mix;
+      else if (i == kCpuRead) t += apuStats.read;
+      if (t) mTicks[i].fetch_add(t, std::memory_order_relaxed);
+    }
+    apu.clear_cpu_stats();
+
+    mSamples.fetch_add(nFrames, std::memory_order_relaxed);
+    mAudioNanos.fetch_add((uint64_t) (nFrames * 1e9 / sampleRate), std::memory_order_relaxed);
+    mBlocks.fetch_add(1, std::memory_order_release);
+  }
+
+  // Any thread. Counters only grow; use LoudNESCpuStats::Since for rates.
+  void Get(LoudNESCpuStats& stats) const
+  {
+    stats.blocks = mBlocks.load(std::memory_order_acquire);
+    stats.samples = mSamples.load(std::memory_order_relaxed);
+    stats.audioNanos = mAudioNanos.load(std::memory_order_relaxed);
+    for (int i = 0; i < kNumCpuCounters; i++) stats.ticks[i] = mTicks[i].load(std::memory_order_relaxed);
+
+    // calibrate against the wall clock over the meter's lifetime
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count();
+    stats.ticksPerSecond = seconds > 0. ? (read_host_ticks() - mStartTicks) / seconds : 0.;
+  }
+
+private:
+  const host_ticks_t mStartTicks;
+  const std::chrono::steady_clock::time_point mStartTime;
+  std::atomic<uint64_t> mBlocks{0};
+  std::atomic<uint64_t> mSamples{0};
+  std::atomic<uint64_t> mAudioNanos{0};
+  std::atomic<uint64_t> mTicks[kNumCpuCounters] = {};
+};
+
+// A block that took longer than its real-time budget
+struct LoudNESOverrun
+{
+  uint64_t sampleTime = 0;   // samples processed before this block
+  double seconds = 0.;       // since the meter was created
+  float utilization = 0.f;   // processing time / block duration
+  int blockSize = 0;
+  int noteOns = 0;           // note-ons handled just before the block
+  bool afterStateLoad = false;  // first block after a preset or state load
+};
+
+// Audio deadline telemetry. The audio thread records each block's utilization in a
+// histogram, and keeps the most recent overruns in a ring. Any thread can read both.
+class LoudNESDeadlineMeter
+{
+public:
+  static constexpr int kBinsPerUnit = 20;                // 5% bins
+  static constexpr int kNumBins = 2 * kBinsPerUnit + 1;  // up to 200%, then everything over
+  static constexpr int kRingSize = 64;
+
+  LoudNESDeadlineMeter()
+  : mStartTime(std::chrono::steady_clock::now())
+  {}
+
+  // Audio thread
+  void AddBlock(double seconds, int nFrames, double sampleRate, int noteOns, bool afterStateLoad)
+  {
+    double utilization = seconds * sampleRate / nFrames;
+    int bin = min((int) (utilization * kBinsPerUnit), kNumBins - 1);
+    mBins[bin].fetch_add(1, std::memory_order_relaxed);
+
+    if (utilization > 1.) {
+      uint64_t n = mOverruns.load(std::memory_order_relaxed);
+      Slot& slot = mRing[n % kRingSize];
+      slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot.overrun.sampleTime = mSamples;
+      slot.overrun.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count();
+      slot.overrun.utilization = (float) utilization;
+      slot.overrun.blockSize = nFrames;
+      slot.overrun.noteOns = noteOns;
+      slot.overrun.afterStateLoad = afterStateLoad;
+      slot.seq.store(2 * n + 2, std::memory_order_release);
+      mOverruns.store(n + 1, std::memory_order_release);
+    }
+
+    mSamples += nFrames;
+  }
+
+  // Any thread. Block counts per bin; bin i covers [i, i + 1) / kBinsPerUnit of the budget.
+  void GetHistogram(uint64_t (&bins)[kNumBins]) const
+  {
+    for (int i = 0; i < kNumBins; i++) bins[i] = mBins[i].load(std::memory_order_relaxed);
+  }
+
+  // Any thread. Total overruns so far, including those no longer in the ring.
+  uint64_t GetOverrunCount() const
+  {
+    return mOverruns.load(std::memory_order_acquire);
+  }
+
+  // Any thread. Copies up to maxCount of the most recent overruns, oldest first.
+  // Returns the number copied; entries overwritten while being read are skipped.
+  int GetRecentOverruns(LoudNESOverrun* out, int maxCount) const
+  {
+    uint64_t end = mOverruns.load(std::memory_order_acquire);
+    uint64_t count = min((uint64_t) min(maxCount, kRingSize), end);
+    int copied = 0;
+    for (uint64_t n = end - count; n < end; n++) {
+      const Slot& slot = mRing[n % kRingSize];
+      if (slot.seq.load(std::memory_order_acquire) != 2 * n + 2) continue;
+      LoudNESOverrun overrun = slot.overrun;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != 2 * n + 2) continue;
+      out[copied++] = overrun;
+    }
+    return copied;
+  }
+
+  // Any thread. Writes the histogram and recent overruns as CSV sections.
+  bool WriteReport(const char* path) const
+  {
+    FILE* fp = fopen(path, "w");
+    if (!fp) return false;
+
+    uint64_t bins[kNumBins];
+    GetHistogram(bins);
+    fprintf(fp, "# utilization histogram\nfrom_pct,to_pct,blocks\n");
+    for (int i = 0; i < kNumBins; i++) {
+      if (i == kNumBins - 1) fprintf(fp, "%d,,%llu\n", i * 100 / kBinsPerUnit, (unsigned long long) bins[i]);
+      else fprintf(fp, "%d,%d,%llu\n", i * 100 / kBinsPerUnit, (i + 1) * 100 / kBinsPerUnit, (unsigned long long) bins[i]);
+    }
+
+    LoudNESOverrun overruns[kRingSize];
+    int n = GetRecentOverruns(overruns, kRingSize);
+    fprintf(fp, "\n# overruns: %llu total, most recent %d listed\n", (unsigned long long) GetOverrunCount(), n);
+    fprintf(fp, "seconds,sample_time,block_size,utilization_pct,note_ons,after_state_load\n");
+    for (int i = 0; i < n; i++) {
+      const LoudNESOverrun& o = overruns[i];
+      fprintf(fp, "%.3f,%llu,%d,%.1f,%d,%d\n", o.seconds, (unsigned long long) o.sampleTime, o.blockSize,
+              o.utilization * 100., o.noteOns, o.afterStateLoad ? 1 : 0);
+    }
+
+    return fclose(fp) == 0;
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> seq{0};
+    LoudNESOverrun overrun;
+  };
+
+  const std::chrono::steady_clock::time_point mStartTime;
+  uint64_t mSamples = 0;  // audio thread only
+  std::atomic<uint64_t> mBins[kNumBins] = {};
+  std::atomic<uint64_t> mOverruns{0};
+  Slot mRing[kRingSize];
+};
@@ -1,9 +1,17 @@
 #pragma once
 
-#include "MidiSynth.h"
+#include "IPlugMidi.h"
+#include "LoudNES_Params.h"
+#include "LoudNES_CpuStats.h"
+#include "LoudNES_WorkerPool.h"
 #include "NesApu.h"
-#include "NesVoice.h"
 #include "NesDpcm.h"
+#include "NesEngine.h"
+#include "NesMidiDispatcher.h"
+#include "NesVoiceAllocator.h"
+#include "NesSndEmu/Vgm_File.h"
+#include "NesSndEmu/nes_apu/apu_snapshot.h"
+#include <atomic>
 
 using namespace iplug;
 
@@ -12,45 +20,40 @@ class LoudNESDSP
 {
 public:
 #pragma mark -
-  LoudNESDSP()
+  // Poly mode renders on up to maxRenderWorkers threads besides the audio thread,
+  // started when it's switched on
+  explicit LoudNESDSP(int maxRenderWorkers = LoudNESWorkerPool::DefaultWorkers(kMaxPolyVoices))
+  : mMaxWorkers(maxRenderWorkers)
   {
-      shared_ptr<Simple_Apu> nesApu = mNesApu = make_shared<Simple_Apu>();
       shared_ptr<NesDpcm> nesDpcm = make_shared<NesDpcm>();
 
-      NesApu::InitializeNoteTables(); // TODO: kill this singleton stuff
-      NesApu::InitAndReset(nesApu, 44100, NesApu::APU_EXPANSION_VRC6, 0, nullptr);
-      nesApu->dmc_reader([](void* nesDpcm_, cpu_addr_t addr) -> int {
-        return static_cast<NesDpcm*>(nesDpcm_)->GetSampleForAddress(addr - 0xc000);
-      }, nesDpcm.get());
-
-      mNesChannels = make_shared<NesChannels>(
-        NesChannelPulse(nesApu,     NesApu::Channel::Pulse1,      NesEnvelopes()),
-        NesChannelPulse(nesApu,     NesApu::Channel::Pulse2,      NesEnvelopes()),
-        NesChannelTriangle(nesApu,  NesApu::Channel::Triangle,    NesEnvelopes()),
-        NesChannelNoise(nesApu,     NesApu::Channel::Noise,       NesEnvelopes()),
-        NesChannelDpcm(nesApu,      NesApu::Channel::Dpcm,        nesDpcm),
-        NesChannelVrc6Pulse(nesApu, NesApu::Channel::Vrc6Pulse1,  NesEnvelopes()),
-        NesChannelVrc6Pulse(nesApu, NesApu::Channel::Vrc6Pulse2,  NesEnvelopes()),
-        NesChannelVrc6Saw(nesApu,   NesApu::Channel::Vrc6Saw,     NesEnvelopes())
-      );
-      SetActiveChannel(NesApu::Channel::Pulse1);
-
-      for (int i = 0; i < mNesChannels->numChannels; i++) {
-        auto channelVoice = new NesVoice<T>(nesApu, mNesChannels->allChannels[i]);
-        auto channelSynth = new MidiSynth(VoiceAllocator::kPolyModeMono, MidiSynth::kDefaultBlockSize);
-        mChannelSynths.emplace_back(channelSynth);
-        mChannelSynths[i]->AddVoice(channelVoice, 0);
+      // The first engine is the one edited, saved and played in mono mode. The rest
+      // only play in poly mode, and sleep until they get a note.
+      for (int i = 0; i < kMaxPolyVoices; i++) {
+        mEngines[i] = make_unique<NesEngine>(nesDpcm);
+        if (i) {
+          mEngines[i]->channels->ShareEnvelopes(*mEngines[0]->channels);
+          mEngines[i]->asleep = true;
+        }
       }
+      shared_ptr<Simple_Apu> nesApu = mNesApu = mEngines[0]->apu;
+      mNesChannels = mEngines[0]->channels;
+      mDispatcher = make_unique<NesMidiDispatcher>(*mEngines[0]);
+      nesApu->enable_cpu_stats(true);
+      SetActiveChannel(NesApu::Channel::Pulse1);
 
-      // TODO: Paraphonic mode? (one synth with several voices; assign each voice to a different NES channel)
-
-      // TODO: Portamento?
-      // mSynth.SetNoteGlideTime(0.5); // portamento
+      // Paraphonic pool defaults to the pulse channels, as the plugin's params do
+      mParaMember[NesApu::Channel::Pulse1] = mParaMember[NesApu::Channel::Pulse2] = true;
+      mParaMember[NesApu::Channel::Vrc6Pulse1] = mParaMember[NesApu::Channel::Vrc6Pulse2] = true;
+      UpdateParaPool();
+      for (int ch = 0; ch < kNumChannels; ch++) mStagedParaMembers |= (unsigned) mParaMember[ch] << ch;
+      for (auto& gains : mPanGains) gains[0] = gains[1] = 1.f;
   }
 
   void SetActiveChannel(NesApu::Channel channel) {
     for (auto ch : mNesChannels->allChannels) {
       if (ch->mChannel == channel) {
+        mActiveChannel = ch;
         mNesEnvelope1 = &(ch->mEnvs.volume);
         mNesEnvelope2 = &(ch->mEnvs.duty);
         mNesEnvelope3 = &(ch->mEnvs.arp);
@@ -64,53 +67,157 @@ public:
 
 
   void SetChannelEnabled(NesApu::Channel channel, bool enabled) {
-    mNesApu->enable_channel(channel, enabled);
+    for (auto& engine : mEngines) engine->apu->enable_channel(channel, enabled);
+  }
+
+  // VGM capture. Start, Stop and Finish are called from the UI thread; the writer is
+  // attached to and detached from the APU by the audio thread at the top of ProcessBlock.
+  // A VGM file is one NES, so in poly mode only the first engine's voice is captured.
+  bool StartVgmCapture() {
+    if (mVgmState != kVgmIdle) return false;
+    if (mVgmWriter.start(1789773)) return false;
+
+    vector<char> dmc = mNesChannels->dpcm.mNesDpcm->GetSampleMemory();
+    if (!dmc.empty()) mVgmWriter.add_dmc_block(0xc000, dmc.data(), (long) dmc.size());
+
+    mVgmState = kVgmStarting;
+    return true;
+  }
+
+  void StopVgmCapture() {
+    int recording = kVgmRecording;
+    if (!mVgmState.compare_exchange_strong(recording, kVgmStopping)) {
+      int starting = kVgmStarting;
+      mVgmState.compare_exchange_strong(starting, kVgmStopping);
+    }
+  }
+
+  // Writes the captured file once the audio thread has let go of the writer.
+  // A null path discards the capture.
+  bool FinishVgmCapture(const char* path) {
+    if (mVgmState != kVgmStopped) return false;
+    if (!path) {
+      mVgmState = kVgmIdle;
+      return false;
+    }
+    blargg_err_t err = mVgmWriter.end(path);
+    if (err) printf("VGM capture failed: %s\n", err);
+    else if (mVgmWriter.dropped_writes()) printf("VGM capture dropped %ld expansion writes\n", mVgmWriter.dropped_writes());
+    mVgmState = kVgmIdle;
+    return !err;
+  }
+
+  bool IsVgmCapturing() const {
+    return mVgmState != kVgmIdle;
+  }
+
+  // Stopped, and ready for FinishVgmCapture
+  bool IsVgmStopped() const {
+    return mVgmState == kVgmStopped;
+  }
+
+  // CPU accounting for this instance, for the diagnostics display and headless tools.
+  // Safe to call from any thread.
+  void GetCpuStats(LoudNESCpuStats& stats) const {
+    mCpuMeter.Get(stats);
   }
 
   void ProcessBlock(T** inputs, T** outputs, int nOutputs, int nFrames, double qnPos = 0., bool transportIsRunning = false, double tempo = 120.)
   {
+    NES_TRACE_SCOPE("LoudNESDSP::ProcessBlock");
+    host_ticks_t blockStart = read_host_ticks();
+    uint64_t ticks[kNumCpuCounters] = {};
+
     // clear outputs
     for(auto i = 0; i < nOutputs; i++)
     {
       memset(outputs[i], 0, nFrames * sizeof(T));
     }
+    if (!mMaxFrames) return;  // not Reset yet, so there's nowhere to render
 
-    for (auto &synth : mChannelSynths) {
-      synth->ProcessBlock(nullptr, outputs, 0, nOutputs, nFrames);
-    }
-
-    while (mNesApu->samples_avail() < nFrames) {
-      for (auto channel : mNesChannels->allChannels) {
-        channel->UpdateAPU();
-      }
-      // TODO: this updates the APU state at 60 hz, introducing jitter and up to 16ms latency. acceptable?
-      mNesApu->end_frame();
+    // A block longer than Reset allowed for is rendered in chunks that fit the buffers
+    T* chunkOutputs[kMaxOutputs];
+    nOutputs = min(nOutputs, (int) kMaxOutputs);
+    for (int start = 0; start < nFrames; start += mMaxFrames) {
+      for (int i = 0; i < nOutputs; i++) chunkOutputs[i] = outputs[i] + start;
+      const double chunkQnPos = qnPos + start * tempo / (60. * mSampleRate);
+      ProcessChunk(chunkOutputs, nOutputs, start, min(nFrames - start, mMaxFrames), chunkQnPos, transportIsRunning, tempo, ticks);
     }
+    mDispatcher->EndBlock();
+    for (auto& engine : mEngines) engine->mpe.EndBlock(mMpeQueue);
+    mMpeQueue.EndBlock();
 
-    mNesApu->read_samples(mNesBuffer, nFrames);
-    for (int i = 0; i < nFrames; i++) {
-      int idx = i;
-      T smpl = mNesBuffer[i] / 32767.0;
-      outputs[0][idx] += smpl;
-      outputs[1][idx] += smpl;
-    }
+    ticks[kCpuProcess] = read_host_ticks() - blockStart;
+    mCpuMeter.AddBlock(ticks, *mNesApu, nFrames, mSampleRate);
   }
 
-  void Reset(double sampleRate, int blockSize)
+  // Outputs past the main pair are a pair per NES channel, in channel order, for as
+  // many as the host has connected. Any at all split every engine's output by channel,
+  // as does panning; see UpdateSplit.
+  void Reset(double sampleRate, int blockSize, int nOutputs = 2)
   {
-    for (auto &synth : mChannelSynths) {
-      synth->SetSampleRateAndBlockSize(sampleRate, blockSize);
-      synth->Reset();
+    if (sampleRate != mSampleRate || blockSize != mBlockSize) {
+      mSampleRate = sampleRate;
+      mBlockSize = blockSize;
+      mMaxFrames = clamp(blockSize, 1, (int) kMaxChunkFrames);
+      mMixBuffer.assign(mMaxFrames, 0);
+      mMixLeft.assign(mMaxFrames, 0.f);
+      mMixRight.assign(mMaxFrames, 0.f);
+      // enough for a chunk and the frame rendered past it, at the longest frame
+      const int splitMsec = (int) (1000. * mMaxFrames / sampleRate) + 50;
+      for (auto& engine : mEngines) {
+        NesApu::SetSampleRate(engine->apu, (int) sampleRate, NesApu::APU_EXPANSION_VRC6);
+        engine->AllocateBuffers(mMaxFrames);
+        engine->apu->reserve_split_outputs(splitMsec);
+        engine->apu->reserve_nonlinear_mixing();
+        engine->nextTick = 0.;
+      }
     }
+
+    ApplyStagedParams();
+    mChannelOutputs = clamp((nOutputs - 2) / 2, 0, kNumChannels);
+    mSplit = NeedsSplit();
+    mSplitPending = false;
+    for (auto& engine : mEngines) engine->apu->split_outputs(mSplit);
+
+    mDispatcher->Reset();
   }
 
   void ProcessMidiMsg(const IMidiMsg& msg)
   {
-    if (mOmniMode) {
-      for (auto synth : mChannelSynths) synth->AddMidiMsgToQueue(msg);
-    } else if (msg.Channel() < mNesChannels->numChannels) {
-      mChannelSynths[msg.Channel()]->AddMidiMsgToQueue(msg);
+    // MPE member channels' bend and pressure follow their notes; the rest is as in omni mode
+    if (mMpe && mMpeQueue.AddMidiMsg(msg)) return;
+    const bool omni = mOmniMode || mMpe;
+
+    if (mPolyVoices > 1) {
+      if (omni) {
+        for (int ch = 0; ch < mNesChannels->numChannels; ch++) ProcessPolyMidiMsg(msg, ch);
+      } else if (msg.Channel() < mNesChannels->numChannels) {
+        ProcessPolyMidiMsg(msg, msg.Channel());
+      }
+      return;
     }
+
+    // The paraphonic pool takes the MIDI channel of its first NES channel
+    if (ParaActive() && (omni || msg.Channel() == mParaChannels[0])) ProcessParaMidiMsg(msg);
+
+    mDispatcher->AddMidiMsg(msg);
+  }
+
+  // Pan from -1 (left) to 1 (right). Centered, a channel is at full level on both
+  // sides, as unpanned; panning turns the far side down, so nothing gets louder.
+  void SetPan(int ch, double pan) {
+    mPanGains[ch][0] = (float) min(1., 1. - pan);
+    mPanGains[ch][1] = (float) min(1., 1. + pan);
+    // splitting doesn't allocate, so ProcessBlock can follow the pan; going back waits
+    // for Reset, as the channels' buffers still hold the tails of what they played
+    if (!mSplit && mBlockSize && NeedsSplit()) mSplitPending = true;
+  }
+
+  // Pitch wheel range, for every mode
+  void SetPitchBendRange(int semitones) {
+    mPitchBendSemitones = semitones;
+    mDispatcher->SetPitchBendRange(semitones);
   }
 
   void SetParam(int paramIdx, double value)
@@ -125,17 +232,24 @@ public:
           SetChannelEnabled(NesApu::Channel(ch), value > 0.5);
           break;
         case kParamChVelSens:
-          mNesChannels->allChannels[ch]->SetVelSens(value > 0.5);
+          for (auto& engine : mEngines) engine->channels->allChannels[ch]->SetVelSens(value > 0.5);
           break;
         case kParamChLegato:
-          mChannelSynths[ch]->SetLegato(value > 0.5);
+          mDispatcher->SetLegato(ch, value > 0.5);
           break;
         case kParamChKeyTrack:
-          mNesChannels->allChannels[ch]->SetKeyTrack(value > 0.5);
+          for (auto& engine : mEngines) engine->channels->allChannels[ch]->SetKeyTrack(value > 0.5);
+          break;
+        case kParamChParaphonic:
+          if (value > 0.5) mStagedParaMembers |= 1u << ch;
+          else mStagedParaMembers &= ~(1u << ch);
+          break;
+        case kParamChPan:
+          SetPan(ch, value / 100.);
           break;
         default:
-          int env = (param - 4) / 4;
-          int envParam = (param - 4) % 4;
+          int env = (param - kParamEnv1LoopPoint) / kNumEnvParams;
+          int envParam = (param - kParamEnv1LoopPoint) % kNumEnvParams;
           auto nesEnv = mNesChannels->allChannels[ch]->mEnvs.allEnvs[env];
           switch(envParam) {
             case kParamEnvLoopPoint:
@@ -159,12 +273,36 @@ public:
 
     switch (paramIdx) {
       case kParamNoteGlideTime:
-        for (auto synth : mChannelSynths) synth->SetNoteGlideTime(value / 1000.);
+        mDispatcher->SetGlideTime(value / 1000.);
         break;
 
       case kParamOmniMode:
         mOmniMode = value > 0.5;
-        for (auto synth : mChannelSynths) synth->Reset();
+        mDispatcher->SetOmni(mOmniMode || mMpe);
+        break;
+
+      case kParamMpe:
+        mStagedMpe = value > 0.5;
+        break;
+
+      case kParamNonlinearMix:
+        // applied by ApplyStagedParams, into the mixer buffers Reset reserved
+        mNonlinearMix = value > 0.5;
+        break;
+
+      case kParamTickRate:
+        mStagedTickRate = clamp((int) value, 0, kNumTickRates - 1);
+        break;
+
+      case kParamPolyVoices:
+        mStagedPolyVoices = clamp((int) value, 1, kMaxPolyVoices);
+        // a worker per voice besides the audio thread's, started and stopped here as
+        // the audio thread mustn't
+        mWorkers.SetWorkers(min(mStagedPolyVoices - 1, mMaxWorkers));
+        break;
+
+      case kParamParaMode:
+        mStagedParaMode = clamp((int) value, 0, kNumParaModes - 1);
         break;
 
       default:
@@ -172,7 +310,439 @@ public:
     }
   }
   
+private:
+  enum EVgmState {
+    kVgmIdle = 0,
+    kVgmStarting,
+    kVgmRecording,
+    kVgmStopping,
+    kVgmStopped
+  };
+
+  static constexpr double kNtscClockRate = 1789773.;
+  static constexpr double kNtscFrameClocks = 29780.5;  // Simple_Apu::end_frame() average
+  // Room left in a frame for a tick's writes; a free-running tick closer to the end waits for the next frame
+  static constexpr int kTickSlackClocks = 512;
+  // Poly mode: how long an idle pool engine renders before it sleeps
+  static constexpr double kSleepSeconds = 1.;
+  // Longest chunk ProcessBlock renders at once, which bounds the buffers Reset allocates
+  enum { kMaxChunkFrames = 8192 };
+  // The main pair, then a pair per channel
+  enum { kMaxOutputs = 2 + 2 * kNumChannels };
+
+  // Timeline event names (see NesSndEmu/nes_apu/Nes_Trace.h), which must be static
+  static constexpr const char* kTraceUpdateNames[kNumChannels] = {
+    "UpdateAPU Pulse 1", "UpdateAPU Pulse 2", "UpdateAPU Triangle", "UpdateAPU Noise",
+    "UpdateAPU DPCM", "UpdateAPU VRC6 Pulse 1", "UpdateAPU VRC6 Pulse 2", "UpdateAPU VRC6 Saw"
+  };
+
+  // NTSC CPU clocks per tick, by free-running ETickRate
+  static constexpr double kTickPeriods[kNumFreeTickRates] = {
+    kNtscClockRate / 50., kNtscFrameClocks, kNtscFrameClocks / 2., kNtscFrameClocks / 4.
+  };
+
+  // Ticks per beat, by synced ETickRate from kTickRateSync16
+  static constexpr double kSyncedTicksPerBeat[kNumTickRates - kNumFreeTickRates] = {4., 6., 8., 12.};
+
+  // Params that reconfigure the engines are staged by SetParam, and applied here by
+  // the audio thread between blocks, rather than under the engines as they render
+  void ApplyStagedParams() {
+    const int tickRate = mStagedTickRate;
+    if (tickRate != mTickRate) SetTickRate(tickRate);
+    SetMpe(mStagedMpe);
+    SetPolyVoices(mStagedPolyVoices);
+
+    const int paraMode = mStagedParaMode;
+    const unsigned paraMembers = mStagedParaMembers;
+    bool paraChanged = paraMode != mParaMode;
+    for (int ch = 0; ch < kNumChannels; ch++) {
+      const bool member = (paraMembers >> ch) & 1;
+      paraChanged |= member != mParaMember[ch];
+      mParaMember[ch] = member;
+    }
+    mParaMode = paraMode;
+    if (paraChanged) UpdateParaPool();
+
+    const bool nonlinear = mNonlinearMix;
+    if (nonlinear != mNesApu->nonlinear_mixing()) {
+      for (auto& engine : mEngines) engine->apu->nonlinear_mixing(nonlinear);
+    }
+    if (mSplitPending.exchange(false) && !mSplit) {
+      mSplit = true;
+      for (auto& engine : mEngines) engine->apu->split_outputs(true);
+    }
+  }
+
+  void SetTickRate(int rate) {
+    mTickRate = clamp(rate, 0, kNumTickRates - 1);
+    if (mTickRate < kNumFreeTickRates) mTickPeriod = kTickPeriods[mTickRate];
+    for (auto& engine : mEngines) engine->tickBeatValid = false;
+  }
+
+  // Synced tick rates: the period follows the tempo
+  void SetSyncedTickPeriod(double tempo) {
+    const double ticksPerBeat = kSyncedTicksPerBeat[mTickRate - kNumFreeTickRates];
+    mSamplesPerBeat = mSampleRate * 60. / max(tempo, 1.);
+    mTickPeriod = mSamplesPerBeat / ticksPerBeat * mNesApu->clocks_per_sample();
+    mBeatsPerTick = 1. / ticksPerBeat;
+  }
+
+  // Synced tick rates: while the transport runs, places the engine's next tick on
+  // the beat grid. The grid position carries over from block to block, so a tick
+  // deferred past a block's end still happens, and is only taken from qnPos again
+  // after a locate or loop. With the transport stopped, ticks free-run at the tempo.
+  // Needs every frame ended at a block end.
+  void PlaceSyncedTick(NesEngine& engine, double qnPos, bool transportIsRunning) {
+    if (!transportIsRunning) {
+      engine.tickBeatValid = false;
+      return;
+    }
+    if (!engine.tickBeatValid || fabs(engine.nextTickBeat - qnPos) > mBeatsPerTick) {
+      engine.nextTickBeat = ceil(qnPos / mBeatsPerTick - 1e-6) * mBeatsPerTick;
+      engine.tickBeatValid = true;
+    }
+    // buffered samples come first in the block; the current frame starts after them
+    const double samples = (engine.nextTickBeat - qnPos) * mSamplesPerBeat - engine.apu->samples_avail();
+    engine.nextTick = samples * engine.apu->clocks_per_sample();
+  }
+
+  // Renders nFrames from 'start' frames into the host's block, which MIDI offsets count from
+  void ProcessChunk(T** outputs, int nOutputs, int start, int nFrames, double qnPos, bool transportIsRunning, double tempo,
+                    uint64_t (&ticks)[kNumCpuCounters])
+  {
+    ApplyStagedParams();
+
+    UpdateVgmCapture();
+
+    const bool synced = mTickRate >= kNumFreeTickRates;
+    if (synced) SetSyncedTickPeriod(tempo);
+
+    // Awake engines render in parallel on the worker pool, each into its own buffer
+    int numAwake = 0;
+    for (int e = 0; e < mPolyVoices; e++) {
+      if (!mEngines[e]->asleep) mAwakeEngines[numAwake++] = e;
+    }
+    auto render = [&](int job) {
+      NesEngine& engine = *mEngines[mAwakeEngines[job]];
+      uint64_t (&engineTicks)[kNumCpuCounters] = mEngineTicks[job];
+      memset(engineTicks, 0, sizeof engineTicks);
+      // in mono mode the first engine plays the dispatcher's queued messages as it ticks
+      NesMidiDispatcher* dispatcher = mPolyVoices == 1 ? mDispatcher.get() : nullptr;
+      RenderEngine(engine, start, nFrames, synced, qnPos, transportIsRunning, dispatcher, engineTicks);
+      engine.ReadSamples(nFrames);
+    };
+    mWorkers.Run(numAwake, render);
+
+    // then are summed in engine order, so the mix is the same whichever thread
+    // rendered what, and converted once. Unsplit, that's as integers, into both sides.
+    // Split, each channel is panned into the sums, and into its own output pair if it
+    // has one, alongside what was mixed before the split.
+    const bool split = mSplit;
+    const int channelOutputs = min(mChannelOutputs, (nOutputs - 2) / 2);
+    for (int job = 0; job < numAwake; job++) {
+      NesEngine& engine = *mEngines[mAwakeEngines[job]];
+      if (!split) {
+        if (job == 0) {
+          for (int i = 0; i < nFrames; i++) mMixBuffer[i] = engine.buffer[i];
+        } else {
+          for (int i = 0; i < nFrames; i++) mMixBuffer[i] += engine.buffer[i];
+        }
+      } else {
+        if (job == 0) {
+          for (int i = 0; i < nFrames; i++) mMixLeft[i] = mMixRight[i] = engine.buffer[i];
+        } else {
+          AddPanned(engine.buffer.data(), 1.f, 1.f, mMixLeft.data(), mMixRight.data(), nFrames);
+        }
+        if (engine.apu->outputs_split()) {
+          for (int ch = 0; ch < kNumChannels; ch++) {
+            const int16_t* in = engine.channelBuffers[ch].data();
+            AddPanned(in, mPanGains[ch][0], mPanGains[ch][1], mMixLeft.data(), mMixRight.data(), nFrames);
+            if (ch < channelOutputs) {
+              AddPanned(in, mPanGains[ch][0] / 32767.f, mPanGains[ch][1] / 32767.f, outputs[2 + 2 * ch], outputs[3 + 2 * ch], nFrames);
+            }
+          }
+        }
+      }
+      for (int c = 0; c < kNumCpuCounters; c++) ticks[c] += mEngineTicks[job][c];
+      if (mAwakeEngines[job]) UpdateSleep(engine, nFrames);
+    }
+
+    if (!split) {
+      for (int i = 0; i < nFrames; i++) {
+        int idx = i;
+        T smpl = mMixBuffer[i] / 32767.0;
+        outputs[0][idx] += smpl;
+        outputs[1][idx] += smpl;
+      }
+    } else {
+      for (int i = 0; i < nFrames; i++) outputs[0][i] += mMixLeft[i] / 32767.0;
+      for (int i = 0; i < nFrames; i++) outputs[1][i] += mMixRight[i] / 32767.0;
+    }
+  }
+
+  // Runs an engine's APU frames until it has a block of samples. The APU runs in
+  // frames of about 1/60 s whatever the tick rate. Ticks fall at their own clock
+  // times within frames, and their writes are queued and applied at frame end, so
+  // faster ticks don't add frames. When synced, the last frame ends with the block,
+  // so the next block's ticks land on its own samples.
+  void RenderEngine(NesEngine& engine, int start, int nFrames, bool synced, double qnPos, bool transportIsRunning,
+                    NesMidiDispatcher* dispatcher, uint64_t (&ticks)[kNumCpuCounters]) {
+    Simple_Apu& apu = *engine.apu;
+    if (synced) PlaceSyncedTick(engine, qnPos, transportIsRunning);
+
+    while (apu.samples_avail() < nFrames) {
+      NES_TRACE_SCOPE("frame");
+      int frameLength = apu.next_frame_length();
+      if (synced) frameLength = min(frameLength, apu.count_clocks(nFrames));
+      // buffered samples come first in the block; the frame starts after them
+      const long frameSample = apu.samples_avail();
+      for (;;) {
+        const int time = max((int) floor(engine.nextTick + 0.5), 0);
+        if (time >= frameLength - kTickSlackClocks) {
+          // A synced tick stretches the frame to fit its writes, rather than wait
+          if (!synced || time >= frameLength) break;
+          frameLength = time + kTickSlackClocks;
+        }
+        apu.set_clock(time);
+        const double sample = start + frameSample + time / apu.clocks_per_sample();
+        if (dispatcher) {
+          dispatcher->ProcessUntil(sample);
+          dispatcher->Tick(mTickPeriod / kNtscClockRate);
+        }
+        if (mMpe) ApplyMpe(engine, sample);
+        Tick(engine, ticks);
+        engine.nextTick += mTickPeriod;
+        engine.nextTickBeat += mBeatsPerTick;
+      }
+      // TODO: this updates the APU state at 60 hz, introducing jitter and up to 16ms latency. acceptable?
+      if (synced) apu.end_frame(frameLength);
+      else apu.end_frame();
+      engine.nextTick -= frameLength;
+    }
+  }
+
+  // One engine tick: step the envelopes, then have each channel write the APU
+  void Tick(NesEngine& engine, uint64_t (&ticks)[kNumCpuCounters]) {
+    engine.channels->envelopes.Tick();
+    engine.channels->ForEach([&ticks](auto& channel) {
+      const int i = channel.mChannel;
+      NES_TRACE_SCOPE(kTraceUpdateNames[i]);
+      host_ticks_t start = read_host_ticks();
+      channel.UpdateAPU();
+      ticks[kCpuChannelBase + i] += read_host_ticks() - start;
+    });
+  }
+
+  // Poly mode: each NES channel deals its notes out to the engines, one voice each
+  void ProcessPolyMidiMsg(const IMidiMsg& msg, int ch) {
+    NesVoiceAllocator& allocator = mPolyAllocators[ch];
+    const int key = msg.NoteNumber();
+    switch (msg.StatusMsg()) {
+      case IMidiMsg::kNoteOn:
+        if (msg.Velocity()) {
+          const bool sounding = allocator.IsSounding(key);
+          int stolenKey;
+          NesEngine& engine = *mEngines[allocator.NoteOn(key, stolenKey)];
+          if (!sounding && stolenKey < 0) engine.heldNotes++;
+          engine.Wake();
+          if (mMpe) engine.mpe.StartNote(ch, msg.Channel(), mMpeQueue);
+          engine.channels->allChannels[ch]->Trigger(key, msg.Velocity() / 127., true);
+          break;
+        }
+        // note on with zero velocity is note off
+        // fall through
+      case IMidiMsg::kNoteOff: {
+        const int voice = allocator.NoteOff(key);
+        if (voice >= 0) {
+          mEngines[voice]->channels->allChannels[ch]->Release();
+          mEngines[voice]->heldNotes--;
+        }
+        break;
+      }
+      case IMidiMsg::kPitchWheel:
+        for (auto& engine : mEngines) {
+          engine->channels->allChannels[ch]->SetPitchBend(msg.PitchWheel() * mPitchBendSemitones / 12.);
+        }
+        break;
+      case IMidiMsg::kControlChange:
+        if (msg.ControlChangeIdx() == IMidiMsg::kAllNotesOff) {
+          for (int voice = 0; voice < allocator.NumVoices(); voice++) {
+            const int sounding = allocator.GetKey(voice);
+            if (sounding >= 0) {
+              allocator.NoteOff(sounding);
+              mEngines[voice]->channels->allChannels[ch]->Release();
+              mEngines[voice]->heldNotes--;
+            }
+          }
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Extra outputs or any panning need the engines' outputs split by channel
+  bool NeedsSplit() const {
+    if (mChannelOutputs > 0) return true;
+    for (auto& gains : mPanGains) {
+      if (gains[0] != 1.f || gains[1] != 1.f) return true;
+    }
+    return false;
+  }
+
+  // Adds a block into the stereo sums at a gain for each side. Plain loops over
+  // contiguous arrays, which the compiler vectorizes.
+  template<typename S>
+  static void AddPanned(const int16_t* in, float gainLeft, float gainRight, S* left, S* right, int nFrames) {
+    for (int i = 0; i < nFrames; i++) left[i] += in[i] * gainLeft;
+    for (int i = 0; i < nFrames; i++) right[i] += in[i] * gainRight;
+  }
+
+  // Pool engines sleep once they've been silent for a while
+  void UpdateSleep(NesEngine& engine, int nFrames) {
+    if (engine.heldNotes || !engine.channels->envelopes.AllOff()) {
+      engine.idleSeconds = 0.;
+    } else {
+      engine.idleSeconds += nFrames / mSampleRate;
+      if (engine.idleSeconds >= kSleepSeconds) engine.asleep = true;
+    }
+  }
+
+  // Voices switch between the mono synths and the poly allocators, so every note is released
+  void SetPolyVoices(int voices) {
+    voices = clamp(voices, 1, kMaxPolyVoices);
+    if (voices == mPolyVoices) return;
+    for (int e = 0; e < kMaxPolyVoices; e++) {
+      for (auto channel : mEngines[e]->channels->allChannels) channel->ReleaseHeld();
+      mEngines[e]->heldNotes = 0;
+      if (e >= voices) mEngines[e]->asleep = e > 0;
+    }
+    mDispatcher->Reset();
+    for (auto& allocator : mPolyAllocators) allocator.Reset(voices);
+    mPolyVoices = voices;
+    UpdateParaPool();
+  }
+
+  // Paraphonic mode: one MIDI channel's notes are dealt out to several NES channels
+  // of the first engine, for chords from one NES. Only with 1 voice.
+  bool ParaActive() const {
+    return mParaMode != kParaOff && mNumParaChannels > 0 && mPolyVoices == 1;
+  }
+
+  bool IsParaChannel(int ch) const {
+    return ParaActive() && mParaMember[ch];
+  }
+
+  // Rebuilds the pool after a change of mode or members; its notes, and any held on
+  // channels joining or leaving it, are released
+  void UpdateParaPool() {
+    static const NesVoiceAllocator::EPolicy kParaPolicies[kNumParaModes] = {
+      NesVoiceAllocator::kOldestSteal,  // off
+      NesVoiceAllocator::kRoundRobin,
+      NesVoiceAllocator::kOldestSteal,
+      NesVoiceAllocator::kLowestNote
+    };
+    for (int i = 0; i < mNumParaChannels; i++) ParaChannel(i)->ReleaseHeld();
+    mNumParaChannels = 0;
+    for (int ch = 0; ch < mNesChannels->numChannels; ch++) {
+      if (mParaMember[ch]) {
+        mParaChannels[mNumParaChannels++] = ch;
+        mNesChannels->allChannels[ch]->ReleaseHeld();
+      }
+    }
+    mParaAllocator.Reset(max(mNumParaChannels, 1), kParaPolicies[mParaMode]);
+    for (int ch = 0; ch < mNesChannels->numChannels; ch++) mDispatcher->SetChannelEnabled(ch, !IsParaChannel(ch));
+  }
+
+  void ProcessParaMidiMsg(const IMidiMsg& msg) {
+    const int key = msg.NoteNumber();
+    switch (msg.StatusMsg()) {
+      case IMidiMsg::kNoteOn:
+        if (msg.Velocity()) {
+          int stolenKey;
+          const int voice = mParaAllocator.NoteOn(key, stolenKey);
+          if (voice >= 0) {
+            if (mMpe) mEngines[0]->mpe.StartNote(mParaChannels[voice], msg.Channel(), mMpeQueue);
+            ParaChannel(voice)->Trigger(key, msg.Velocity() / 127., true);
+          }
+          break;
+        }
+        // note on with zero velocity is note off
+        // fall through
+      case IMidiMsg::kNoteOff: {
+        const int voice = mParaAllocator.NoteOff(key);
+        if (voice >= 0) ParaChannel(voice)->Release();
+        break;
+      }
+      case IMidiMsg::kPitchWheel:
+        for (int i = 0; i < mNumParaChannels; i++) {
+          ParaChannel(i)->SetPitchBend(msg.PitchWheel() * mPitchBendSemitones / 12.);
+        }
+        break;
+      case IMidiMsg::kControlChange:
+        if (msg.ControlChangeIdx() == IMidiMsg::kAllNotesOff) {
+          for (int voice = 0; voice < mNumParaChannels; voice++) {
+            const int sounding = mParaAllocator.GetKey(voice);
+            if (sounding >= 0) {
+              mParaAllocator.NoteOff(sounding);
+              ParaChannel(voice)->Release();
+            }
+          }
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // MPE mode: each channel plays the expression of the member channel its note came on
+  void SetMpe(bool enabled) {
+    if (enabled == mMpe) return;
+    mMpe = enabled;
+    mMpeQueue.Reset();
+    for (auto& engine : mEngines) {
+      engine->mpe.Reset();
+      for (auto channel : engine->channels->allChannels) channel->SetNoteExpression(NesMpeExpression());
+    }
+    mDispatcher->SetOmni(mOmniMode || mMpe);
+  }
+
+  void ApplyMpe(NesEngine& engine, double sample) {
+    NesMpeState& mpe = engine.mpe;
+    mpe.ProcessUntil(sample, mMpeQueue);
+    for (int ch = 0; ch < engine.channels->numChannels; ch++) {
+      if (mpe.sources[ch] >= 0) engine.channels->allChannels[ch]->SetNoteExpression(mpe.expressions[mpe.sources[ch]]);
+    }
+  }
+
+  NesChannel* ParaChannel(int voice) const {
+    return mNesChannels->allChannels[mParaChannels[voice]];
+  }
+
+  void UpdateVgmCapture() {
+    int state = mVgmState.load();
+    switch (state) {
+      case kVgmStarting: {
+        if (!mVgmState.compare_exchange_strong(state, kVgmRecording)) break;
+        // Register state from before the capture started
+        apu_snapshot_t snapshot;
+        mNesApu->save_snapshot(&snapshot);
+        for (int i = 0; i < 0x14; i++) mVgmWriter.log_write(0, 0x4000 + i, snapshot.w40xx[i]);
+        mVgmWriter.log_write(0, 0x4015, snapshot.w4015);
+        mNesApu->write_logger(&mVgmWriter);
+        break;
+      }
+      case kVgmStopping:
+        mNesApu->write_logger(nullptr);
+        mVgmState = kVgmStopped;
+        break;
+      default:
+        break;
+    }
+  }
+
 public:
+  NesChannel* mActiveChannel;
   NesEnvelope* mNesEnvelope1;
   NesEnvelope* mNesEnvelope2;
   NesEnvelope* mNesEnvelope3;
@@ -181,8 +751,51 @@ public:
   array<NesEnvelope*, 4>mNesEnvs;
 
   shared_ptr<NesChannels> mNesChannels;
-  vector<MidiSynth*> mChannelSynths;
+  unique_ptr<NesMidiDispatcher> mDispatcher;  // mono mode's MIDI, for the first engine
   shared_ptr<Simple_Apu> mNesApu;
-  int16_t mNesBuffer[32768];
-  bool mOmniMode;
+  unique_ptr<NesEngine> mEngines[kMaxPolyVoices];  // mNesApu and mNesChannels are the first's
+  NesVoiceAllocator mPolyAllocators[kNumChannels];
+  int mPolyVoices = 1;
+  int mParaMode = kParaOff;
+  bool mParaMember[kNumChannels] = {};
+  int mParaChannels[kNumChannels];  // members, in channel order; voice i plays mParaChannels[i]
+  int mNumParaChannels = 0;
+  NesVoiceAllocator mParaAllocator;
+  vector<int32_t> mMixBuffer;  // mMaxFrames long, as are the rest of the mix and engine buffers
+  int mChannelOutputs = 0;  // output pairs after the main one, see Reset
+  bool mSplit = false;      // engines' outputs are split by channel
+  // As set, for ApplyStagedParams
+  std::atomic<int> mStagedTickRate{kTickRate60};
+  std::atomic<int> mStagedPolyVoices{1};
+  std::atomic<int> mStagedParaMode{kParaOff};
+  std::atomic<unsigned> mStagedParaMembers{0};  // by bit
+  std::atomic<bool> mStagedMpe{false};
+  std::atomic<bool> mNonlinearMix{false};
+  std::atomic<bool> mSplitPending{false};  // panning needs a split, see SetPan
+  float mPanGains[kNumChannels][2];  // left, right
+  vector<float> mMixLeft;
+  vector<float> mMixRight;
+  int mBlockSize = 0;
+  int mMaxFrames = 0;  // per ProcessChunk, from the block size
+  LoudNESWorkerPool mWorkers;  // none until poly mode
+  int mMaxWorkers;
+  int mAwakeEngines[kMaxPolyVoices];
+  uint64_t mEngineTicks[kMaxPolyVoices][kNumCpuCounters];
+  bool mOmniMode = false;
+  bool mMpe = false;
+  NesMpeQueue mMpeQueue;
+  double mPitchBendSemitones = 2.;
+  double mSampleRate = 44100.;
+  int mTickRate = kTickRate60;
+  double mTickPeriod = kNtscFrameClocks;
+  double mBeatsPerTick = 0.;
+  double mSamplesPerBeat = 0.;
+  Vgm_Writer mVgmWriter;
+  std::atomic<int> mVgmState{kVgmIdle};
+  LoudNESCpuMeter mCpuMeter;
 };
+
+// Definitions of the constexpr tables odr-used above, which C++14 still needs
+template<typename T> constexpr const char* LoudNESDSP<T>::kTraceUpdateNames[];
+template<typename T> constexpr double LoudNESDSP<T>::kTickPeriods[];
+template<typename T> constexpr double LoudNESDSP<T>::kSyncedTicksPerBeat[];
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <utility>
+
+// Parameter layout shared by the plugin and LoudNES_DSP.h
+
+const int kNumChannels = 8;
+const int kMaxPolyVoices = 8;
+
+enum EEnvParams {
+  kParamEnvLoopPoint = 0,
+  kParamEnvRelPoint,
+  kParamEnvLength,
+  kParamEnvSpeedDiv,
+
+  kNumEnvParams
+};
+
+// Channel params must be used with ParamFromCh.
+enum EChParams {
+  kParamChEnabled = 0,
+  kParamChKeyTrack,
+  kParamChVelSens,
+  kParamChLegato,
+  // 16 envelope parameters, must be contiguous
+  kParamEnv1LoopPoint,
+  kParamEnv1RelPoint,
+  kParamEnv1Length,
+  kParamEnv1SpeedDiv,
+  kParamEnv2LoopPoint,
+  kParamEnv2RelPoint,
+  kParamEnv2Length,
+  kParamEnv2SpeedDiv,
+  kParamEnv3LoopPoint,
+  kParamEnv3RelPoint,
+  kParamEnv3Length,
+  kParamEnv3SpeedDiv,
+  kParamEnv4LoopPoint,
+  kParamEnv4RelPoint,
+  kParamEnv4Length,
+  kParamEnv4SpeedDiv,
+  // Added since the first release, and numbered after every channel's first
+  // params (see ParamFromCh), so saved states and automation keep their indices
+  kParamChParaphonic,
+  kParamChPan,
+
+  kNumChParams,
+  kNumFirstChParams = kParamChParaphonic,
+  kNumLaterChParams = kNumChParams - kNumFirstChParams
+};
+
+enum EParams
+{
+  kParamGain = 0,
+  kParamNoteGlideTime,
+  kParamOmniMode,
+  kParamChannelBase,
+  // Added since the first release, after the channels' first params; new params go last
+  kParamTickRate = kParamChannelBase + kNumFirstChParams * kNumChannels,
+  kParamPolyVoices,
+  kParamParaMode,
+  kParamMpe,
+  kParamNonlinearMix,
+  kParamLaterChannelBase,
+
+  kNumParams = kParamLaterChannelBase + kNumLaterChParams * kNumChannels
+};
+
+// Engine tick rates for kParamTickRate. Envelopes step, and channels write the APU,
+// once per tick; the speed divider still counts ticks. 60 Hz is the NTSC frame rate.
+// Synced rates are note divisions at the host tempo, locked to its beat position.
+enum ETickRate {
+  kTickRate50 = 0,
+  kTickRate60,
+  kTickRate120,
+  kTickRate240,
+  kTickRateSync16,
+  kTickRateSync16T,
+  kTickRateSync32,
+  kTickRateSync32T,
+
+  kNumTickRates,
+  kNumFreeTickRates = kTickRateSync16
+};
+
+// Paraphonic modes for kParamParaMode. One MIDI channel's notes are dealt out to the
+// channels with kParamChParaphonic set, chosen by NesVoiceAllocator's policies.
+enum EParaMode {
+  kParaOff = 0,
+  kParaRoundRobin,
+  kParaOldestSteal,
+  kParaLowestNote,
+
+  kNumParaModes
+};
+
+inline int ParamFromCh(int channelNum, int subParam) {
+  if (subParam < kNumFirstChParams) return kParamChannelBase + channelNum * kNumFirstChParams + subParam;
+  return kParamLaterChannelBase + channelNum * kNumLaterChParams + subParam - kNumFirstChParams;
+}
+
+inline std::pair<int, int> ResolveParamToChannelParam(int paramIdx) {
+  if (paramIdx >= kParamLaterChannelBase) {
+    int ch = (paramIdx - kParamLaterChannelBase) / kNumLaterChParams;
+    int param = (paramIdx - kParamLaterChannelBase) % kNumLaterChParams + kNumFirstChParams;
+    return {ch, param};
+  }
+  if (paramIdx >= kParamChannelBase && paramIdx < kParamTickRate) {
+    int ch = (paramIdx - kParamChannelBase) / kNumFirstChParams;
+    int param = (paramIdx - kParamChannelBase) % kNumFirstChParams;
+    return {ch, param};
+  }
+  return {-1, -1};
+}
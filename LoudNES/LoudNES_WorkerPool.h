@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Persistent threads that help the audio thread through a batch of independent jobs.
+//
+// Run() publishes a batch and then works on it itself, so a batch always finishes
+// even if no worker wakes in time: the audio thread only ever waits for jobs that a
+// worker has already started, and never blocks in the OS. Jobs are claimed from one
+// atomic word holding the batch's generation, size and next index, so a worker that
+// wakes late can't claim a job from a batch that has moved on.
+//
+// Between batches, workers park on a condition variable, so an idle pool costs no
+// CPU. A wakeup can be lost if a worker parks just as a batch is published; it then
+// sits that batch out and is woken by the next one.
+//
+// Workers are started and stopped by SetWorkers, off the audio thread, so a pool
+// only has threads while there's parallel work for them.
+class LoudNESWorkerPool
+{
+public:
+  // One thread short of the machine, as the audio thread works too
+  static int DefaultWorkers(int maxJobs)
+  {
+    const int cores = (int) std::thread::hardware_concurrency();
+    const int workers = cores < maxJobs ? cores - 1 : maxJobs - 1;
+    return workers > 0 ? workers : 0;
+  }
+
+  explicit LoudNESWorkerPool(int numWorkers = 0)
+  {
+    SetWorkers(numWorkers);
+  }
+
+  ~LoudNESWorkerPool()
+  {
+    SetWorkers(0);
+  }
+
+  LoudNESWorkerPool(const LoudNESWorkerPool&) = delete;
+  LoudNESWorkerPool& operator=(const LoudNESWorkerPool&) = delete;
+
+  // Any thread but the audio thread. Starts or stops workers to leave numWorkers;
+  // stopping waits for the jobs they've started to finish. Run can go on meanwhile.
+  void SetWorkers(int numWorkers)
+  {
+    std::lock_guard<std::mutex> resize(mResizeMutex);
+    const int current = (int) mThreads.size();
+    if (numWorkers == current) return;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mNumWorkers = numWorkers;
+    }
+    if (numWorkers > current) {
+      for (int i = current; i < numWorkers; i++) mThreads.emplace_back([this, i] { WorkerLoop(i); });
+    } else {
+      mWake.notify_all();
+      for (int i = numWorkers; i < current; i++) mThreads[i].join();
+      mThreads.resize(numWorkers);
+    }
+  }
+
+  int NumWorkers() const { return mNumWorkers.load(std::memory_order_relaxed); }
+
+  // Audio thread. Calls job(i) once for each i in [0, count), spread over the calling
+  // thread and any workers that are awake, and returns when all have finished. Jobs
+  // run in no particular order, so each should write only its own output.
+  template<typename Job>
+  void Run(int count, Job& job)
+  {
+    if (count <= 0) return;
+    if (NumWorkers() == 0 || count == 1) {
+      for (int i = 0; i < count; i++) job(i);
+      return;
+    }
+
+    mJob = [](void* context, int i) { (*static_cast<Job*>(context))(i); };
+    mContext = &job;
+    mDone.store(0, std::memory_order_relaxed);
+    mGeneration = (mGeneration + 1) & 0xffffffff;
+    if (mGeneration == Generation(kNoBatch)) mGeneration++;
+    mBatch.store(mGeneration << 32 | (uint64_t) count << 16, std::memory_order_seq_cst);
+    if (mParked.load(std::memory_order_seq_cst)) mWake.notify_all();
+
+    const uint64_t batch = mGeneration << 32 | (uint64_t) count << 16;
+    WorkOn(batch);
+    while (mDone.load(std::memory_order_acquire) < count) CpuRelax();
+  }
+
+private:
+  static constexpr uint64_t kNoBatch = 0;
+
+  static void CpuRelax()
+  {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+
+  static uint64_t Generation(uint64_t batch) { return batch >> 32; }
+  static int Count(uint64_t batch) { return (int) (batch >> 16 & 0xffff); }
+  static int Next(uint64_t batch) { return (int) (batch & 0xffff); }
+
+  // Claims and runs jobs from the batch until none are left, or it's been replaced
+  void WorkOn(uint64_t batch)
+  {
+    uint64_t current = mBatch.load(std::memory_order_acquire);
+    while (Generation(current) == Generation(batch) && Next(current) < Count(current)) {
+      if (!mBatch.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel)) continue;
+      mJob(mContext, Next(current));
+      mDone.fetch_add(1, std::memory_order_release);
+      current = mBatch.load(std::memory_order_acquire);
+    }
+  }
+
+  // Worker 'index' runs until SetWorkers leaves fewer workers than that
+  void WorkerLoop(int index)
+  {
+    uint64_t seen = kNoBatch;
+    for (;;) {
+      uint64_t batch;
+      {
+        // park until a batch is published
+        std::unique_lock<std::mutex> lock(mMutex);
+        mParked.fetch_add(1, std::memory_order_seq_cst);
+        mWake.wait(lock, [&] {
+          batch = mBatch.load(std::memory_order_seq_cst);
+          return index >= mNumWorkers || Generation(batch) != Generation(seen);
+        });
+        mParked.fetch_sub(1, std::memory_order_relaxed);
+        if (index >= mNumWorkers) return;
+      }
+      seen = batch;
+      WorkOn(batch);
+    }
+  }
+
+  std::vector<std::thread> mThreads;  // SetWorkers' alone
+  std::mutex mResizeMutex;
+  std::atomic<int> mNumWorkers{0};  // changed under mMutex
+  std::atomic<uint64_t> mBatch{kNoBatch};  // generation:32 count:16 next:16
+  std::atomic<int> mDone{0};
+  uint64_t mGeneration = 0;  // audio thread's copy
+  void (*mJob)(void*, int) = nullptr;
+  void* mContext = nullptr;
+  std::atomic<int> mParked{0};
+  std::mutex mMutex;
+  std::condition_variable mWake;
+};
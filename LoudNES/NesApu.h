@@ -148,12 +148,14 @@ public:
   static const int MaximumPeriod15Bit = 0x7fff; // 32767
   static const int MaximumPeriod16Bit = 0xffff; // 65535
 
-  static array<ushort, 97> NoteTableNTSC;
-  static array<ushort, 97> NoteTablePAL;
-  static array<ushort, 97> NoteTableVrc6Saw;
-  static array<ushort, 97> NoteTableVrc7;
-  static array<ushort, 97> NoteTableFds;
-//  static array<array<ushort, 97>, 8> NoteTableN163;
+  struct NoteTables {
+    array<ushort, 97> ntsc = {};
+//    array<ushort, 97> pal = {};
+    array<ushort, 97> vrc6Saw = {};
+    array<ushort, 97> vrc7 = {};
+    array<ushort, 97> fds = {};
+//    array<array<ushort, 97>, 8> n163 = {};
+  };
 
   enum Channel {
     Pulse1 = 0,
@@ -192,7 +194,14 @@ public:
 
   NesApu() {}
 
-  static void InitializeNoteTables() {
+  // Built on first use and shared by every channel of every instance
+  static const NoteTables& GetNoteTables() {
+    static const NoteTables tables = MakeNoteTables();
+    return tables;
+  }
+
+  static NoteTables MakeNoteTables() {
+    NoteTables t;
     const double BaseFreq = 32.7032; /// C0
 
     double clockNtsc = 1789773 / 16.0;
@@ -202,25 +211,26 @@ public:
       auto octave = i / 12;
       auto freq = BaseFreq * pow(2.0, i / 12.0);
 
-      NoteTableNTSC[i]    = (ushort)(clockNtsc / freq - 0.5);
-      printf("%d, %0.4f, %d\n", i, freq, NoteTableNTSC[i]);
-//      NoteTablePAL[i]     = (ushort)(clockPal  / freq - 0.5);
-      NoteTableVrc6Saw[i] = (ushort)((clockNtsc * 16.0) / (freq * 14.0) - 0.5);
-      NoteTableFds[i]     = (ushort)((freq * 65536.0) / (clockNtsc / 1.0) + 0.5);
-      NoteTableVrc7[i]    = octave == 0 ? (ushort)(freq * 262144.0 / 49716.0 + 0.5) : (ushort)(NoteTableVrc7[i % 12] << octave);
+      t.ntsc[i]    = (ushort)(clockNtsc / freq - 0.5);
+//      t.pal[i]     = (ushort)(clockPal  / freq - 0.5);
+      t.vrc6Saw[i] = (ushort)((clockNtsc * 16.0) / (freq * 14.0) - 0.5);
+      t.fds[i]     = (ushort)((freq * 65536.0) / (clockNtsc / 1.0) + 0.5);
+      t.vrc7[i]    = octave == 0 ? (ushort)(freq * 262144.0 / 49716.0 + 0.5) : (ushort)(t.vrc7[i % 12] << octave);
 
 //            for (int j = 0; j < 8; j++)
-//              NoteTableN163[j][i] = (ushort)fmin(0xffff, ((freq * (j + 1) * 983040.0) / clockNtsc) / 4);
+//              t.n163[j][i] = (ushort)fmin(0xffff, ((freq * (j + 1) * 983040.0) / clockNtsc) / 4);
     }
+    return t;
   }
 
-  static array<ushort, 97> GetNoteTableForChannel(Channel channel) {
+  static const array<ushort, 97>& GetNoteTableForChannel(Channel channel) {
+    const NoteTables& tables = GetNoteTables();
     switch (channel)
     {
       case Channel::Vrc6Saw:
-        return NoteTableVrc6Saw;
+        return tables.vrc6Saw;
       case Channel::FdsWave:
-        return NoteTableFds;
+        return tables.fds;
         //      case Channel::N163Wave1:
         //      case Channel::N163Wave2:
         //      case Channel::N163Wave3:
@@ -229,17 +239,17 @@ public:
         //      case Channel::N163Wave6:
         //      case Channel::N163Wave7:
         //      case Channel::N163Wave8:
-        //        return NoteTableN163[numN163Channels - 1];
+        //        return tables.n163[numN163Channels - 1];
       case Channel::Vrc7Fm1:
       case Channel::Vrc7Fm2:
       case Channel::Vrc7Fm3:
       case Channel::Vrc7Fm4:
       case Channel::Vrc7Fm5:
       case Channel::Vrc7Fm6:
-        return NoteTableVrc7;
+        return tables.vrc7;
       default:
-        return NoteTableNTSC;
-        //        return pal ? NoteTablePAL : NoteTableNTSC;
+        return tables.ntsc;
+        //        return pal ? tables.pal : tables.ntsc;
     }
   }
 
@@ -271,8 +281,34 @@ public:
     }
   }
 
-  static void InitAndReset(shared_ptr<Simple_Apu> nesApu, int sampleRate, int expansion, int numExpansionChannels, int (*dmcCallback)( void*, cpu_addr_t )) {
+  // Sets output rate and the matching treble eq without touching register state,
+  // so it can follow host sample rate changes.
+  static void SetSampleRate(shared_ptr<Simple_Apu> nesApu, int sampleRate, int expansion) {
     nesApu->sample_rate(sampleRate, false);
+    // These were the default values in Nes_Snd_Emu, review eventually.
+    // FamiTracker by default has -24, 12000 respectively.
+    const double treble = -8.87;
+    const int    cutoff =  8800;
+    nesApu->treble_eq(APU_EXPANSION_NONE, treble, cutoff, sampleRate);
+
+    switch (expansion)
+    {
+      case APU_EXPANSION_VRC6:
+        nesApu->treble_eq(expansion, treble, cutoff, sampleRate);
+        break;
+      case APU_EXPANSION_FDS:
+        // These are taken from FamiTracker. They smooth out the waveform extremely nicely!
+        //nesApu->treble_eq(expansion, -48, 1000, sampleRate);
+        nesApu->treble_eq(expansion, -15, 2000, sampleRate);
+        break;
+      case APU_EXPANSION_NAMCO:
+        nesApu->treble_eq(expansion, -15, 4000, sampleRate);
+        break;
+    }
+  }
+
+  static void InitAndReset(shared_ptr<Simple_Apu> nesApu, int sampleRate, int expansion, int numExpansionChannels, int (*dmcCallback)( void*, cpu_addr_t )) {
+    SetSampleRate(nesApu, sampleRate, expansion);
     nesApu->set_audio_expansion(expansion);
     if (dmcCallback)
       nesApu->dmc_reader(dmcCallback, NULL);
@@ -285,22 +321,11 @@ public:
     nesApu->write_register(APU_NOISE_VOL,  0x30);
     nesApu->write_register(APU_PL1_SWEEP,  0x08); // no sweep
     nesApu->write_register(APU_PL2_SWEEP,  0x08);
-    // These were the default values in Nes_Snd_Emu, review eventually.
-    // FamiTracker by default has -24, 12000 respectively.
-    const double treble = -8.87;
-    const int    cutoff =  8800;
-    nesApu->treble_eq(APU_EXPANSION_NONE, treble, cutoff, sampleRate);
 
     switch (expansion)
     {
       case APU_EXPANSION_VRC6:
         nesApu->write_register(VRC6_CTRL, 0x00);  // No halt, no octave change
-        nesApu->treble_eq(expansion, treble, cutoff, sampleRate);
-        break;
-      case APU_EXPANSION_FDS:
-        // These are taken from FamiTracker. They smooth out the waveform extremely nicely!
-        //nesApu->treble_eq(expansion, -48, 1000, sampleRate);
-        nesApu->treble_eq(expansion, -15, 2000, sampleRate);
         break;
       case APU_EXPANSION_MMC5:
         nesApu->write_register(MMC5_SND_CHN, 0x03); // Enable both square channels.
@@ -312,7 +337,6 @@ public:
         // This is mainly because the instrument player might not update all the channels all the time.
         nesApu->write_register(N163_ADDR, N163_REG_VOLUME);
         nesApu->write_register(N163_DATA, (numExpansionChannels - 1) << 4);
-        nesApu->treble_eq(expansion, -15, 4000, sampleRate);
         break;
       case APU_EXPANSION_SUNSOFT:
         nesApu->write_register(S5B_ADDR, S5B_REG_TONE);
@@ -322,11 +346,4 @@ public:
   }
 };
 
-array<ushort, 97> NesApu::NoteTableNTSC = {};
-array<ushort, 97> NesApu::NoteTablePAL = {};
-array<ushort, 97> NesApu::NoteTableVrc6Saw = {};
-array<ushort, 97> NesApu::NoteTableVrc7 = {};
-array<ushort, 97> NesApu::NoteTableFds = {};
-//array<array<ushort, 97>, 8> NesApu::NoteTableN163 = {};
-
 #endif /* NesApu_hpp */
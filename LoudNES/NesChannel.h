@@ -11,6 +11,7 @@
 #include "NesApu.h"
 #include "NesDpcm.h"
 #include "NesEnvelope.h"
+#include "NesMpe.h"
 #include <algorithm>
 #include <utility>
 
@@ -28,8 +29,8 @@ public:
   {}
 
   virtual int GetPeriod() {
-    int arpNote = mEnvs.arp.GetValueAndAdvance();
-    int finePitch = mEnvs.pitch.GetValueAndAdvance();
+    int arpNote = EnvValue(NesEnvelopes::kArp);
+    int finePitch = EnvValue(NesEnvelopes::kPitch);
 
     // Absolute fine pitch mode + note table lookup (becomes ineffective at lower notes)
     //    int basePeriod = mNoteTable[mBaseNote - mNoteTableMidiOffset + arpNote] / (1.f + pow(2.f, finePitch / 72.f));
@@ -41,7 +42,7 @@ public:
     static const double clockNtsc = 1789773 / 16.0;
     static const double note0Freq = 8.1757989156;
 
-    double note = mBaseNote + arpNote + (finePitch / 12.0);
+    double note = mBaseNote + arpNote + (finePitch / 12.0) + mNoteBend;
     double freq = note0Freq * pow(2.0, note / 12.0) * mPitchBendRatio;
     int idealPeriod;
     if (mChannel == NesApu::Vrc6Saw)
@@ -56,17 +57,34 @@ public:
   }
 
   virtual int GetVolume() {
-    int envVolume = mEnvs.volume.GetValueAndAdvance();
+    int envVolume = EnvValue(NesEnvelopes::kVolume);
     // Simple multiply https://docs.google.com/spreadsheets/d/1i1xJdoUZuDM50SogPGg270OP6oX1rjiDNVBMh6yfQiw/edit#gid=1871770382
-    return ceil(envVolume * mVelocity);
+    return ceil(envVolume * (mPressure >= 0 ? mPressure : mVelocity));
   }
 
   virtual int GetDuty() {
     // 2A03 pulse duty really only has 3 levels:
     // 1/8 (0), 1/4 (1), and 1/2 (2). The last is 1/4 inverted (3).
-    return mEnvs.duty.GetValueAndAdvance() % 4;
+    return EnvValue(NesEnvelopes::kDuty) % 4;
   }
 
+  // Envelopes play back in bank, which must tick once per frame before UpdateAPU
+  void AttachEnvelopes(NesEnvelopeBank* bank) {
+    mEnvBank = bank;
+    mEnvBase = bank->Add(mEnvs.allEnvs[0]);
+    for (int e = 1; e < NesEnvelopes::kNumEnvs; e++) bank->Add(mEnvs.allEnvs[e]);
+  }
+
+  // Play other's envelope shapes rather than mEnvs, with this channel's own playback
+  void ShareEnvelopes(const NesChannel& other) {
+    for (int e = 0; e < NesEnvelopes::kNumEnvs; e++) mEnvBank->Bind(mEnvBase + e, other.mEnvs.allEnvs[e]);
+  }
+
+  // This frame's envelope value, and the envelope's state before it advanced
+  int EnvValue(int env) const { return mEnvBank->Value(mEnvBase + env); }
+  NesEnvelope::State EnvState(int env) const { return mEnvBank->State(mEnvBase + env); }
+  int EnvStep(int env) const { return mEnvBank->Step(mEnvBase + env); }
+
   // TODO rename something like Advance() or EndFrame()
   virtual void UpdateAPU() {
   }
@@ -78,22 +96,28 @@ public:
     }
   }
 
+  // MPE: the note's own bend in semitones, on top of the pitch bend, and its pressure,
+  // which takes over from velocity once it's been sent (see NesMpe.h)
+  void SetNoteExpression(const NesMpeExpression& expression) {
+    mNoteBend = expression.bend;
+    mPressure = expression.pressure;
+  }
+
   virtual void Trigger(int baseNote, double velocity, bool isRetrigger) {
     mBaseNote = mKeyTrack ? baseNote : 64;
     if (isRetrigger) {
       mVelocity = mVelSens ? velocity : 1.f;
-      mEnvs.volume.Trigger();
-      mEnvs.arp.Trigger();
-      mEnvs.pitch.Trigger();
-      mEnvs.duty.Trigger();
+      for (int e = 0; e < NesEnvelopes::kNumEnvs; e++) mEnvBank->Trigger(mEnvBase + e);
     }
   }
 
   virtual void Release() {
-    mEnvs.volume.Release();
-    mEnvs.arp.Release();
-    mEnvs.pitch.Release();
-    mEnvs.duty.Release();
+    for (int e = 0; e < NesEnvelopes::kNumEnvs; e++) mEnvBank->Release(mEnvBase + e);
+  }
+
+  // Ends whatever note may be held, without waking envelopes that have finished
+  virtual void ReleaseHeld() {
+    for (int e = 0; e < NesEnvelopes::kNumEnvs; e++) mEnvBank->ReleaseIfHeld(mEnvBase + e);
   }
 
   virtual void SetKeyTrack(bool enabled) {
@@ -122,18 +146,22 @@ public:
   //protected:
   shared_ptr<Simple_Apu> mNesApu;
   NesApu::Channel mChannel;
-  array<ushort, 97> mNoteTable;
+  const array<ushort, 97>& mNoteTable;  // shared, see NesApu::GetNoteTables()
   int mBaseNote = 48;
   int mNoteTableMidiOffset = 24;
   NesEnvelopes mEnvs;
+  NesEnvelopeBank* mEnvBank = nullptr;
+  int mEnvBase = 0;
   float mPitchBendRatio = 1;
   float mPitchBend = 0;
-  float mVelocity;
+  float mVelocity = 1;
+  float mNoteBend = 0;
+  float mPressure = -1;
   bool mKeyTrack = true;
   bool mVelSens = true;
 };
 
-class NesChannelPulse : public NesChannel
+class NesChannelPulse final : public NesChannel
 {
 public:
   int mRegOffset = 0;
@@ -149,7 +177,7 @@ public:
     int duty = GetDuty();
     int volume = 0;
 
-    if (mEnvs.arp.GetState() != NesEnvelope::ENV_OFF) {
+    if (EnvState(NesEnvelopes::kArp) != NesEnvelope::ENV_OFF) {
       int period = GetPeriod();
       volume = GetVolume();
 
@@ -191,7 +219,7 @@ public:
   }
 };
 
-class NesChannelTriangle : public NesChannel
+class NesChannelTriangle final : public NesChannel
 {
 public:
   NesChannelTriangle(shared_ptr<Simple_Apu> nesApu, NesApu::Channel channel, const NesEnvelopes &nesEnvelopes) : NesChannel(nesApu, channel, nesEnvelopes) {
@@ -199,11 +227,11 @@ public:
   }
 
   int GetVolume() override {
-    return mEnvs.volume.GetValueAndAdvance() ? 0xff : 0x80;
+    return EnvValue(NesEnvelopes::kVolume) ? 0xff : 0x80;
   }
 
   void UpdateAPU() override {
-    if (mEnvs.volume.GetState() != NesEnvelope::ENV_OFF) {
+    if (EnvState(NesEnvelopes::kVolume) != NesEnvelope::ENV_OFF) {
       int volume = GetVolume();
       int period = GetPeriod();
       int periodLo = (period >> 0) & 0xff;
@@ -220,17 +248,17 @@ public:
   }
 };
 
-class NesChannelNoise : public NesChannel
+class NesChannelNoise final : public NesChannel
 {
 public:
   NesChannelNoise(shared_ptr<Simple_Apu> nesApu, NesApu::Channel channel, const NesEnvelopes &nesEnvelopes) : NesChannel(nesApu, channel, nesEnvelopes) {}
 
   int GetPeriod() override {
-    return (mBaseNote + mEnvs.arp.GetValueAndAdvance()) & 0x0f;
+    return (mBaseNote + EnvValue(NesEnvelopes::kArp)) & 0x0f;
   }
 
   void UpdateAPU() override {
-    if (mEnvs.volume.GetState() != NesEnvelope::ENV_OFF) {
+    if (EnvState(NesEnvelopes::kVolume) != NesEnvelope::ENV_OFF) {
       int volume = GetVolume();
       int duty = GetDuty();
       int period = GetPeriod();
@@ -245,7 +273,7 @@ public:
   }
 };
 
-class NesChannelDpcm : public NesChannel
+class NesChannelDpcm final : public NesChannel
 {
 public:
   NesChannelDpcm(shared_ptr<Simple_Apu> nesApu, NesApu::Channel channel, shared_ptr<NesDpcm> nesDpcm)
@@ -262,6 +290,10 @@ public:
     mDpcmReleased = true;
   }
 
+  void ReleaseHeld() override {
+    Release();
+  }
+
   void UpdateAPU() override {
     if (mDpcmTriggered) {
       mDpcmTriggered = false;
@@ -303,11 +335,11 @@ public:
 
   shared_ptr<NesDpcm> mNesDpcm;
 protected:
-  bool mDpcmTriggered;
-  bool mDpcmReleased;
+  bool mDpcmTriggered = false;
+  bool mDpcmReleased = false;
 };
 
-class NesChannelVrc6Pulse : public NesChannel
+class NesChannelVrc6Pulse final : public NesChannel
 {
 public:
   int mRegOffset = 0;
@@ -319,13 +351,13 @@ public:
 
   virtual int GetDuty() override {
     // VRC6 pulse channels duty has 8 levels; 0: 1/16, 1: 2/16,... 7: 8/16
-    return mEnvs.duty.GetValueAndAdvance();
+    return EnvValue(NesEnvelopes::kDuty);
   }
 
   void UpdateAPU() override {
     int duty = GetDuty();
 
-    if (mEnvs.arp.GetState() == NesEnvelope::ENV_OFF) {
+    if (EnvState(NesEnvelopes::kArp) == NesEnvelope::ENV_OFF) {
       mNesApu->write_register(NesApu::VRC6_PL1_VOL + mRegOffset, duty << 4);
     } else {
       int period = GetPeriod();
@@ -340,14 +372,14 @@ public:
   }
 };
 
-class NesChannelVrc6Saw : public NesChannel
+class NesChannelVrc6Saw final : public NesChannel
 {
 public:
   NesChannelVrc6Saw(shared_ptr<Simple_Apu> nesApu, NesApu::Channel channel, const NesEnvelopes &nesEnvelopes)
     : NesChannel(nesApu, channel, nesEnvelopes) {}
 
   void UpdateAPU() override {
-    if (mEnvs.arp.GetState() == NesEnvelope::ENV_OFF) {
+    if (EnvState(NesEnvelopes::kArp) == NesEnvelope::ENV_OFF) {
       mNesApu->write_register(NesApu::VRC6_SAW_VOL, 0x00);
     } else {
       int period = GetPeriod();
@@ -374,7 +406,17 @@ struct NesChannels {
     , vrc6pulse1(std::move(vp1))
     , vrc6pulse2(std::move(vp2))
     , vrc6saw(std::move(s))
-    , allChannels({&pulse1, &pulse2, &triangle, &noise, &dpcm, &vrc6pulse1, &vrc6pulse2, &vrc6saw}) {}
+    , allChannels({&pulse1, &pulse2, &triangle, &noise, &dpcm, &vrc6pulse1, &vrc6pulse2, &vrc6saw}) {
+    for (auto ch : allChannels) ch->AttachEnvelopes(&envelopes);
+  }
+
+  void ShareEnvelopes(const NesChannels& other) {
+    for (int i = 0; i < numChannels; i++) allChannels[i]->ShareEnvelopes(*other.allChannels[i]);
+  }
+
+  // Channels point into envelopes, so keep them in place
+  NesChannels(const NesChannels&) = delete;
+  NesChannels& operator=(const NesChannels&) = delete;
 
   NesChannelPulse     pulse1;
   NesChannelPulse     pulse2;
@@ -387,6 +429,21 @@ struct NesChannels {
   const int numChannels = 8;
 
   vector<NesChannel*> allChannels;
+  NesEnvelopeBank envelopes;
+
+  // Calls f on each channel in order, as its concrete (final) type, so per-tick calls
+  // like UpdateAPU dispatch statically and can inline. Use allChannels elsewhere.
+  template<typename F>
+  void ForEach(F&& f) {
+    f(pulse1);
+    f(pulse2);
+    f(triangle);
+    f(noise);
+    f(dpcm);
+    f(vrc6pulse1);
+    f(vrc6pulse2);
+    f(vrc6saw);
+  }
 };
 
 #endif /* NesChannelState_h */
@@ -111,19 +111,29 @@ struct NesDpcmPatch {
 
 class NesDpcm {
 public:
-  NesDpcm() {
-    // TODO: decide on bundled DPMC samples
-    mSamples.push_back(make_shared<NesDpcmSample>(TMNT3__E300_dmc, TMNT3__E300_dmc_len, "TMNT3 Hey"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C000_dmc, TinyToonA2__C000_dmc_len, "TinyToon 1"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C1C0_dmc, TinyToonA2__C1C0_dmc_len, "TinyToon 2"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C2C0_dmc, TinyToonA2__C2C0_dmc_len, "TinyToon 3"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C340_dmc, TinyToonA2__C340_dmc_len, "TinyToon 4"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C580_dmc, TinyToonA2__C580_dmc_len, "TinyToon 5"));
-    mSamples.push_back(make_shared<NesDpcmSample>(TinyToonA2__C740_dmc, TinyToonA2__C740_dmc_len, "TinyToon 6"));
+  NesDpcm()
+  : mSamples(BundledSamples())
+  {
     for (int i = 0; i < 12; i++)
       mNoteMap.push_back(make_shared<NesDpcmPatch>());
   }
 
+  // Loaded on first use and shared by every instance. Samples are never modified once
+  // made, only replaced, so sharing them is safe.
+  static const vector<shared_ptr<NesDpcmSample>>& BundledSamples() {
+    static const vector<shared_ptr<NesDpcmSample>> samples = {
+      // TODO: decide on bundled DPMC samples
+      make_shared<NesDpcmSample>(TMNT3__E300_dmc, TMNT3__E300_dmc_len, "TMNT3 Hey"),
+      make_shared<NesDpcmSample>(TinyToonA2__C000_dmc, TinyToonA2__C000_dmc_len, "TinyToon 1"),
+      make_shared<NesDpcmSample>(TinyToonA2__C1C0_dmc, TinyToonA2__C1C0_dmc_len, "TinyToon 2"),
+      make_shared<NesDpcmSample>(TinyToonA2__C2C0_dmc, TinyToonA2__C2C0_dmc_len, "TinyToon 3"),
+      make_shared<NesDpcmSample>(TinyToonA2__C340_dmc, TinyToonA2__C340_dmc_len, "TinyToon 4"),
+      make_shared<NesDpcmSample>(TinyToonA2__C580_dmc, TinyToonA2__C580_dmc_len, "TinyToon 5"),
+      make_shared<NesDpcmSample>(TinyToonA2__C740_dmc, TinyToonA2__C740_dmc_len, "TinyToon 6"),
+    };
+    return samples;
+  }
+
   void AddSample(shared_ptr<NesDpcmSample> sample) {
     mSamples.push_back(sample);
   }
@@ -150,6 +160,19 @@ public:
     return addr;
   }
 
+  // Sample memory image as seen by GetSampleForAddress (starting at $C000)
+  vector<char> GetSampleMemory() {
+    vector<char> memory;
+    int addr = 0;
+    for (const auto &s : mSamples) {
+      if (addr + s->data.size() > 0x4000) break;
+      memory.resize(addr, 0x55);
+      memory.insert(memory.end(), s->data.begin(), s->data.end());
+      addr = (addr + s->data.size() + 63) & 0xffc0;
+    }
+    return memory;
+  }
+
   int GetAddressForSample(int sampleIdx) {
     int addr = 0;
     for (int i = 0; i < mSamples.size(); i++) {
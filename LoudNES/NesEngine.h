@@ -0,0 +1,85 @@
+//
+//  NesEngine.h
+//  LoudNES
+//
+//  One emulated NES: an APU, its channels and their envelope playback. LoudNESDSP
+//  plays everything through its first engine, and in poly mode deals notes out to
+//  the rest of its pool too. Pool engines play the first engine's envelope shapes.
+//
+
+#pragma once
+
+#include "NesApu.h"
+#include "NesChannel.h"
+#include "NesDpcm.h"
+#include "NesMpe.h"
+
+struct NesEngine
+{
+  explicit NesEngine(const shared_ptr<NesDpcm>& nesDpcm)
+  : apu(make_shared<Simple_Apu>())
+  {
+    NesApu::InitAndReset(apu, 44100, NesApu::APU_EXPANSION_VRC6, 0, nullptr);
+    apu->enable_register_cache(true);
+    apu->dmc_reader([](void* nesDpcm_, cpu_addr_t addr) -> int {
+      return static_cast<NesDpcm*>(nesDpcm_)->GetSampleForAddress(addr - 0xc000);
+    }, nesDpcm.get());
+
+    channels = make_shared<NesChannels>(
+      NesChannelPulse(apu,     NesApu::Channel::Pulse1,      NesEnvelopes()),
+      NesChannelPulse(apu,     NesApu::Channel::Pulse2,      NesEnvelopes()),
+      NesChannelTriangle(apu,  NesApu::Channel::Triangle,    NesEnvelopes()),
+      NesChannelNoise(apu,     NesApu::Channel::Noise,       NesEnvelopes()),
+      NesChannelDpcm(apu,      NesApu::Channel::Dpcm,        nesDpcm),
+      NesChannelVrc6Pulse(apu, NesApu::Channel::Vrc6Pulse1,  NesEnvelopes()),
+      NesChannelVrc6Pulse(apu, NesApu::Channel::Vrc6Pulse2,  NesEnvelopes()),
+      NesChannelVrc6Saw(apu,   NesApu::Channel::Vrc6Saw,     NesEnvelopes())
+    );
+  }
+
+  // Sleeping engines aren't rendered. Waking drops the stale samples left in the
+  // buffer, and restarts tick scheduling.
+  void Wake() {
+    if (!asleep) return;
+    asleep = false;
+    idleSeconds = 0.;
+    apu->remove_samples(apu->samples_avail());
+    nextTick = 0.;
+    tickBeatValid = false;
+  }
+
+  // Room for blocks of up to maxFrames. Not for the audio thread, as it allocates.
+  void AllocateBuffers(int maxFrames) {
+    buffer.assign(maxFrames, 0);
+    for (auto& channelBuffer : channelBuffers) channelBuffer.assign(maxFrames, 0);
+  }
+
+  // Reads the last block rendered: all of it into buffer, or with outputs split,
+  // each channel into its own buffer, and whatever was mixed before the split into buffer
+  void ReadSamples(int nFrames) {
+    if (!apu->outputs_split()) {
+      apu->read_samples(buffer.data(), nFrames);
+      return;
+    }
+    Simple_Apu::sample_t* outs[Simple_Apu::max_channels] = {};
+    for (int ch = 0; ch < kNumChannels; ch++) outs[ch] = channelBuffers[ch].data();
+    apu->read_channels(outs, buffer.data(), nFrames);
+  }
+
+  shared_ptr<Simple_Apu> apu;
+  shared_ptr<NesChannels> channels;
+  vector<int16_t> buffer;  // the last block rendered
+  vector<int16_t> channelBuffers[kNumChannels];  // the same, per channel, when split
+
+  // Tick scheduling, see LoudNESDSP::RenderEngine
+  double nextTick = 0.;       // clock time of the next tick, from the start of the current frame
+  double nextTickBeat = 0.;   // host beat of the next tick, when synced and tickBeatValid
+  bool tickBeatValid = false;
+
+  NesMpeState mpe;
+
+  // Poly mode
+  int heldNotes = 0;
+  double idleSeconds = 0.;    // with no notes held and all envelopes off
+  bool asleep = false;
+};
@@ -27,69 +27,36 @@ public:
     mValues.fill(defaultValue);
   }
 
-  void Trigger() {
-    mState = ENV_INITIAL;
-    mStep = 0;
-  }
-
-  void Release() {
-    mStep = mReleasePoint * mSpeedDivider;
-    if (mReleasePoint < mLength) {
-      mState = ENV_RELEASE;
-    } else {
-      mState = ENV_OFF;
-    }
-  }
-
-  int GetValueAndAdvance() {
-    int step = mStep / mSpeedDivider;
-    mStep++;
-    switch (mState) {
-      case ENV_INITIAL:
-        if (mStep >= mReleasePoint * mSpeedDivider)
-          mStep = mLoopPoint * mSpeedDivider;
-      // Fall through - no break
-      case ENV_RELEASE:
-        if (mStep >= mLength * mSpeedDivider)
-          mState = ENV_OFF;
-        break;
-      case ENV_OFF:
-        return 0;
-    }
-    assert(step < mValues.size());
-    return mValues.at(step);
-  }
-
-  int GetStep() {
-    return mState == ENV_OFF ? -1 : mStep / mSpeedDivider;
-  }
-
-  State GetState() {
-    return mState;
+  void SetValue(int step, int value) {
+    mValues[step] = value;
+    mVersion++;
   }
 
   void SetLength(int length) {
     mLength = clamp(length, 1, kMaxSteps);
     if (mReleasePoint > mLength) mReleasePoint = mLength;
     if (mLoopPoint >= mLength) mLoopPoint = mLength - 1;
+    mVersion++;
   }
 
+  // A playing envelope keeps its place; NesEnvelopeBank rescales its step
   void SetSpeedDivider(int speedDivider) {
-    int newSpeedDivider = clamp(speedDivider, 1, 8);
-    mStep = min(mStep * (float)newSpeedDivider / mSpeedDivider, kMaxSteps * newSpeedDivider - 1);
-    mSpeedDivider = newSpeedDivider;
+    mSpeedDivider = clamp(speedDivider, 1, 8);
+    mVersion++;
   }
 
   void SetLoop(int loopPoint) {
     mLoopPoint = clamp(loopPoint, 0, kMaxSteps - 1);
     if (mReleasePoint <= mLoopPoint) mReleasePoint = mLoopPoint + 1;
     if (mLength <= mLoopPoint) mLength = mLoopPoint + 1;
+    mVersion++;
   }
 
   void SetRelease(int releasePoint) {
     mReleasePoint = clamp(releasePoint, 1, kMaxSteps);
     if (mLoopPoint >= mReleasePoint) mLoopPoint = mReleasePoint - 1;
     if (mLength < mReleasePoint) mLength = mReleasePoint;
+    mVersion++;
   }
 
   void Serialize(iplug::IByteChunk &chunk) const {
@@ -107,23 +74,24 @@ public:
       pos = chunk.Get(addr, pos);
 //      pos = chunk.Get(addr, startPos + i * 4);
     }
+    mVersion++;
     return pos;
   }
 
+  // Shape. Change it through the setters, which bump mVersion so playback picks it up.
   array<int, kMaxSteps> mValues = {0};
-  int mStep = 0;
   int mLoopPoint = 15;
   int mReleasePoint = 16;
   int mLength = 16;
   int mSpeedDivider = 1;
   int mMinVal = 0;
   int mMaxVal = 15;
-
-protected:
-  NesEnvelope::State mState = ENV_OFF;
+  uint32_t mVersion = 0;
 };
 
 struct NesEnvelopes {
+  enum EEnv { kVolume = 0, kDuty, kArp, kPitch, kNumEnvs };
+
   NesEnvelopes()
     : volume(NesEnvelope(15, 0, 15))
     , duty(NesEnvelope(2, 0, 7))
@@ -154,4 +122,135 @@ struct NesEnvelopes {
   array<NesEnvelope*, 4> allEnvs;
 };
 
+// Playback state of many envelopes, stored field by field so that each tick advances
+// all of them in one branch-free loop the compiler can vectorize. Shapes stay in their
+// NesEnvelope, where the UI edits them; the bank keeps an int8 copy, refreshed when the
+// envelope's version changes.
+class NesEnvelopeBank {
+public:
+  static constexpr int kMaxEnvelopes = 32;
+
+  NesEnvelopeBank() {
+    for (int i = 0; i < kMaxEnvelopes; i++) mState[i] = mLatchedState[i] = NesEnvelope::ENV_OFF;
+  }
+
+  // Returns the index of env, which must outlive the bank
+  int Add(const NesEnvelope* env) {
+    assert(mCount < kMaxEnvelopes);
+    const int i = mCount++;
+    mEnvs[i] = env;
+    Sync(i);
+    return i;
+  }
+
+  // Play env's shape in slot i instead, as when one bank plays another's shapes
+  void Bind(int i, const NesEnvelope* env) {
+    mEnvs[i] = env;
+    Sync(i);
+  }
+
+  void Trigger(int i) {
+    SyncIfChanged(i);
+    mState[i] = NesEnvelope::ENV_INITIAL;
+    mPos[i] = 0;
+    mSub[i] = 0;
+  }
+
+  void Release(int i) {
+    SyncIfChanged(i);
+    mPos[i] = mRelease[i];
+    mSub[i] = 0;
+    mState[i] = mRelease[i] < mLength[i] ? NesEnvelope::ENV_RELEASE : NesEnvelope::ENV_OFF;
+  }
+
+  // Release, unless already released or off
+  void ReleaseIfHeld(int i) {
+    if (mState[i] == NesEnvelope::ENV_INITIAL) Release(i);
+  }
+
+  // Once per frame, before the channels update: latch each envelope's value and state,
+  // then advance it.
+  void Tick() {
+    for (int i = 0; i < mCount; i++) SyncIfChanged(i);
+
+    for (int i = 0; i < kMaxEnvelopes; i++) mValue[i] = mValues[i][mPos[i] & (kMaxSteps - 1)];
+
+    for (int i = 0; i < kMaxEnvelopes; i++) {
+      const uint8_t state = mState[i];
+      const bool off = state == NesEnvelope::ENV_OFF;
+      mLatchedState[i] = state;
+      mValue[i] = off ? 0 : mValue[i];
+
+      uint8_t sub = mSub[i] + 1;
+      uint8_t pos = mPos[i];
+      const bool carry = sub >= mSpeed[i];
+      sub = carry ? 0 : sub;
+      pos = carry ? pos + 1 : pos;
+
+      // past the release point, an unreleased envelope loops
+      const bool loop = state == NesEnvelope::ENV_INITIAL && pos >= mRelease[i];
+      pos = loop ? mLoop[i] : pos;
+      sub = loop ? 0 : sub;
+
+      const bool end = pos >= mLength[i];
+      mState[i] = (off || end) ? (uint8_t) NesEnvelope::ENV_OFF : state;
+      mPos[i] = off ? mPos[i] : pos;
+      mSub[i] = off ? mSub[i] : sub;
+    }
+  }
+
+  // Value and state as of the last Tick. The value is 0 if the envelope was off.
+  int Value(int i) const { return mValue[i]; }
+  NesEnvelope::State State(int i) const { return NesEnvelope::State(mLatchedState[i]); }
+
+  bool AllOff() const {
+    bool on = false;
+    for (int i = 0; i < kMaxEnvelopes; i++) on |= mState[i] != NesEnvelope::ENV_OFF;
+    return !on;
+  }
+
+  // Step to highlight in the editor, or -1 if off
+  int Step(int i) const { return mState[i] == NesEnvelope::ENV_OFF ? -1 : mPos[i]; }
+
+private:
+  void SyncIfChanged(int i) {
+    if (mEnvs[i]->mVersion != mVersions[i]) Sync(i);
+  }
+
+  void Sync(int i) {
+    const NesEnvelope& env = *mEnvs[i];
+    for (int s = 0; s < kMaxSteps; s++) mValues[i][s] = (int8_t) env.mValues[s];
+    mLoop[i] = env.mLoopPoint;
+    mRelease[i] = env.mReleasePoint;
+    mLength[i] = env.mLength;
+
+    // keep the same place in the envelope at the new speed
+    const int speed = env.mSpeedDivider;
+    if (mSpeed[i] && speed != mSpeed[i]) {
+      int step = mPos[i] * mSpeed[i] + mSub[i];
+      step = min(step * (float) speed / mSpeed[i], kMaxSteps * speed - 1);
+      mPos[i] = step / speed;
+      mSub[i] = step % speed;
+    }
+    mSpeed[i] = speed;
+    mVersions[i] = env.mVersion;
+  }
+
+  int mCount = 0;
+  const NesEnvelope* mEnvs[kMaxEnvelopes] = {};
+  uint32_t mVersions[kMaxEnvelopes] = {};
+  int8_t mValues[kMaxEnvelopes][kMaxSteps] = {};
+
+  // Position is step (mPos) and tick within the step (mSub), so no per-tick division
+  uint8_t mPos[kMaxEnvelopes] = {};
+  uint8_t mSub[kMaxEnvelopes] = {};
+  uint8_t mSpeed[kMaxEnvelopes] = {};
+  uint8_t mLoop[kMaxEnvelopes] = {};
+  uint8_t mRelease[kMaxEnvelopes] = {};
+  uint8_t mLength[kMaxEnvelopes] = {};
+  uint8_t mState[kMaxEnvelopes] = {};
+  uint8_t mLatchedState[kMaxEnvelopes] = {};
+  int8_t mValue[kMaxEnvelopes] = {};
+};
+
 #endif /* NesEnvelope_h */
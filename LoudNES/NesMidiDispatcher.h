@@ -0,0 +1,195 @@
+//
+//  NesMidiDispatcher.h
+//  LoudNES
+//
+//  Plays the first engine's NES channels from MIDI, one monophonic voice per channel.
+//  Messages are queued as they arrive and applied from inside the render loop, just
+//  before the first tick at or after their sample offset, so a note lands on the tick
+//  it belongs to rather than at the start of the block. Glide advances once a tick.
+//
+
+#pragma once
+
+#include "IPlugMidi.h"
+#include "LoudNES_Params.h"
+#include "NesChannel.h"
+#include "NesEngine.h"
+
+using namespace iplug;
+
+class NesMidiDispatcher
+{
+public:
+  static constexpr int kMaxQueued = 1024;  // per block; later messages are dropped
+
+  explicit NesMidiDispatcher(NesEngine& engine)
+  : mChannels(*engine.channels)
+  , mMpe(engine.mpe)
+  {}
+
+  // Forgets held keys and queued messages; channels keep sounding as they are
+  void Reset() {
+    mNumQueued = mNextQueued = 0;
+    for (int ch = 0; ch < kNumChannels; ch++) ResetChannel(ch);
+  }
+
+  void ResetChannel(int ch) {
+    Voice& voice = mVoices[ch];
+    voice.held[0] = voice.held[1] = 0;
+    voice.numHeld = 0;
+    voice.sustained = false;
+    voice.releasePending = false;
+  }
+
+  // With omni on, every channel plays every MIDI channel; otherwise NES channel n plays MIDI channel n
+  void SetOmni(bool omni) {
+    mOmni = omni;
+    Reset();
+  }
+
+  // Disabled channels ignore MIDI, for when something else plays them
+  void SetChannelEnabled(int ch, bool enabled) {
+    if (mVoices[ch].enabled != enabled) ResetChannel(ch);
+    mVoices[ch].enabled = enabled;
+  }
+
+  void SetLegato(int ch, bool legato) { mVoices[ch].legato = legato; }
+  void SetGlideTime(double seconds) { mGlideSeconds = max(seconds, 0.); }
+  void SetPitchBendRange(double semitones) { mPitchBendSemitones = semitones; }
+
+  // Audio thread, between blocks. Messages are expected in offset order, as hosts send them.
+  void AddMidiMsg(const IMidiMsg& msg) {
+    if (mNumQueued < kMaxQueued) mQueue[mNumQueued++] = msg;
+  }
+
+  // Applies the queued messages due at or before a sample offset into the block
+  void ProcessUntil(double offset) {
+    if (mNextQueued == mNumQueued || mQueue[mNextQueued].mOffset > offset) return;
+    NES_TRACE_SCOPE("MIDI dispatch");
+    while (mNextQueued < mNumQueued && mQueue[mNextQueued].mOffset <= offset) {
+      ProcessMidiMsg(mQueue[mNextQueued++]);
+    }
+  }
+
+  // Applies what's left of the block's messages, which the next tick would have picked up
+  void EndBlock() {
+    while (mNextQueued < mNumQueued) ProcessMidiMsg(mQueue[mNextQueued++]);
+    mNumQueued = mNextQueued = 0;
+  }
+
+  // Before each tick: moves glides along, and sets each channel's bend
+  void Tick(double seconds) {
+    for (int ch = 0; ch < mChannels.numChannels; ch++) {
+      Voice& voice = mVoices[ch];
+      if (!voice.enabled) continue;
+      if (voice.glide != 0.) {
+        const double step = voice.glideRate * seconds;
+        if (fabs(voice.glide) <= step) voice.glide = 0.;
+        else voice.glide -= voice.glide > 0. ? step : -step;
+      }
+      mChannels.allChannels[ch]->SetPitchBend(voice.bend + voice.glide);
+    }
+  }
+
+private:
+  struct Voice {
+    uint64_t held[2] = {};    // bit per held key
+    int numHeld = 0;
+    int key = -1;             // last note played, where the next glides from
+    double bend = 0.;         // octaves
+    double glide = 0.;        // octaves from the note's pitch, heading for 0
+    double glideRate = 0.;    // octaves per second
+    bool legato = false;
+    bool sustained = false;   // pedal down
+    bool releasePending = false;  // keys lifted under the pedal
+    bool enabled = true;
+  };
+
+  void ProcessMidiMsg(const IMidiMsg& msg) {
+    if (mOmni) {
+      for (int ch = 0; ch < mChannels.numChannels; ch++) {
+        if (mVoices[ch].enabled) ProcessMidiMsg(msg, ch);
+      }
+    } else if (msg.Channel() < mChannels.numChannels && mVoices[msg.Channel()].enabled) {
+      ProcessMidiMsg(msg, msg.Channel());
+    }
+  }
+
+  void ProcessMidiMsg(const IMidiMsg& msg, int ch) {
+    Voice& voice = mVoices[ch];
+    NesChannel* channel = mChannels.allChannels[ch];
+    const int key = msg.NoteNumber() & 0x7f;
+    const uint64_t keyBit = 1ull << (key & 63);
+    switch (msg.StatusMsg()) {
+      case IMidiMsg::kNoteOn:
+        if (msg.Velocity()) {
+          // a new phrase, or every note when not legato, restarts the envelopes
+          const bool retrigger = !voice.numHeld || !voice.legato;
+          if (!(voice.held[key >> 6] & keyBit)) {
+            voice.held[key >> 6] |= keyBit;
+            voice.numHeld++;
+          }
+          voice.releasePending = false;
+          mMpe.sources[ch] = (int8_t) msg.Channel();
+          StartGlide(voice, key);
+          channel->Trigger(key, msg.Velocity() / 127., retrigger);
+          break;
+        }
+        // note on with zero velocity is note off
+        // fall through
+      case IMidiMsg::kNoteOff:
+        if (voice.held[key >> 6] & keyBit) {
+          voice.held[key >> 6] &= ~keyBit;
+          if (!--voice.numHeld) {
+            if (voice.sustained) voice.releasePending = true;
+            else channel->Release();
+          }
+        }
+        break;
+      case IMidiMsg::kPitchWheel:
+        voice.bend = msg.PitchWheel() * mPitchBendSemitones / 12.;
+        break;
+      case IMidiMsg::kControlChange:
+        switch (msg.ControlChangeIdx()) {
+          case IMidiMsg::kSustainOnOff:
+            voice.sustained = msg.ControlChange(IMidiMsg::kSustainOnOff) >= 0.5;
+            if (!voice.sustained && voice.releasePending) {
+              voice.releasePending = false;
+              channel->Release();
+            }
+            break;
+          case IMidiMsg::kAllNotesOff:
+            if (voice.numHeld || voice.releasePending) channel->Release();
+            ResetChannel(ch);
+            break;
+          default:
+            break;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Glides from wherever the last note's pitch has got to, taking the glide time
+  // whatever the interval
+  void StartGlide(Voice& voice, int key) {
+    if (mGlideSeconds > 0. && voice.key >= 0) {
+      voice.glide += (voice.key - key) / 12.;
+      voice.glideRate = fabs(voice.glide) / mGlideSeconds;
+    } else {
+      voice.glide = 0.;
+    }
+    voice.key = key;
+  }
+
+  NesChannels& mChannels;
+  NesMpeState& mMpe;  // takes the MIDI channel of each note, for MPE expression
+  Voice mVoices[kNumChannels];
+  IMidiMsg mQueue[kMaxQueued];
+  int mNumQueued = 0;
+  int mNextQueued = 0;
+  bool mOmni = false;
+  double mGlideSeconds = 0.;
+  double mPitchBendSemitones = 2.;
+};
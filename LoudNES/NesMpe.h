@@ -0,0 +1,130 @@
+//
+//  NesMpe.h
+//  LoudNES
+//
+//  MPE: each note comes on a member channel of its own, whose pitch wheel and channel
+//  pressure belong to that note alone. LoudNES takes the lower zone, with MIDI channel
+//  1 as the master channel, whose messages act on every note as usual.
+//
+//  Member channel expression is queued with its sample offset, and each engine plays
+//  the queue through its own view as it ticks, so engines rendering on different
+//  threads only ever read the queue.
+//
+
+#pragma once
+
+#include "IPlugMidi.h"
+#include "LoudNES_Params.h"
+#include <cstdint>
+#include <limits>
+
+using namespace iplug;
+
+struct NesMpeExpression
+{
+  float bend = 0.f;       // semitones
+  float pressure = -1.f;  // 0 to 1, or -1 until the note's first pressure message
+};
+
+// Audio thread: the zone's expression as messages arrive, and the block's queue of it
+class NesMpeQueue
+{
+public:
+  static constexpr int kNumMidiChannels = 16;
+  static constexpr int kMasterChannel = 0;
+  static constexpr int kMaxQueued = 1024;         // per block; later updates reach notes started after them only
+  static constexpr double kBendSemitones = 48.;   // the MPE default for member channels
+
+  struct Update {
+    int offset;
+    int channel;
+    NesMpeExpression expression;  // the channel's, after the message
+  };
+
+  void Reset() {
+    for (auto& expression : mLatest) expression = NesMpeExpression();
+    mNumQueued = 0;
+  }
+
+  // Takes a member channel's pitch wheel and pressure, returning true if it did. A note
+  // on starts its channel's pressure over, and is left for the note to be played.
+  bool AddMidiMsg(const IMidiMsg& msg) {
+    const int channel = msg.Channel();
+    if (channel == kMasterChannel) return false;
+    NesMpeExpression& expression = mLatest[channel];
+    switch (msg.StatusMsg()) {
+      case IMidiMsg::kPitchWheel:
+        expression.bend = (float) (msg.PitchWheel() * kBendSemitones);
+        Queue(msg.mOffset, channel);
+        return true;
+      case IMidiMsg::kChannelAftertouch:
+        expression.pressure = msg.ChannelAfterTouch() / 127.f;
+        Queue(msg.mOffset, channel);
+        return true;
+      case IMidiMsg::kNoteOn:
+        if (msg.Velocity()) {
+          expression.pressure = -1.f;
+          Queue(msg.mOffset, channel);
+        }
+        return false;
+      default:
+        return false;
+    }
+  }
+
+  void EndBlock() { mNumQueued = 0; }
+
+  const NesMpeExpression& Latest(int channel) const { return mLatest[channel]; }
+  int NumQueued() const { return mNumQueued; }
+  const Update& operator[](int i) const { return mQueue[i]; }
+
+private:
+  void Queue(int offset, int channel) {
+    if (mNumQueued < kMaxQueued) mQueue[mNumQueued++] = {offset, channel, mLatest[channel]};
+  }
+
+  NesMpeExpression mLatest[kNumMidiChannels];
+  Update mQueue[kMaxQueued];
+  int mNumQueued = 0;
+};
+
+// One engine's view of the zone, and which member channel each of its NES channels plays
+struct NesMpeState
+{
+  NesMpeState() { Reset(); }
+
+  void Reset() {
+    for (auto& expression : expressions) expression = NesMpeExpression();
+    for (auto& source : sources) source = -1;
+    for (auto& skip : skipBefore) skip = 0;
+    next = 0;
+  }
+
+  // A note started ahead of its offset takes its channel's expression as it arrived.
+  // Queued updates from before it were for the channel's previous note.
+  void StartNote(int ch, int member, const NesMpeQueue& queue) {
+    sources[ch] = (int8_t) member;
+    expressions[member] = queue.Latest(member);
+    skipBefore[member] = queue.NumQueued();
+  }
+
+  // Applies the queued updates due at or before a sample offset into the block
+  void ProcessUntil(double offset, const NesMpeQueue& queue) {
+    for (; next < queue.NumQueued() && queue[next].offset <= offset; next++) {
+      const NesMpeQueue::Update& update = queue[next];
+      if (next >= skipBefore[update.channel]) expressions[update.channel] = update.expression;
+    }
+  }
+
+  // Applies what's left of the block's updates, which the next tick would have picked up
+  void EndBlock(const NesMpeQueue& queue) {
+    ProcessUntil(std::numeric_limits<double>::infinity(), queue);
+    next = 0;
+    for (auto& skip : skipBefore) skip = 0;
+  }
+
+  NesMpeExpression expressions[NesMpeQueue::kNumMidiChannels];
+  int8_t sources[kNumChannels];  // member channel, or -1
+  int skipBefore[NesMpeQueue::kNumMidiChannels];
+  int next;
+};
@@ -15,7 +15,9 @@ extern "C" int __stdcall NesApuInit(int apuIdx, int sampleRate, int pal, int exp
 	if (apu[apuIdx].sample_rate(sampleRate, pal))
 		return -1;
 
-	apu[apuIdx].set_audio_expansion(expansion);
+	if (apu[apuIdx].set_audio_expansion(expansion))
+		return -1;
+
 	apu[apuIdx].dmc_reader(dmcReadFunc, NULL);
 
 	return 0;
@@ -0,0 +1,171 @@
+
+#include "Golden_Checker.h"
+
+#include "Wave_Writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static unsigned get_le16( unsigned char const* p )
+{
+	return p [0] | (p [1] << 8);
+}
+
+static unsigned long get_le32( unsigned char const* p )
+{
+	return get_le16( p ) | ((unsigned long) get_le16( p + 2 ) << 16);
+}
+
+Golden_Checker::Golden_Checker( const char* d, int tol, bool upd, FILE* l )
+{
+	dir = d;
+	log = l;
+	tolerance = tol;
+	update = upd;
+	failed_ = 0;
+	written_ = 0;
+}
+
+unsigned long long Golden_Checker::hash( sample_t const* in, long count )
+{
+	unsigned long long h = 0xCBF29CE484222325ULL;
+	for ( long i = 0; i < count; i++ )
+	{
+		unsigned s = (unsigned short) in [i];
+		h = (h ^ (s & 0xFF)) * 0x100000001B3ULL;
+		h = (h ^ (s >> 8)) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+const char* Golden_Checker::read_wave( const char* path, std::vector<sample_t>& out, long* sample_rate )
+{
+	FILE* file = fopen( path, "rb" );
+	if ( !file )
+		return "Couldn't open WAVE file";
+
+	const char* err = "Not a WAVE file";
+	unsigned char header [12];
+	if ( fread( header, sizeof header, 1, file ) && !memcmp( header, "RIFF", 4 ) &&
+			!memcmp( header + 8, "WAVE", 4 ) )
+	{
+		// walk chunks to 'data', checking format on the way
+		bool format_ok = false;
+		unsigned char chunk [8];
+		while ( fread( chunk, sizeof chunk, 1, file ) )
+		{
+			unsigned long size = get_le32( chunk + 4 );
+			if ( !memcmp( chunk, "fmt ", 4 ) && size >= 16 )
+			{
+				unsigned char fmt [16];
+				if ( !fread( fmt, sizeof fmt, 1, file ) )
+					break;
+				*sample_rate = get_le32( fmt + 4 );
+				format_ok = get_le16( fmt ) == 1 && get_le16( fmt + 2 ) == 1 && get_le16( fmt + 14 ) == 16;
+				fseek( file, size - sizeof fmt + (size & 1), SEEK_CUR );
+			}
+			else if ( !memcmp( chunk, "data", 4 ) )
+			{
+				if ( !format_ok )
+				{
+					err = "WAVE file isn't 16-bit mono";
+					break;
+				}
+				out.resize( size / 2 );
+				std::vector<unsigned char> data( size / 2 * 2 );
+				if ( !data.empty() && !fread( &data [0], data.size(), 1, file ) )
+				{
+					err = "Couldn't read WAVE data";
+					break;
+				}
+				for ( size_t i = 0; i < out.size(); i++ )
+					out [i] = (sample_t) get_le16( &data [i * 2] );
+				err = NULL;
+				break;
+			}
+			else
+			{
+				fseek( file, size + (size & 1), SEEK_CUR );
+			}
+		}
+	}
+
+	fclose( file );
+	return err;
+}
+
+bool Golden_Checker::check( const char* name, sample_t const* in, long count, long sample_rate )
+{
+	std::string path = std::string( dir ) + "/" + name + ".wav";
+	unsigned long long h = hash( in, count );
+
+	// missing references are recorded rather than failed
+	FILE* existing = update ? NULL : fopen( path.c_str(), "rb" );
+	if ( !existing )
+	{
+		Wave_Writer wave;
+		const char* err = wave.open( path.c_str(), sample_rate );
+		if ( err )
+		{
+			fprintf( log, "%-32s %016llx  ERROR %s\n", name, h, err );
+			failed_++;
+			return false;
+		}
+		wave.write( in, count );
+		fprintf( log, "%-32s %016llx  written\n", name, h );
+		written_++;
+		return true;
+	}
+	fclose( existing );
+
+	std::vector<sample_t> ref;
+	long ref_rate = 0;
+	const char* err = read_wave( path.c_str(), ref, &ref_rate );
+	if ( err )
+	{
+		fprintf( log, "%-32s %016llx  ERROR %s\n", name, h, err );
+		failed_++;
+		return false;
+	}
+
+	// first difference over tolerance, and largest difference overall
+	long first_bad = -1;
+	long diff_count = 0;
+	int max_diff = 0;
+	long common = count < (long) ref.size() ? count : (long) ref.size();
+	for ( long i = 0; i < common; i++ )
+	{
+		int diff = abs( in [i] - ref [i] );
+		if ( diff )
+			diff_count++;
+		if ( diff > max_diff )
+			max_diff = diff;
+		if ( diff > tolerance && first_bad < 0 )
+			first_bad = i;
+	}
+
+	if ( ref_rate != sample_rate || count != (long) ref.size() )
+	{
+		fprintf( log, "%-32s %016llx  FAIL %ld samples at %ld Hz, reference has %ld at %ld Hz\n",
+				name, h, count, sample_rate, (long) ref.size(), ref_rate );
+		failed_++;
+		return false;
+	}
+
+	if ( first_bad >= 0 )
+	{
+		fprintf( log, "%-32s %016llx  FAIL first at sample %ld (%.3f s), %ld differ, max diff %d\n",
+				name, h, first_bad, (double) first_bad / sample_rate, diff_count, max_diff );
+		failed_++;
+		return false;
+	}
+
+	if ( diff_count )
+		fprintf( log, "%-32s %016llx  ok, %ld differ within tolerance, max diff %d\n", name, h, diff_count, max_diff );
+	else
+		fprintf( log, "%-32s %016llx  ok\n", name, h );
+	return true;
+}
+
@@ -0,0 +1,47 @@
+
+// Golden-output checks: compares rendered audio with reference WAVE files
+
+// Each check is named, and its reference is dir/name.wav. A missing reference
+// is written from the rendered audio, so the first run records the golden set.
+// Later runs must match it exactly, or to within a tolerance in sample units
+// for changes that are expected to be lossy.
+
+#ifndef GOLDEN_CHECKER_H
+#define GOLDEN_CHECKER_H
+
+#include <stdio.h>
+#include <vector>
+
+class Golden_Checker {
+public:
+	typedef short sample_t;
+
+	// Largest allowed difference per sample; 0 for bit-exact. If update is set,
+	// references are always rewritten rather than compared. Results go to log.
+	Golden_Checker( const char* dir, int tolerance = 0, bool update = false, FILE* log = stdout );
+
+	// Check samples against reference 'name' and log one line of result.
+	// Returns false on a mismatch or file error.
+	bool check( const char* name, sample_t const*, long count, long sample_rate );
+
+	// Number of checks that failed, and that wrote a new reference
+	int failed() const { return failed_; }
+	int written() const { return written_; }
+
+	// 64-bit FNV-1a hash of samples, for logs
+	static unsigned long long hash( sample_t const*, long count );
+
+	// Read 16-bit mono WAVE file as written by Wave_Writer
+	static const char* read_wave( const char* path, std::vector<sample_t>& out, long* sample_rate );
+
+private:
+	const char* dir;
+	FILE* log;
+	int tolerance;
+	bool update;
+	int failed_;
+	int written_;
+};
+
+#endif
+
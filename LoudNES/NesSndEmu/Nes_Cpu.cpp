@@ -0,0 +1,496 @@
+
+#include "Nes_Cpu.h"
+
+#include <assert.h>
+#include <string.h>
+
+static int null_read( void*, cpu_addr_t addr )
+{
+	return addr >> 8; // open bus
+}
+
+static void null_write( void*, cpu_time_t, cpu_addr_t, int )
+{
+}
+
+Nes_Cpu::Nes_Cpu()
+{
+	memset( read_pages, 0, sizeof read_pages );
+	memset( write_pages, 0, sizeof write_pages );
+	set_io( null_read, null_write, NULL );
+	reset();
+}
+
+void Nes_Cpu::set_io( read_func_t read, write_func_t write, void* data )
+{
+	read_io = read;
+	write_io = write;
+	io_data = data;
+}
+
+void Nes_Cpu::map_memory( cpu_addr_t start, long size, byte const* read, byte* write )
+{
+	assert( start % page_size == 0 && size % page_size == 0 );
+	assert( start + size <= 0x10000 );
+	for ( long offset = 0; offset < size; offset += page_size )
+	{
+		int page = (start + offset) >> page_bits;
+		read_pages [page] = read + offset;
+		write_pages [page] = write ? write + offset : NULL;
+	}
+}
+
+void Nes_Cpu::unmap_memory( cpu_addr_t start, long size )
+{
+	assert( start % page_size == 0 && size % page_size == 0 );
+	for ( long offset = 0; offset < size; offset += page_size )
+	{
+		int page = (start + offset) >> page_bits;
+		read_pages [page] = NULL;
+		write_pages [page] = NULL;
+	}
+}
+
+void Nes_Cpu::reset()
+{
+	r.pc = 0;
+	r.a = 0;
+	r.x = 0;
+	r.y = 0;
+	r.sp = 0xFF;
+	r.status = 0x24; // I and unused bit set
+	time_ = 0;
+	unofficial_count_ = 0;
+}
+
+void Nes_Cpu::push_return( cpu_addr_t addr )
+{
+	addr--; // RTS adds one
+	write( 0x100 + r.sp, addr >> 8 );
+	r.sp = (r.sp - 1) & 0xFF;
+	write( 0x100 + r.sp, addr & 0xFF );
+	r.sp = (r.sp - 1) & 0xFF;
+}
+
+// Base clocks for each opcode, not including page crossing and branches
+static unsigned char const clock_table [256] = {
+	7,6,2,8,3,3,5,5,3,2,2,2,4,4,6,6, // 00
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7, // 10
+	6,6,2,8,3,3,5,5,4,2,2,2,4,4,6,6, // 20
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7, // 30
+	6,6,2,8,3,3,5,5,3,2,2,2,3,4,6,6, // 40
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7, // 50
+	6,6,2,8,3,3,5,5,4,2,2,2,5,4,6,6, // 60
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7, // 70
+	2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4, // 80
+	2,6,2,6,4,4,4,4,2,5,2,5,5,5,5,5, // 90
+	2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4, // A0
+	2,5,2,5,4,4,4,4,2,4,2,4,4,4,4,4, // B0
+	2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6, // C0
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7, // D0
+	2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6, // E0
+	2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7 // F0
+};
+
+// Addressing mode of each opcode, with page_penalty set for reads that take
+// an extra clock when indexing crosses a page
+enum {
+	m_imp, m_imm, m_zp, m_zpx, m_zpy, m_abs, m_abx, m_aby, m_izx, m_izy, m_ind, m_rel,
+	mode_mask = 0x0F,
+	page_penalty = 0x10
+};
+
+static unsigned char const mode_table [256] = {
+	0x00,0x08,0x00,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // 00
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06, // 10
+	0x05,0x08,0x00,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // 20
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06, // 30
+	0x00,0x08,0x00,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // 40
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06, // 50
+	0x00,0x08,0x00,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x0A,0x05,0x05,0x05, // 60
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06, // 70
+	0x01,0x08,0x01,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // 80
+	0x0B,0x09,0x00,0x09,0x03,0x03,0x04,0x04,0x00,0x07,0x00,0x07,0x06,0x06,0x07,0x07, // 90
+	0x01,0x08,0x01,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // A0
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x04,0x04,0x00,0x17,0x00,0x07,0x16,0x16,0x17,0x07, // B0
+	0x01,0x08,0x01,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // C0
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06, // D0
+	0x01,0x08,0x01,0x08,0x02,0x02,0x02,0x02,0x00,0x01,0x00,0x01,0x05,0x05,0x05,0x05, // E0
+	0x0B,0x19,0x00,0x09,0x03,0x03,0x03,0x03,0x00,0x17,0x00,0x07,0x06,0x16,0x06,0x06  // F0
+};
+
+// Length of instruction in bytes for each addressing mode
+static unsigned char const mode_lengths [12] = { 1, 2, 2, 2, 2, 3, 3, 3, 2, 2, 3, 2 };
+
+bool Nes_Cpu::run( cpu_time_t end_time )
+{
+	// registers are cached in locals and written back on exit
+	unsigned pc = r.pc;
+	int a = r.a;
+	int x = r.x;
+	int y = r.y;
+	int sp = r.sp;
+	int status = r.status & ~0xC3; // I, D, B and unused bits
+	int c = r.status & 0x01;       // carry in bit 0
+	int v = r.status & 0x40;       // overflow in bit 6
+	int nz = ((r.status & 0x80) << 1) | (~r.status & 0x02); // N in bit 8 or 7, Z if low 8 bits are zero
+	bool halted = false;
+
+	#define PUSH( n )   (write( 0x100 + sp, (n) ), sp = (sp - 1) & 0xFF)
+	#define POP()       (sp = (sp + 1) & 0xFF, read( 0x100 + sp ))
+	#define SET_NZ( n ) (nz = (n))
+	#define FLAG_N()    ((nz & 0x180) != 0)
+	#define FLAG_Z()    ((nz & 0xFF) == 0)
+	#define PACK_STATUS() (status | c | v | (FLAG_N() ? 0x80 : 0) | (FLAG_Z() ? 0x02 : 0))
+	#define UNPACK_STATUS( s ) (status = ((s) & 0x0C) | 0x20, c = (s) & 0x01, v = (s) & 0x40, \
+			nz = (((s) & 0x80) << 1) | (~(s) & 0x02))
+
+	while ( time_ < end_time )
+	{
+		int opcode = read( pc );
+		int mode = mode_table [opcode];
+		int clocks = clock_table [opcode]; // accesses occur at start time
+
+		// effective address
+		cpu_addr_t addr = 0;
+		int operand = read( (pc + 1) & 0xFFFF );
+		switch ( mode & mode_mask )
+		{
+			case m_imm:
+				addr = (pc + 1) & 0xFFFF;
+				break;
+			case m_zp:
+				addr = operand;
+				break;
+			case m_zpx:
+				addr = (operand + x) & 0xFF;
+				break;
+			case m_zpy:
+				addr = (operand + y) & 0xFF;
+				break;
+			case m_abs:
+				addr = operand | (read( (pc + 2) & 0xFFFF ) << 8);
+				break;
+			case m_abx:
+			case m_aby: {
+				cpu_addr_t base = operand | (read( (pc + 2) & 0xFFFF ) << 8);
+				addr = (base + ((mode & mode_mask) == m_abx ? x : y)) & 0xFFFF;
+				if ( (mode & page_penalty) && ((addr ^ base) & 0xFF00) )
+					clocks++;
+				break;
+			}
+			case m_izx: {
+				int zp = (operand + x) & 0xFF;
+				addr = read( zp ) | (read( (zp + 1) & 0xFF ) << 8);
+				break;
+			}
+			case m_izy: {
+				cpu_addr_t base = read( operand ) | (read( (operand + 1) & 0xFF ) << 8);
+				addr = (base + y) & 0xFFFF;
+				if ( (mode & page_penalty) && ((addr ^ base) & 0xFF00) )
+					clocks++;
+				break;
+			}
+			case m_ind: {
+				// 6502 bug: pointer doesn't carry into high byte
+				cpu_addr_t ptr = operand | (read( (pc + 2) & 0xFFFF ) << 8);
+				addr = read( ptr ) | (read( (ptr & 0xFF00) | ((ptr + 1) & 0xFF) ) << 8);
+				break;
+			}
+		}
+
+		pc = (pc + mode_lengths [mode & mode_mask]) & 0xFFFF;
+
+		#define BRANCH( cond ) \
+		{\
+			if ( cond )\
+			{\
+				cpu_addr_t dest = (pc + (BOOST::int8_t) operand) & 0xFFFF;\
+				clocks += 1 + (((dest ^ pc) & 0xFF00) != 0);\
+				pc = dest;\
+			}\
+			break;\
+		}
+
+		switch ( opcode )
+		{
+		// Loads and stores
+
+			case 0xA9: case 0xA5: case 0xB5: case 0xAD: case 0xBD: case 0xB9: case 0xA1: case 0xB1: // LDA
+				SET_NZ( a = read( addr ) );
+				break;
+
+			case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE: // LDX
+				SET_NZ( x = read( addr ) );
+				break;
+
+			case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC: // LDY
+				SET_NZ( y = read( addr ) );
+				break;
+
+			case 0x85: case 0x95: case 0x8D: case 0x9D: case 0x99: case 0x81: case 0x91: // STA
+				write( addr, a );
+				break;
+
+			case 0x86: case 0x96: case 0x8E: // STX
+				write( addr, x );
+				break;
+
+			case 0x84: case 0x94: case 0x8C: // STY
+				write( addr, y );
+				break;
+
+		// Transfers
+
+			case 0xAA: SET_NZ( x = a ); break;  // TAX
+			case 0xA8: SET_NZ( y = a ); break;  // TAY
+			case 0xBA: SET_NZ( x = sp ); break; // TSX
+			case 0x8A: SET_NZ( a = x ); break;  // TXA
+			case 0x9A: sp = x; break;           // TXS
+			case 0x98: SET_NZ( a = y ); break;  // TYA
+
+		// Stack
+
+			case 0x48: PUSH( a ); break; // PHA
+			case 0x08: PUSH( PACK_STATUS() | 0x30 ); break; // PHP
+			case 0x68: SET_NZ( a = POP() ); break; // PLA
+			case 0x28: { // PLP
+				int s = POP();
+				UNPACK_STATUS( s );
+				break;
+			}
+
+		// Arithmetic and logic
+
+			case 0x69: case 0x65: case 0x75: case 0x6D: case 0x7D: case 0x79: case 0x61: case 0x71: // ADC
+			case 0xE9: case 0xE5: case 0xF5: case 0xED: case 0xFD: case 0xF9: case 0xE1: case 0xF1: // SBC
+			case 0xEB: { // unofficial SBC #imm
+				int data = read( addr );
+				if ( (opcode & 0xE0) == 0xE0 )
+					data ^= 0xFF; // SBC is ADC of complement
+				int sum = a + data + c;
+				v = (~(a ^ data) & (a ^ sum) & 0x80) >> 1;
+				c = sum >> 8;
+				SET_NZ( a = sum & 0xFF );
+				break;
+			}
+
+			case 0x29: case 0x25: case 0x35: case 0x2D: case 0x3D: case 0x39: case 0x21: case 0x31: // AND
+				SET_NZ( a &= read( addr ) );
+				break;
+
+			case 0x09: case 0x05: case 0x15: case 0x0D: case 0x1D: case 0x19: case 0x01: case 0x11: // ORA
+				SET_NZ( a |= read( addr ) );
+				break;
+
+			case 0x49: case 0x45: case 0x55: case 0x4D: case 0x5D: case 0x59: case 0x41: case 0x51: // EOR
+				SET_NZ( a ^= read( addr ) );
+				break;
+
+			case 0xC9: case 0xC5: case 0xD5: case 0xCD: case 0xDD: case 0xD9: case 0xC1: case 0xD1: { // CMP
+				int diff = a - read( addr );
+				c = diff >= 0;
+				SET_NZ( diff & 0xFF );
+				break;
+			}
+
+			case 0xE0: case 0xE4: case 0xEC: { // CPX
+				int diff = x - read( addr );
+				c = diff >= 0;
+				SET_NZ( diff & 0xFF );
+				break;
+			}
+
+			case 0xC0: case 0xC4: case 0xCC: { // CPY
+				int diff = y - read( addr );
+				c = diff >= 0;
+				SET_NZ( diff & 0xFF );
+				break;
+			}
+
+			case 0x24: case 0x2C: { // BIT
+				int data = read( addr );
+				v = data & 0x40;
+				// N from operand, Z from AND result
+				nz = ((data & 0x80) << 1) | (a & data);
+				break;
+			}
+
+		// Increments and decrements
+
+			case 0xE6: case 0xF6: case 0xEE: case 0xFE: { // INC
+				int data = (read( addr ) + 1) & 0xFF;
+				write( addr, data );
+				SET_NZ( data );
+				break;
+			}
+
+			case 0xC6: case 0xD6: case 0xCE: case 0xDE: { // DEC
+				int data = (read( addr ) - 1) & 0xFF;
+				write( addr, data );
+				SET_NZ( data );
+				break;
+			}
+
+			case 0xE8: SET_NZ( x = (x + 1) & 0xFF ); break; // INX
+			case 0xC8: SET_NZ( y = (y + 1) & 0xFF ); break; // INY
+			case 0xCA: SET_NZ( x = (x - 1) & 0xFF ); break; // DEX
+			case 0x88: SET_NZ( y = (y - 1) & 0xFF ); break; // DEY
+
+		// Shifts
+
+			case 0x0A: // ASL A
+				c = a >> 7;
+				SET_NZ( a = (a << 1) & 0xFF );
+				break;
+
+			case 0x4A: // LSR A
+				c = a & 1;
+				SET_NZ( a >>= 1 );
+				break;
+
+			case 0x2A: { // ROL A
+				int n = (a << 1) | c;
+				c = a >> 7;
+				SET_NZ( a = n & 0xFF );
+				break;
+			}
+
+			case 0x6A: { // ROR A
+				int n = (a >> 1) | (c << 7);
+				c = a & 1;
+				SET_NZ( a = n );
+				break;
+			}
+
+			case 0x06: case 0x16: case 0x0E: case 0x1E: { // ASL
+				int data = read( addr );
+				c = data >> 7;
+				data = (data << 1) & 0xFF;
+				write( addr, data );
+				SET_NZ( data );
+				break;
+			}
+
+			case 0x46: case 0x56: case 0x4E: case 0x5E: { // LSR
+				int data = read( addr );
+				c = data & 1;
+				data >>= 1;
+				write( addr, data );
+				SET_NZ( data );
+				break;
+			}
+
+			case 0x26: case 0x36: case 0x2E: case 0x3E: { // ROL
+				int data = read( addr );
+				int n = ((data << 1) | c) & 0xFF;
+				c = data >> 7;
+				write( addr, n );
+				SET_NZ( n );
+				break;
+			}
+
+			case 0x66: case 0x76: case 0x6E: case 0x7E: { // ROR
+				int data = read( addr );
+				int n = (data >> 1) | (c << 7);
+				c = data & 1;
+				write( addr, n );
+				SET_NZ( n );
+				break;
+			}
+
+		// Jumps and branches
+
+			case 0x4C: case 0x6C: // JMP
+				pc = addr;
+				break;
+
+			case 0x20: // JSR
+				PUSH( ((pc - 1) & 0xFFFF) >> 8 );
+				PUSH( (pc - 1) & 0xFF );
+				pc = addr;
+				break;
+
+			case 0x60: { // RTS
+				int lo = POP();
+				int hi = POP();
+				pc = (((hi << 8) | lo) + 1) & 0xFFFF;
+				break;
+			}
+
+			case 0x40: { // RTI
+				int s = POP();
+				UNPACK_STATUS( s );
+				int lo = POP();
+				int hi = POP();
+				pc = (hi << 8) | lo;
+				break;
+			}
+
+			case 0x00: { // BRK
+				pc = (pc + 1) & 0xFFFF; // skip padding byte
+				PUSH( pc >> 8 );
+				PUSH( pc & 0xFF );
+				PUSH( PACK_STATUS() | 0x30 );
+				status |= 0x04;
+				pc = read( 0xFFFE ) | (read( 0xFFFF ) << 8);
+				break;
+			}
+
+			case 0x10: BRANCH( !FLAG_N() ) // BPL
+			case 0x30: BRANCH( FLAG_N() )  // BMI
+			case 0x50: BRANCH( !v )        // BVC
+			case 0x70: BRANCH( v )         // BVS
+			case 0x90: BRANCH( !c )        // BCC
+			case 0xB0: BRANCH( c )         // BCS
+			case 0xD0: BRANCH( !FLAG_Z() ) // BNE
+			case 0xF0: BRANCH( FLAG_Z() )  // BEQ
+
+		// Flags
+
+			case 0x18: c = 0; break;              // CLC
+			case 0x38: c = 1; break;              // SEC
+			case 0x58: status &= ~0x04; break;    // CLI
+			case 0x78: status |= 0x04; break;     // SEI
+			case 0xB8: v = 0; break;              // CLV
+			case 0xD8: status &= ~0x08; break;    // CLD
+			case 0xF8: status |= 0x08; break;     // SED
+
+			case 0xEA: // NOP
+				break;
+
+			case 0x02: case 0x12: case 0x22: case 0x32: case 0x42: case 0x52: // JAM
+			case 0x62: case 0x72: case 0x92: case 0xB2: case 0xD2: case 0xF2:
+				pc = (pc - 1) & 0xFFFF;
+				halted = true;
+				goto stop;
+
+			default:
+				// unofficial: skip operand bytes only
+				unofficial_count_++;
+				break;
+		}
+
+		time_ += clocks;
+	}
+
+	#undef BRANCH
+stop:
+	r.pc = pc;
+	r.a = a;
+	r.x = x;
+	r.y = y;
+	r.sp = sp;
+	r.status = PACK_STATUS();
+
+	#undef PUSH
+	#undef POP
+	#undef SET_NZ
+	#undef FLAG_N
+	#undef FLAG_Z
+	#undef PACK_STATUS
+	#undef UNPACK_STATUS
+
+	return halted;
+}
+
@@ -0,0 +1,98 @@
+
+// 6502 CPU emulator for running NSF music drivers
+
+// Implements all official instructions with NES (2A03) timing, without
+// decimal mode. Unofficial instructions are executed as NOPs of the same
+// length, and the JAM instructions halt the CPU.
+
+#ifndef NES_CPU_H
+#define NES_CPU_H
+
+#include "nes_apu/Nes_Apu.h"
+
+class Nes_Cpu {
+public:
+	typedef BOOST::uint8_t byte;
+
+	Nes_Cpu();
+
+	// Memory is mapped in pages. Accesses to unmapped pages go to the I/O
+	// functions, which receive the CPU time of the access.
+	enum { page_bits = 11 };
+	enum { page_size = 1L << page_bits };
+	enum { page_count = 0x10000L >> page_bits };
+	typedef int (*read_func_t)( void* user_data, cpu_addr_t );
+	typedef void (*write_func_t)( void* user_data, cpu_time_t, cpu_addr_t, int data );
+	void set_io( read_func_t, write_func_t, void* user_data );
+
+	// Map size bytes at start to memory. Where write is NULL, writes go to
+	// the I/O write function (mapper and sound registers overlay ROM). Start
+	// and size must be multiples of page_size.
+	void map_memory( cpu_addr_t start, long size, byte const* read, byte* write = 0 );
+	void unmap_memory( cpu_addr_t start, long size );
+
+	// Registers, valid between calls to run()
+	struct registers_t {
+		unsigned pc;
+		int a;
+		int x;
+		int y;
+		int sp;
+		int status;
+	};
+	registers_t r;
+
+	// Reset registers and time. Memory map is unchanged.
+	void reset();
+
+	// Push address that RTS will return to
+	void push_return( cpu_addr_t );
+
+	// Run until end_time is reached or a JAM instruction is executed. Returns
+	// true if halted by JAM, with PC pointing at it.
+	enum { halt_opcode = 0xF2 };
+	bool run( cpu_time_t end_time );
+
+	// Current time in clocks
+	cpu_time_t time() const { return time_; }
+
+	// Subtract count from current time, at end of frame
+	void end_frame( cpu_time_t count ) { time_ -= count; }
+
+	// Number of unofficial instructions executed since reset
+	long unofficial_count() const { return unofficial_count_; }
+
+	// Read memory through memory map and I/O functions
+	int read( cpu_addr_t );
+
+private:
+	byte const* read_pages [page_count];
+	byte* write_pages [page_count];
+	read_func_t read_io;
+	write_func_t write_io;
+	void* io_data;
+	cpu_time_t time_;
+	long unofficial_count_;
+
+	void write( cpu_addr_t, int data );
+};
+
+inline int Nes_Cpu::read( cpu_addr_t addr )
+{
+	byte const* p = read_pages [addr >> page_bits];
+	if ( p )
+		return p [addr & (page_size - 1)];
+	return read_io( io_data, addr );
+}
+
+inline void Nes_Cpu::write( cpu_addr_t addr, int data )
+{
+	byte* p = write_pages [addr >> page_bits];
+	if ( p )
+		p [addr & (page_size - 1)] = (byte) data;
+	else
+		write_io( io_data, time_, addr, data );
+}
+
+#endif
+
@@ -0,0 +1,366 @@
+
+#include "Nsf_Player.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline unsigned get_le16( unsigned char const* p )
+{
+	return p [0] | (p [1] << 8);
+}
+
+Nsf_Player::Nsf_Player()
+{
+	apu = NULL;
+	rom = NULL;
+	unload();
+}
+
+Nsf_Player::~Nsf_Player()
+{
+	unload();
+}
+
+void Nsf_Player::unload()
+{
+	free( rom );
+	rom = NULL;
+	bank_count = 0;
+	banked = false;
+	pal = false;
+	fds = false;
+	expansion_ = Simple_Apu::expansion_none;
+	load_addr = 0;
+	init_addr = 0;
+	play_addr = 0;
+	play_period = 0;
+	play_extra = 0;
+	in_routine = false;
+	memset( header, 0, sizeof header );
+	memset( info, 0, sizeof info );
+}
+
+blargg_err_t Nsf_Player::load( const char* path )
+{
+	FILE* file = fopen( path, "rb" );
+	if ( !file )
+		return "Couldn't open NSF file";
+
+	fseek( file, 0, SEEK_END );
+	long size = ftell( file );
+	rewind( file );
+
+	void* data = malloc( size > 0 ? size : 1 );
+	if ( !data )
+	{
+		fclose( file );
+		return "Out of memory";
+	}
+
+	blargg_err_t err = NULL;
+	if ( fread( data, 1, size, file ) != (size_t) size )
+		err = "Couldn't read NSF file";
+	fclose( file );
+
+	if ( !err )
+		err = load_mem( data, size );
+	free( data );
+	return err;
+}
+
+blargg_err_t Nsf_Player::load_mem( void const* data, long size )
+{
+	unload();
+
+	unsigned char const* in = (unsigned char const*) data;
+	if ( size < (long) sizeof header || memcmp( in, "NESM\x1A", 5 ) )
+		return "Not an NSF file";
+
+	memcpy( header, in, sizeof header );
+	for ( int i = 0; i < 3; i++ )
+		memcpy( info [i], header + 0x0E + i * 32, 32 );
+
+	load_addr = get_le16( header + 0x08 );
+	init_addr = get_le16( header + 0x0A );
+	play_addr = get_le16( header + 0x0C );
+	if ( load_addr < 0x6000 || init_addr < 0x6000 || play_addr < 0x6000 )
+		return "NSF file has invalid addresses";
+
+	// region: bit 0 = PAL, bit 1 = dual
+	pal = (header [0x7A] & 3) == 1;
+
+	int const flags = header [0x7B];
+	fds = (flags & 0x04) != 0;
+	if ( flags & 0x01 )      expansion_ = Simple_Apu::expansion_vrc6;
+	else if ( flags & 0x02 ) expansion_ = Simple_Apu::expansion_vrc7;
+	else if ( flags & 0x04 ) expansion_ = Simple_Apu::expansion_fds;
+	else if ( flags & 0x08 ) expansion_ = Simple_Apu::expansion_mmc5;
+	else if ( flags & 0x10 ) expansion_ = Simple_Apu::expansion_namco;
+	else if ( flags & 0x20 ) expansion_ = Simple_Apu::expansion_sunsoft;
+
+	for ( int i = 0; i < 8; i++ )
+		if ( header [0x70 + i] )
+			banked = true;
+
+	// NSF2 files may give program length, with metadata following it
+	long data_size = size - (long) sizeof header;
+	long program_size = header [0x7D] | (header [0x7E] << 8) | ((long) header [0x7F] << 16);
+	if ( header [0x05] >= 2 && program_size && program_size < data_size )
+		data_size = program_size;
+
+	// Image is padded so that load address falls at its offset within a bank.
+	// Without bank switching, banks map in order from $8000 ($6000 for FDS).
+	long pad = banked ? (load_addr & (bank_size - 1)) : load_addr - (fds ? 0x6000 : 0x8000);
+	if ( pad < 0 )
+		return "NSF file has invalid load address";
+	long rom_size = (pad + data_size + bank_size - 1) / bank_size * bank_size;
+	if ( !banked && rom_size < bank_reg_count * (long) bank_size )
+		rom_size = bank_reg_count * (long) bank_size;
+
+	rom = (unsigned char*) malloc( rom_size );
+	if ( !rom )
+		return "Out of memory";
+	memset( rom, 0, rom_size );
+	memcpy( rom + pad, in + sizeof header, data_size );
+	bank_count = rom_size / bank_size;
+
+	return NULL;
+}
+
+void Nsf_Player::map_bank( int reg, int bank )
+{
+	bank %= bank_count;
+	unsigned char const* data = rom + (long) bank * bank_size;
+	cpu_addr_t addr = 0x6000 + reg * bank_size;
+
+	if ( fds && addr < 0xE000 )
+	{
+		// FDS has RAM here, and bank switching copies into it
+		memcpy( fds_ram + (addr - 0x6000), data, bank_size );
+	}
+	else if ( addr >= 0x8000 )
+	{
+		cpu.map_memory( addr, bank_size, data );
+	}
+}
+
+blargg_err_t Nsf_Player::start_track( Simple_Apu* a, int track, long sample_rate )
+{
+	assert( rom ); // file must be loaded
+	apu = a;
+
+	long clock_rate = pal ? 1662607 : 1789773;
+	blargg_err_t err = apu->sample_rate( sample_rate, pal );
+	if ( err )
+		return err;
+	err = apu->set_audio_expansion( expansion_ );
+	if ( err )
+		return err;
+	apu->dmc_reader( read_dmc, this );
+	apu->reset();
+
+	// play routine period is given in microseconds
+	unsigned period_us = get_le16( header + (pal ? 0x78 : 0x6E ) );
+	if ( !period_us )
+		period_us = pal ? 20000 : 16639;
+	play_period = (double) period_us * clock_rate / 1000000;
+	play_extra = 0;
+
+	// memory
+	memset( ram, 0, sizeof ram );
+	memset( sram, 0, sizeof sram );
+	memset( fds_ram, 0, sizeof fds_ram );
+	memset( exram, 0, sizeof exram );
+	mul [0] = 0xFF;
+	mul [1] = 0xFF;
+
+	cpu.reset();
+	cpu.set_io( read_io_, write_io_, this );
+	for ( cpu_addr_t addr = 0; addr < 0x2000; addr += sizeof ram )
+		cpu.map_memory( addr, sizeof ram, ram, ram );
+	if ( fds )
+		cpu.map_memory( 0x6000, sizeof fds_ram, fds_ram, fds_ram );
+	else
+		cpu.map_memory( 0x6000, sizeof sram, sram, sram );
+
+	if ( banked )
+	{
+		for ( int i = 0; i < 8; i++ )
+			map_bank( i + 2, header [0x70 + i] );
+
+		// FDS banks for $6000-$7FFF are given by banks for $E000-$FFFF
+		if ( fds )
+		{
+			map_bank( 0, header [0x76] );
+			map_bank( 1, header [0x77] );
+		}
+	}
+	else
+	{
+		for ( int i = fds ? 0 : 2; i < bank_reg_count; i++ )
+			map_bank( i, i - (fds ? 0 : 2) );
+	}
+
+	// sound registers to power-up state
+	for ( cpu_addr_t addr = 0x4000; addr < 0x4014; addr++ )
+		apu->write_register( 0, addr, 0 );
+	apu->write_register( 0, 0x4015, 0x0F );
+	apu->write_register( 0, 0x4017, 0x40 );
+	if ( expansion_ == Simple_Apu::expansion_fds )
+	{
+		apu->write_register( 0, 0x4080, 0x80 );
+		apu->write_register( 0, 0x408A, 0xE8 );
+	}
+
+	// init routine gets track in A and region in X
+	cpu.r.a = track;
+	cpu.r.x = pal;
+	call( init_addr );
+
+	return NULL;
+}
+
+void Nsf_Player::call( cpu_addr_t addr )
+{
+	cpu.push_return( halt_addr );
+	cpu.r.pc = addr;
+	in_routine = true;
+}
+
+void Nsf_Player::run_frame()
+{
+	play_extra += play_period;
+	blip_time_t length = (blip_time_t) play_extra;
+	play_extra -= length;
+
+	// play routine is called once per frame, unless it's still running
+	if ( !in_routine )
+		call( play_addr );
+
+	if ( cpu.run( length ) )
+	{
+		// CPU idles until next call
+		in_routine = false;
+		cpu.end_frame( cpu.time() );
+	}
+	else
+	{
+		cpu.end_frame( length );
+	}
+
+	apu->end_frame( length );
+}
+
+long Nsf_Player::play( Simple_Apu::sample_t* out, long count )
+{
+	assert( apu ); // start_track() must have been called
+
+	// Samples are read after each frame since VRC7 and Sunsoft 5B output
+	// is mixed at read time, rather than at the time of register writes
+	long n = 0;
+	while ( n < count )
+	{
+		if ( !apu->samples_avail() )
+			run_frame();
+		n += apu->read_samples( out + n, count - n );
+	}
+	return n;
+}
+
+int Nsf_Player::read_io( cpu_addr_t addr )
+{
+	if ( addr == halt_addr )
+		return Nes_Cpu::halt_opcode;
+
+	if ( addr == 0x4015 )
+		return apu->read_status( cpu.time() );
+
+	if ( expansion_ == Simple_Apu::expansion_mmc5 )
+	{
+		if ( addr == 0x5205 )
+			return (mul [0] * mul [1]) & 0xFF;
+		if ( addr == 0x5206 )
+			return (mul [0] * mul [1]) >> 8;
+		if ( addr >= 0x5C00 && addr < 0x5FF6 )
+			return exram [addr - 0x5C00];
+	}
+
+	return addr >> 8; // open bus
+}
+
+void Nsf_Player::write_io( cpu_time_t time, cpu_addr_t addr, int data )
+{
+	if ( addr >= bank_reg_addr && addr < bank_reg_addr + bank_reg_count )
+	{
+		int reg = addr - bank_reg_addr;
+		if ( fds || reg >= 2 )
+			map_bank( reg, data );
+		return;
+	}
+
+	if ( addr >= Nes_Apu::start_addr && addr <= Nes_Apu::end_addr )
+	{
+		if ( addr != 0x4014 && addr != 0x4016 )
+			apu->write_register( time, addr, data );
+		return;
+	}
+
+	// only forward writes that belong to the expansion chip, since
+	// Simple_Apu passes everything else outside the 2A03 range to it
+	bool forward = false;
+	switch ( expansion_ )
+	{
+		case Simple_Apu::expansion_vrc6:
+			forward = addr >= 0x9000 && addr < 0xC000 && (addr & 0x0FFF) < 3;
+			break;
+
+		case Simple_Apu::expansion_vrc7:
+			forward = addr == 0x9010 || addr == 0x9030;
+			break;
+
+		case Simple_Apu::expansion_fds:
+			forward = addr >= 0x4040 && addr <= 0x408A;
+			// Nes_Fds doesn't implement volume and sweep envelopes; use
+			// direct mode so envelope speed writes give steady output
+			if ( addr == 0x4080 || addr == 0x4084 )
+				data |= 0x80;
+			break;
+
+		case Simple_Apu::expansion_mmc5:
+			forward = addr >= 0x5000 && addr <= 0x5015;
+			if ( addr == 0x5205 || addr == 0x5206 )
+				mul [addr - 0x5205] = data;
+			else if ( addr >= 0x5C00 && addr < 0x5FF6 )
+				exram [addr - 0x5C00] = data;
+			break;
+
+		case Simple_Apu::expansion_namco:
+			forward = (addr >= 0x4800 && addr < 0x5000) || addr >= 0xF800;
+			break;
+
+		case Simple_Apu::expansion_sunsoft:
+			forward = addr >= 0xC000;
+			break;
+	}
+
+	if ( forward )
+		apu->write_register( time, addr, data );
+}
+
+int Nsf_Player::read_io_( void* self, cpu_addr_t addr )
+{
+	return ((Nsf_Player*) self)->read_io( addr );
+}
+
+void Nsf_Player::write_io_( void* self, cpu_time_t time, cpu_addr_t addr, int data )
+{
+	((Nsf_Player*) self)->write_io( time, addr, data );
+}
+
+int Nsf_Player::read_dmc( void* self, cpu_addr_t addr )
+{
+	return ((Nsf_Player*) self)->cpu.read( addr );
+}
+
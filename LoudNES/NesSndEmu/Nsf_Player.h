@@ -0,0 +1,104 @@
+
+// NSF (NES Sound Format) player for Simple_Apu
+
+// Runs the music driver in an NSF file on a 6502 core and routes its sound
+// register writes into Simple_Apu at the clock they occur. Only what audio
+// needs is emulated: CPU, RAM, bank switching and sound chips (no PPU, no
+// interrupts), so tracks render many times faster than real time.
+
+#ifndef NSF_PLAYER_H
+#define NSF_PLAYER_H
+
+#include "Simple_Apu.h"
+#include "Nes_Cpu.h"
+
+class Nsf_Player {
+public:
+	Nsf_Player();
+	~Nsf_Player();
+
+	// Load NSF file
+	blargg_err_t load( const char* path );
+
+	// Load NSF file from memory. Data is copied.
+	blargg_err_t load_mem( void const* data, long size );
+
+	void unload();
+
+	// Number of tracks in file, and track to start with by default (0-based)
+	int track_count() const { return header [0x06]; }
+	int default_track() const { return header [0x07] ? header [0x07] - 1 : 0; }
+
+	// Information strings from header (not necessarily terminated in file)
+	const char* game() const { return info [0]; }
+	const char* author() const { return info [1]; }
+	const char* copyright() const { return info [2]; }
+
+	// Expansion chip used for playback (Simple_Apu::expansion_*). Simple_Apu
+	// supports one expansion, so for files using several, the first of VRC6,
+	// VRC7, FDS, MMC5, Namco 163 and Sunsoft 5B is used.
+	int expansion() const { return expansion_; }
+
+	// Expansion chip flags from header
+	int expansion_flags() const { return header [0x7B]; }
+
+	// True if file is PAL-only
+	bool is_pal() const { return pal; }
+
+	// Set up APU at specified sample rate and start track (0-based). Player
+	// sets APU's DMC reader and expansion, and must outlive playback.
+	blargg_err_t start_track( Simple_Apu*, int track, long sample_rate );
+
+	// Render count samples into out and return number rendered
+	long play( Simple_Apu::sample_t* out, long count );
+
+	// Number of unofficial 6502 instructions the driver executed. These are
+	// run as NOPs, so a non-zero count means playback may be wrong.
+	long unofficial_count() const { return cpu.unofficial_count(); }
+
+private:
+	enum { bank_size = 0x1000 };
+	enum { bank_reg_addr = 0x5FF6 };
+	enum { bank_reg_count = 10 };
+	enum { halt_addr = 0x4100 }; // unused I/O address where routines return to
+
+	Nes_Cpu cpu;
+	Simple_Apu* apu;
+	unsigned char header [0x80];
+	char info [3] [33];
+	unsigned char* rom;
+	int bank_count;
+	bool banked;
+	bool pal;
+	bool fds;
+	int expansion_;
+	cpu_addr_t load_addr;
+	cpu_addr_t init_addr;
+	cpu_addr_t play_addr;
+	double play_period;  // clocks between calls to play routine
+	double play_extra;   // fraction of clock carried into next frame
+	bool in_routine;     // init or play routine hasn't returned yet
+	int mul [2];         // MMC5 multiplier operands
+
+	unsigned char ram [0x800];
+	unsigned char sram [0x2000];     // $6000-$7FFF
+	unsigned char fds_ram [0x8000];  // $6000-$DFFF for FDS
+	unsigned char exram [0x400];     // MMC5 $5C00-$5FFF
+
+	// not supported
+	Nsf_Player( const Nsf_Player& );
+	Nsf_Player& operator = ( const Nsf_Player& );
+
+	void map_bank( int reg, int bank );
+	void call( cpu_addr_t );
+	void run_frame();
+	int read_io( cpu_addr_t );
+	void write_io( cpu_time_t, cpu_addr_t, int data );
+
+	static int read_io_( void*, cpu_addr_t );
+	static void write_io_( void*, cpu_time_t, cpu_addr_t, int data );
+	static int read_dmc( void*, cpu_addr_t );
+};
+
+#endif
+
@@ -3,6 +3,8 @@
 
 #include "Simple_Apu.h"
 
+#include <string.h>
+
 /* Copyright (C) 2003-2005 Shay Green. This module is free software; you
 can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -14,11 +16,103 @@ more details. You should have received a copy of the GNU Lesser General
 Public License along with this module; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
 
+#include "nes_apu/blargg_source.h"
+
 static int null_dmc_reader( void*, cpu_addr_t )
 {
 	return 0x55; // causes dmc sample to be flat
 }
 
+// An expansion chip, as Simple_Apu uses it. Expansion_Chip below fills this in
+// for each chip, with the differences between them in the helpers before it.
+class Simple_Apu::Expansion {
+public:
+	Expansion( int oscs, bool mixes ) : osc_count( oscs ), mixes_samples( mixes ) { }
+	virtual ~Expansion() { }
+	
+	int const osc_count;      // channels after the 2A03's
+	bool const mixes_samples; // renders its own samples, in mix_samples()
+	
+	virtual void output( Blip_Buffer* ) = 0;
+	virtual void osc_output( int index, Blip_Buffer*, bool enabled ) = 0;
+	virtual void treble_eq( blip_eq_t const& ) = 0;
+	virtual void reset() = 0;
+	virtual void write_registers( queued_write_t const* begin, queued_write_t const* end ) = 0;
+	virtual void write_shadow_register( int addr, int data ) = 0;
+	virtual void start_seeking() = 0;
+	virtual void stop_seeking( blip_time_t& ) = 0;
+	virtual void end_frame( blip_time_t ) = 0;
+	virtual void mix_samples( sample_t*, long ) { }
+};
+
+// VRC7 and Sunsoft 5B render their own samples, so channels are muted rather
+// than given a buffer, and there's no eq. FDS has its one channel.
+template<class Chip>
+static void expansion_osc_output( Chip& chip, int i, Blip_Buffer* b, bool ) { chip.osc_output( i, b ); }
+static void expansion_osc_output( Nes_Fds& chip, int, Blip_Buffer* b, bool ) { chip.output( b ); }
+static void expansion_osc_output( Nes_Vrc7& chip, int i, Blip_Buffer*, bool e ) { chip.enable_channel( i, e ); }
+static void expansion_osc_output( Nes_Sunsoft& chip, int i, Blip_Buffer*, bool e ) { chip.enable_channel( i, e ); }
+
+// TODO: VRC7 + Sunsoft eq.
+template<class Chip>
+static void expansion_treble_eq( Chip& chip, blip_eq_t const& eq ) { chip.treble_eq( eq ); }
+static void expansion_treble_eq( Nes_Vrc7&, blip_eq_t const& ) { }
+static void expansion_treble_eq( Nes_Sunsoft&, blip_eq_t const& ) { }
+
+template<class Chip>
+static void expansion_mix( Chip&, blip_sample_t*, long ) { }
+static void expansion_mix( Nes_Vrc7& chip, blip_sample_t* p, long s )
+{
+	NES_COUNT_RUN( chip_vrc7 );
+	chip.mix_samples( p, s );
+}
+static void expansion_mix( Nes_Sunsoft& chip, blip_sample_t* p, long s )
+{
+	NES_COUNT_RUN( chip_sunsoft );
+	chip.mix_samples( p, s );
+}
+
+template<class Chip>
+class Expansion_Chip : public Simple_Apu::Expansion {
+	Chip chip;
+public:
+	Expansion_Chip( int oscs, bool mixes = false ) : Expansion( oscs, mixes ) { }
+	
+	void output( Blip_Buffer* b ) { chip.output( b ); }
+	void osc_output( int i, Blip_Buffer* b, bool e ) { expansion_osc_output( chip, i, b, e ); }
+	void treble_eq( blip_eq_t const& eq ) { expansion_treble_eq( chip, eq ); }
+	void reset() { chip.reset(); }
+	void write_shadow_register( int addr, int data ) { chip.write_shadow_register( addr, data ); }
+	void start_seeking() { chip.start_seeking(); }
+	void stop_seeking( blip_time_t& t ) { chip.stop_seeking( t ); }
+	void end_frame( blip_time_t t ) { chip.end_frame( t ); }
+	void mix_samples( Simple_Apu::sample_t* p, long s ) { expansion_mix( chip, p, s ); }
+	
+	// Writes for the chip, in time order
+	void write_registers( Simple_Apu::queued_write_t const* w,
+			Simple_Apu::queued_write_t const* end )
+	{
+		for ( ; w < end; w++ )
+			if ( w->addr < Nes_Apu::start_addr || w->addr > Nes_Apu::end_addr )
+				chip.write_register( w->time, w->addr, w->data );
+	}
+};
+
+// The chip set: each expansion and its number of channels
+Simple_Apu::Expansion* Simple_Apu::new_expansion( int type )
+{
+	switch ( type )
+	{
+		case expansion_vrc6:    return BLARGG_NEW Expansion_Chip<Nes_Vrc6>( Nes_Vrc6::osc_count );
+		case expansion_vrc7:    return BLARGG_NEW Expansion_Chip<Nes_Vrc7>( 6, true );
+		case expansion_fds:     return BLARGG_NEW Expansion_Chip<Nes_Fds>( 1 );
+		case expansion_mmc5:    return BLARGG_NEW Expansion_Chip<Nes_Mmc5>( 2 );
+		case expansion_namco:   return BLARGG_NEW Expansion_Chip<Nes_Namco>( Nes_Namco::osc_count );
+		case expansion_sunsoft: return BLARGG_NEW Expansion_Chip<Nes_Sunsoft>( 3, true );
+	}
+	return NULL;
+}
+
 Simple_Apu::Simple_Apu()
 {
 	pal_mode = false;
@@ -26,11 +120,26 @@ Simple_Apu::Simple_Apu()
 	time = 0;
 	frame_length = 29780;
 	expansion = expansion_none;
+	chip = NULL;
+	expansion_eqs_set = 0;
+	logger = NULL;
+	split_msec = 0;
+	split = false;
+	mixer_reserved = false;
+	nonlinear = false;
+	channels_disabled = 0;
+	stats_enabled = false;
+	reg_cache_enabled = false;
+	write_count = 0;
+	clear_cpu_stats();
+	clear_counters();
+	clear_reg_cache();
 	apu.dmc_reader( null_dmc_reader, NULL );
 }
 
 Simple_Apu::~Simple_Apu()
 {
+	delete chip;
 }
 
 void Simple_Apu::dmc_reader( int (*f)( void* user_data, cpu_addr_t ), void* p )
@@ -43,55 +152,154 @@ blargg_err_t Simple_Apu::sample_rate( long rate, bool pal)
 {
 	pal_mode = pal;
 	frame_length = pal ? 33247 : 29780;
+	channels_disabled = 0;
 	apu.output( &buf );
-	vrc6.output(&buf);
-	vrc7.output(&buf);
-	fds.output(&buf);
-	mmc5.output(&buf);
-	namco.output(&buf);
-	sunsoft.output(&buf);
 	buf.clock_rate( pal ? 1662607 : 1789773 );
-	return buf.sample_rate( rate );
+	BLARGG_RETURN_ERR( buf.sample_rate( rate ) );
+	if ( chip )
+		chip->output( &buf );
+	if ( split_msec )
+	{
+		channel_bufs.clock_rate( buf.clock_rate() );
+		BLARGG_RETURN_ERR( channel_bufs.sample_rate( buf.sample_rate(), split_msec ) );
+	}
+	if ( mixer_reserved )
+	{
+		mixer.clock_rate( buf.clock_rate() );
+		BLARGG_RETURN_ERR( mixer.sample_rate( buf.sample_rate(), buf.length() ) );
+		if ( nonlinear )
+			apu.buffer_cleared();
+	}
+	if ( split || nonlinear )
+		route_outputs();
+	return blargg_success;
+}
+
+blargg_err_t Simple_Apu::reserve_split_outputs( int msec )
+{
+	if ( !msec )
+		split_outputs( false );
+	split_msec = msec;
+	BLARGG_RETURN_ERR( channel_bufs.set_channel_count( msec ? max_channels : 0 ) );
+	if ( msec )
+	{
+		channel_bufs.clock_rate( buf.clock_rate() );
+		BLARGG_RETURN_ERR( channel_bufs.sample_rate( buf.sample_rate(), msec ) );
+	}
+	clear_buffers();
+	return blargg_success;
+}
+
+void Simple_Apu::split_outputs( bool s )
+{
+	require( !s || split_msec );
+	bool clear = split && !s;
+	split = s;
+	route_outputs();
+	// channel buffers are kept silent while unsplit (see remove_samples())
+	if ( clear )
+		clear_buffers();
+}
+
+blargg_err_t Simple_Apu::nonlinear_mixing( bool b )
+{
+	if ( b == nonlinear )
+		return blargg_success;
+	if ( b && !mixer_reserved )
+		BLARGG_RETURN_ERR( reserve_nonlinear_mixing() );
+	nonlinear = b;
+	mixer.enable( apu, b );
+	route_outputs();
+	if ( buf.length() )
+		clear_buffers();
+	return blargg_success;
+}
+
+blargg_err_t Simple_Apu::reserve_nonlinear_mixing()
+{
+	mixer.prepare( apu );
+	if ( !mixer_reserved && buf.length() ) // otherwise sample_rate() allocates them
+	{
+		mixer.clock_rate( buf.clock_rate() );
+		BLARGG_RETURN_ERR( mixer.sample_rate( buf.sample_rate(), buf.length() ) );
+	}
+	mixer_reserved = true;
+	return blargg_success;
+}
+
+// The mixer's levels only follow the APU's amplitudes from zero, so when it's
+// cleared the oscillators start over from zero too
+void Simple_Apu::clear_buffers()
+{
+	buf.clear();
+	if ( split_msec )
+		channel_bufs.clear();
+	if ( nonlinear )
+	{
+		mixer.clear();
+		apu.buffer_cleared();
+	}
+}
+
+Blip_Buffer* Simple_Apu::channel_output( int idx )
+{
+	if ( split )
+		return channel_bufs.buffer( idx );
+	if ( nonlinear && idx < Nes_Apu::osc_count )
+		return idx < 2 ? mixer.pulse_buffer() : mixer.tnd_buffer();
+	return &buf;
+}
+
+void Simple_Apu::route_outputs()
+{
+	for ( int i = 0; i < channel_count(); i++ )
+		enable_channel( i, !(channels_disabled >> i & 1) );
 }
 
 void Simple_Apu::enable_channel(int idx, bool enable)
 {
+	if ( enable )
+		channels_disabled &= ~(1 << idx);
+	else
+		channels_disabled |= 1 << idx;
+	
+	Blip_Buffer* output = enable ? channel_output( idx ) : NULL;
 	if (idx < 5)
 	{
-		apu.osc_output(idx, enable ? &buf : NULL);
+		apu.osc_output(idx, output);
 	}
-	else
+	else if (chip)
 	{
-		idx -= 5;
-
-		switch (expansion)
-		{
-			case expansion_vrc6: vrc6.osc_output(idx, enable ? &buf : NULL); break;
-			case expansion_vrc7: vrc7.enable_channel(idx, enable); break;
-			case expansion_fds: fds.output(enable ? &buf : NULL); break;
-			case expansion_mmc5: mmc5.osc_output(idx, enable ? &buf : NULL); break;
-			case expansion_namco: namco.osc_output(idx, enable ? &buf : NULL); break;
-			case expansion_sunsoft: sunsoft.enable_channel(idx, enable); break;
-		}
+		chip->osc_output(idx - 5, output, enable);
 	}
 }
 
+int Simple_Apu::channel_count() const
+{
+	return Nes_Apu::osc_count + (chip ? chip->osc_count : 0);
+}
+
 void Simple_Apu::treble_eq(int exp, double treble, int cutoff, int sample_rate)
 {
 	blip_eq_t eq(blip_eq_t(treble, cutoff, sample_rate));
 
-	// TODO: VRC7 + Sunsoft eq.
-	switch (exp)
+	if (exp == expansion_none)
+		apu.treble_eq(eq);
+	else if (exp > expansion_none && exp < expansion_count)
 	{
-		case expansion_none: apu.treble_eq(eq); break;
-		case expansion_vrc6: vrc6.treble_eq(eq); break;
-		case expansion_fds: fds.treble_eq(eq); break;
-		case expansion_mmc5: mmc5.treble_eq(eq); break;
-		case expansion_namco: namco.treble_eq(eq); break;
+		expansion_eqs[exp] = eq;
+		expansion_eqs_set |= 1 << exp;
 	}
+	if (chip && exp == expansion)
+		chip->treble_eq(eq);
 }
 
 void Simple_Apu::write_register(cpu_addr_t addr, int data)
+{
+	write_register(seeking ? time : clock(), addr, data);
+}
+
+void Simple_Apu::write_register(blip_time_t t, cpu_addr_t addr, int data)
 {
 	if (seeking)
 	{
@@ -99,113 +307,226 @@ void Simple_Apu::write_register(cpu_addr_t addr, int data)
 		{
 			apu.write_shadow_register(addr, data);
 		}
-		else
+		else if (chip)
 		{
-			switch (expansion)
-			{
-				case expansion_vrc6: vrc6.write_shadow_register(addr, data); break;
-				case expansion_vrc7: vrc7.write_shadow_register(addr, data); break;
-				case expansion_fds: fds.write_shadow_register(addr, data); break;
-				case expansion_mmc5: mmc5.write_shadow_register(addr, data); break;
-				case expansion_namco: namco.write_shadow_register(addr, data); break;
-				case expansion_sunsoft: sunsoft.write_shadow_register(addr, data); break;
-			}
+			chip->write_shadow_register(addr, data);
 		}
 	}
 	else
 	{
-		if (addr >= Nes_Apu::start_addr && addr <= Nes_Apu::end_addr)
-		{
-			apu.write_register(clock(), addr, data);
-		}
-		else
+		NES_COUNTERS_SCOPE( &counts );
+
+		if (t > time)
+			time = t;
+
+		int slot = reg_cache_slot( addr );
+		if ( slot >= 0 )
 		{
-			switch (expansion)
+			if ( reg_cache [slot] == data )
 			{
-				case expansion_vrc6: vrc6.write_register(clock(), addr, data); break;
-				case expansion_vrc7: vrc7.write_register(clock(), addr, data); break;
-				case expansion_fds: fds.write_register(clock(), addr, data); break;
-				case expansion_mmc5: mmc5.write_register(clock(), addr, data); break;
-				case expansion_namco: namco.write_register(clock(), addr, data); break;
-				case expansion_sunsoft: sunsoft.write_register(clock(), addr, data); break;
+				NES_COUNT_CACHED_WRITE();
+				return;
 			}
+			reg_cache [slot] = data;
 		}
+		else if ( addr == 0x4001 || addr == 0x4005 )
+		{
+			// an enabled sweep rewrites the period, so it can't be cached until
+			// the sweep is disabled again
+			int square = (addr - Nes_Apu::start_addr) >> 2;
+			if ( (data & 0x80) && (data & 0x07) )
+				sweep_enabled |= 1 << square;
+			else
+				sweep_enabled &= ~(1 << square);
+			reg_cache [addr + 1 - Nes_Apu::start_addr] = -1;
+		}
+
+		NES_COUNT_WRITE( addr );
+
+		if ( write_count >= write_queue_size )
+			flush_writes();
+		queued_write_t& w = write_queue [write_count++];
+		w.time = time;
+		w.addr = addr;
+		w.data = data;
 	}
 }
 
-void Simple_Apu::start_seeking()
+void Simple_Apu::flush_writes()
 {
-	seeking = true;
-	apu.start_seeking();
+	queued_write_t const* const begin = write_queue;
+	queued_write_t const* const end = write_queue + write_count;
+	write_count = 0;
+
+	if ( logger )
+		for ( queued_write_t const* w = begin; w < end; w++ )
+			logger->log_write( w->time, w->addr, w->data );
+
+	// Chips only depend on the order of their own writes, so each gets all of
+	// its writes in one pass
+	for ( queued_write_t const* w = begin; w < end; w++ )
+		if ( w->addr >= Nes_Apu::start_addr && w->addr <= Nes_Apu::end_addr )
+			apu.write_register( w->time, w->addr, w->data );
+
+	if ( chip )
+		chip->write_registers( begin, end );
+}
 
-	switch (expansion)
+void Simple_Apu::enable_register_cache( bool enable )
+{
+	reg_cache_enabled = enable;
+	clear_reg_cache();
+}
+
+void Simple_Apu::clear_reg_cache()
+{
+	for ( int i = 0; i < reg_cache_size; i++ )
+		reg_cache [i] = -1;
+	sweep_enabled = 0;
+}
+
+// Index into reg_cache of register whose writes have no side effects, or -1
+int Simple_Apu::reg_cache_slot( cpu_addr_t addr ) const
+{
+	if ( !reg_cache_enabled )
+		return -1;
+
+	if ( addr >= Nes_Apu::start_addr && addr < 0x4014 )
+	{
+		int osc = (addr - Nes_Apu::start_addr) >> 2;
+		int reg = addr & 3;
+		if ( reg == 0 || (reg == 2 && !(osc < 2 && (sweep_enabled >> osc & 1))) )
+			return addr - Nes_Apu::start_addr;
+		if ( addr == 0x4013 ) // DMC length; $4011 isn't cached, as the DAC changes on its own
+			return addr - Nes_Apu::start_addr;
+		return -1;
+	}
+
+	if ( expansion == expansion_vrc6 )
+	{
+		int osc = (addr - Nes_Vrc6::base_addr) / Nes_Vrc6::addr_step;
+		int reg = (addr - Nes_Vrc6::base_addr) % Nes_Vrc6::addr_step;
+		if ( addr >= Nes_Vrc6::base_addr && osc < Nes_Vrc6::osc_count && reg < Nes_Vrc6::reg_count )
+			return 0x20 + osc * Nes_Vrc6::reg_count + reg;
+	}
+	else if ( expansion == expansion_mmc5 )
 	{
-		case expansion_vrc6: vrc6.start_seeking(); break;
-		case expansion_vrc7: vrc7.start_seeking(); break;
-		case expansion_fds: fds.start_seeking(); break;
-		case expansion_mmc5: mmc5.start_seeking(); break;
-		case expansion_namco: namco.start_seeking(); break;
-		case expansion_sunsoft: sunsoft.start_seeking(); break;
+		// squares' volume and period low
+		if ( addr >= Nes_Mmc5::start_addr && addr < Nes_Mmc5::start_addr + 8 && !(addr & 1) )
+			return 0x20 + (addr - Nes_Mmc5::start_addr);
 	}
+	return -1;
+}
+
+void Simple_Apu::start_seeking()
+{
+	flush_writes();
+	clear_reg_cache();
+	seeking = true;
+	apu.start_seeking();
+	if (chip)
+		chip->start_seeking();
 }
 
 void Simple_Apu::stop_seeking()
 {
+	clear_reg_cache();
 	apu.stop_seeking(time);
-
-	switch (expansion)
-	{
-		case expansion_vrc6: vrc6.stop_seeking(time); break;
-		case expansion_vrc7: vrc7.stop_seeking(time); break;
-		case expansion_fds: fds.stop_seeking(time); break;
-		case expansion_mmc5: mmc5.stop_seeking(time); break;
-		case expansion_namco: namco.stop_seeking(time); break;
-		case expansion_sunsoft: sunsoft.stop_seeking(time); break;
-	}
+	if (chip)
+		chip->stop_seeking(time);
 
 	seeking = false;
 }
 
 int Simple_Apu::read_status()
 {
-	return apu.read_status( clock() );
+	return read_status( clock() );
+}
+
+int Simple_Apu::read_status( blip_time_t t )
+{
+	if ( t > time )
+		time = t;
+	NES_COUNTERS_SCOPE( &counts );
+	flush_writes();
+	return apu.read_status( time );
 }
 
 void Simple_Apu::end_frame()
 {
-	time = 0;
 	frame_length ^= 1;
+	end_frame( frame_length );
+}
+
+void Simple_Apu::end_frame( blip_time_t length )
+{
+	assert( length >= time );
+	time = 0;
 
-	apu.end_frame( frame_length );
+	NES_TRACE_SCOPE( "end_frame" );
+	NES_COUNTERS_SCOPE( &counts );
+	flush_writes();
+	apu.end_frame( length );
 
-	switch (expansion)
+	if ( chip )
 	{
-		case expansion_vrc6: vrc6.end_frame(frame_length); break;
-		case expansion_vrc7: vrc7.end_frame(frame_length); break;
-		case expansion_fds: fds.end_frame(frame_length); break;
-		case expansion_mmc5: mmc5.end_frame(frame_length); break;
-		case expansion_namco: namco.end_frame(frame_length); break;
-		case expansion_sunsoft: sunsoft.end_frame(frame_length); break;
+		host_ticks_t start = stats_enabled ? read_host_ticks() : 0;
+		chip->end_frame( length );
+		if ( stats_enabled )
+			stats.expansion += read_host_ticks() - start;
 	}
 
-	buf.end_frame( frame_length );
+	buf.end_frame( length );
+	if ( split_msec )
+		channel_bufs.end_frame( length );
+	if ( nonlinear )
+		mixer.end_frame( length );
+
+	if (logger)
+		logger->log_end_frame( length );
+
+	if ( event_counters )
+	{
+		counts.frames = 1;
+		frame_counts = counts;
+		total_counts.add( counts );
+		counts.clear();
+	}
 }
 
 void Simple_Apu::reset()
 {
 	seeking = false;
+	write_count = 0;
+	clear_reg_cache();
 	apu.reset(pal_mode);
-	vrc6.reset();
-	vrc7.reset();
-	fds.reset();
-	mmc5.reset();
-	namco.reset();
-	sunsoft.reset();
+	if (chip)
+		chip->reset();
+	if ( nonlinear )
+		clear_buffers();
 }
 
-void Simple_Apu::set_audio_expansion(long exp)
+blargg_err_t Simple_Apu::set_audio_expansion(long exp)
 {
-	expansion = exp;
+	flush_writes();
+	clear_reg_cache();
+	if ( exp == expansion )
+		return blargg_success;
+	
+	delete chip;
+	chip = NULL;
+	expansion = expansion_none;
+	if ( exp > expansion_none && exp < expansion_count )
+	{
+		chip = new_expansion( exp );
+		BLARGG_CHECK_ALLOC( chip );
+		expansion = exp;
+		if ( expansion_eqs_set >> exp & 1 )
+			chip->treble_eq( expansion_eqs [exp] );
+		chip->output( &buf );
+	}
+	route_outputs();
+	return blargg_success;
 }
 
 long Simple_Apu::samples_avail() const
@@ -215,19 +536,102 @@ long Simple_Apu::samples_avail() const
 
 long Simple_Apu::read_samples( sample_t* p, long s )
 {
+	NES_TRACE_SCOPE( "read_samples" );
+	host_ticks_t start = stats_enabled ? read_host_ticks() : 0;
+	if ( nonlinear )
+		mixer.mix_samples( buf, s );
 	long count = buf.read_samples( p, s );
+	if ( split )
+		channel_bufs.mix_samples( p, count );
+	else if ( split_msec )
+		channel_bufs.remove_silence( count );
 
-	if (expansion == expansion_vrc7)
-		vrc7.mix_samples(p, s);
-	else if (expansion == expansion_sunsoft)
-		sunsoft.mix_samples(p, s);
+	mix_expansion( p, s );
+
+	if ( stats_enabled )
+		stats.read += read_host_ticks() - start;
+	return count;
+}
+
+long Simple_Apu::read_channels( sample_t* const* outs, sample_t* mixed, long s )
+{
+	assert( split );
+	NES_TRACE_SCOPE( "read_samples" );
+	host_ticks_t start = stats_enabled ? read_host_ticks() : 0;
+	long count = channel_bufs.read_channels( outs, s );
+	if ( nonlinear )
+		mixer.mix_samples( buf, count );
+	if ( mixed )
+		buf.read_samples( mixed, count );
+	else
+		buf.remove_samples( count );
+
+	sample_t* p = outs [Nes_Apu::osc_count];
+	if ( p )
+	{
+		mix_expansion( p, count );
+	}
+	else if (chip && chip->mixes_samples)
+	{
+		// the chip still has to generate its samples to keep its place
+		enum { scratch_size = 256 };
+		sample_t scratch [scratch_size];
+		for ( long n = 0; n < count; n += scratch_size )
+		{
+			long chunk = count - n < scratch_size ? count - n : (long) scratch_size;
+			memset( scratch, 0, chunk * sizeof scratch [0] );
+			mix_expansion( scratch, chunk );
+		}
+	}
 
+	if ( stats_enabled )
+		stats.read += read_host_ticks() - start;
 	return count;
 }
 
+// Mixes in the chips that render their own samples rather than into the buffer
+void Simple_Apu::mix_expansion( sample_t* p, long s )
+{
+	if (chip && chip->mixes_samples)
+	{
+		host_ticks_t mix_start = stats_enabled ? read_host_ticks() : 0;
+		NES_COUNTERS_SCOPE( &counts );
+		chip->mix_samples(p, s);
+		if ( stats_enabled )
+			stats.expansion_mix += read_host_ticks() - mix_start;
+	}
+}
+
+void Simple_Apu::enable_cpu_stats( bool enable )
+{
+	stats_enabled = enable;
+	apu.osc_ticks( enable ? stats.osc : NULL );
+}
+
+void Simple_Apu::clear_cpu_stats()
+{
+	memset( &stats, 0, sizeof stats );
+}
+
+void Simple_Apu::clear_counters()
+{
+	counts.clear();
+	frame_counts.clear();
+	total_counts.clear();
+}
+
 void Simple_Apu::remove_samples(long s)
 {
+	// the mixer has to follow levels through removed samples
+	if ( nonlinear )
+		mixer.mix_samples( buf, s );
 	buf.remove_samples(s);
+	// unsplit, nothing is added to the channel buffers, so they only need to
+	// keep time with the mixed one
+	if ( split )
+		channel_bufs.remove_samples(s);
+	else if ( split_msec )
+		channel_bufs.remove_silence(s);
 }
 
 void Simple_Apu::save_snapshot( apu_snapshot_t* out ) const
@@ -237,6 +641,10 @@ void Simple_Apu::save_snapshot( apu_snapshot_t* out ) const
 
 void Simple_Apu::load_snapshot( apu_snapshot_t const& in )
 {
+	write_count = 0;
 	apu.load_snapshot( in );
+	clear_reg_cache();
+	if ( nonlinear )
+		clear_buffers();
 }
 
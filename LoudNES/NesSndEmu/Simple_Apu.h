@@ -14,6 +14,10 @@
 #include "nes_apu/Nes_Namco.h"
 #include "nes_apu/Nes_Sunsoft.h"
 #include "nes_apu/Blip_Buffer.h"
+#include "nes_apu/Multi_Buffer.h"
+#include "nes_apu/Nonlinear_Buffer.h"
+
+template<class Chip> class Expansion_Chip;
 
 class Simple_Apu {
 public:
@@ -25,6 +29,7 @@ public:
 	enum { expansion_mmc5    = 4 };
 	enum { expansion_namco   = 5 };
 	enum { expansion_sunsoft = 6 };
+	enum { expansion_count   = 7 };
 
 	Simple_Apu();
 	~Simple_Apu();
@@ -36,42 +41,122 @@ public:
 	// Set function for APU to call when it needs to read memory (DMC samples)
 	void dmc_reader( int (*callback)( void* user_data, cpu_addr_t ), void* user_data = NULL );
 	
-	// Set output sample rate
+	// Set output sample rate. Enables every channel again (see enable_channel()).
 	blargg_err_t sample_rate( long rate, bool pal );
 	
 	// Write to register (0x4000-0x4017, except 0x4014 and 0x4016)
 	void write_register( cpu_addr_t, int data );
 	
+	// Write to register at specified clock time in current frame. Writes with
+	// times earlier than the last write are moved up to the last write time.
+	// Writes are queued, and the chips catch up and apply them together at
+	// end_frame(), or sooner if the queue fills or the status is read. Either
+	// way, each takes effect at its own time.
+	void write_register( blip_time_t, cpu_addr_t, int data );
+	
+	struct queued_write_t {
+		blip_time_t time;
+		cpu_addr_t addr;
+		int data;
+	};
+	
+	// Drop writes of the value a register already holds, where writing has no
+	// other effect, so they don't make the chips catch up. Registers that restart
+	// or reload something ($4001/$4005, $4003/$4007, $400B, $400F, $4011, $4015,
+	// $4017 and MMC5's equivalents) are always written. Only the 2A03, VRC6 and
+	// MMC5 are cached. Dropped writes aren't logged, but still advance the clock.
+	void enable_register_cache( bool );
+	
 	// Read from status register at 0x4015
 	int read_status();
 	
+	// Read from status register at specified clock time in current frame
+	int read_status( blip_time_t );
+	
 	// End a 1/60 sound frame
  	// Run all oscillators up to specified time, end current time frame, then
 	// start a new time frame at time 0. Time frames have no effect on emulation
 	// and each can be whatever length is convenient. 
 	void end_frame();
 	
+	// End a sound frame of specified length in clocks, which must not be
+	// earlier than the last register write
+	void end_frame( blip_time_t length );
+	
+	// Length in clocks of the frame the next end_frame() without a length ends
+	blip_time_t next_frame_length() const { return frame_length ^ 1; }
+	
+	// Move the clock that writes and status reads without a time are made at
+	// up to t in the current frame. Each such access advances it a little.
+	void set_clock( blip_time_t t ) { if ( t > time ) time = t; }
+	
 	// Resets
 	void reset();
 
-	void set_audio_expansion(long exp);
+	// Select expansion chip. Only the selected chip is kept: selecting another
+	// replaces it with a newly reset one, which is allocated and can fail.
+	blargg_err_t set_audio_expansion(long exp);
 	int get_audio_expansion() const { return expansion; }
 
 	// Number of samples in buffer
 	long samples_avail() const;
+	
+	// Clocks from the start of the current frame until 'count' samples are in buffer
+	blip_time_t count_clocks( long count ) const { return buf.count_clocks( count ); }
+	
+	// Clocks per output sample, as the buffer actually resamples
+	double clocks_per_sample() const { return (double) (1L << BLIP_BUFFER_ACCURACY) / buf.resampled_duration( 1 ); }
 
 	void enable_channel(int, bool);
+
+	// Number of channels for enable_channel(): the 2A03's five, then the expansion's
+	int channel_count() const;
+	enum { max_channels = Nes_Apu::osc_count + Nes_Namco::osc_count };
 	
+	// Set eq of the 2A03 or an expansion chip, kept for when it's selected
 	void treble_eq(int exp, double treble, int cutoff, int sample_rate);
+	
+	// Allocate buffers for split_outputs() holding 'msec' of samples each (see
+	// Blip_Buffer.h), or free them with 0. Clears buffered samples. Allocated
+	// buffers keep in step with the mixed one whether or not outputs are split.
+	blargg_err_t reserve_split_outputs( int msec );
+	
+	// Give each channel for enable_channel() a buffer of its own, all filled by
+	// the one emulation, or go back to mixing them into one. Needs reserved
+	// buffers, and doesn't allocate. Samples already in the mixed buffer are
+	// still read after splitting, so nothing is lost; going back clears all
+	// buffered samples. VRC7 and Sunsoft 5B go to their chip's first channel.
+	void split_outputs( bool );
+	bool outputs_split() const { return split; }
+	
+	// Mix the 2A03's channels through the hardware's nonlinear DAC curves (see
+	// Nes_Nonlinear_Mixer) rather than linearly. Expansion chips are still added
+	// linearly, and split outputs stay linear. Reserves what it needs the first
+	// time, and clears buffered samples when changed. While enabled, reset() and
+	// load_snapshot() clear buffered samples too.
+	blargg_err_t nonlinear_mixing( bool );
+	
+	// Allocate nonlinear_mixing()'s two buffers and set up its volumes ahead of
+	// time, so switching it doesn't allocate or lock. The buffers then follow
+	// sample_rate() whether or not mixing is nonlinear.
+	blargg_err_t reserve_nonlinear_mixing();
+	bool nonlinear_mixing() const { return nonlinear; }
 
 	// Read at most 'count' samples and return number of samples actually read
 	typedef blip_sample_t sample_t;
 	long read_samples( sample_t* buf, long buf_size );
+	
+	// With outputs split, read at most 'count' samples of each channel into
+	// outs [channel], and of the mixed buffer into 'mixed', discarding them
+	// where NULL. Return number of samples actually read. The mixed buffer only
+	// has what was in it before splitting. read_samples() mixes everything.
+	long read_channels( sample_t* const* outs, sample_t* mixed, long count );
 
 	// Discard 'count' samples.
 	void remove_samples(long buf_size);
 	
-	// Save/load snapshot of emulation state
+	// Save/load snapshot of emulation state. Queued writes aren't included in
+	// a saved snapshot until the frame ends, and are discarded by a load.
 	void save_snapshot( apu_snapshot_t* out ) const;
 	void load_snapshot( apu_snapshot_t const& );
 
@@ -79,21 +164,85 @@ public:
 	void stop_seeking();
 	bool is_seeking() const { return seeking; }
 
+	// Register write logging (VGM export, capture). Receives every write that
+	// reaches the sound chips, with time relative to the current frame, and
+	// each frame end. Pass NULL to stop logging.
+	class Write_Logger {
+	public:
+		virtual ~Write_Logger() { }
+		virtual void log_write( blip_time_t, cpu_addr_t, int data ) = 0;
+		virtual void log_end_frame( blip_time_t length ) = 0;
+	};
+	void write_logger( Write_Logger* l ) { logger = l; }
+
+	// Host ticks (see nes_apu/Host_Ticks.h) spent emulating, counted while
+	// enabled. Oscillators are timed wherever they run, including catch-up on
+	// register writes.
+	struct cpu_stats_t {
+		host_ticks_t osc [Nes_Apu::osc_count]; // 2A03 oscillators
+		host_ticks_t expansion;     // expansion chip end_frame()
+		host_ticks_t expansion_mix; // VRC7 and Sunsoft 5B mixing in read_samples()
+		host_ticks_t read;          // read_samples(), including expansion_mix
+	};
+	void enable_cpu_stats( bool );
+	cpu_stats_t const& cpu_stats() const { return stats; }
+	void clear_cpu_stats();
+
+	// Event counters (see nes_apu/Nes_Counters.h) for the last frame ended, and
+	// running totals. They stay zero unless built with NES_EVENT_COUNTERS.
+	enum { event_counters = NES_EVENT_COUNTERS };
+	nes_counters_t const& frame_counters() const { return frame_counts; }
+	nes_counters_t const& total_counters() const { return total_counts; }
+	void clear_counters();
+
 private:
 	bool pal_mode;
 	bool seeking;
 	int  expansion;
 	Nes_Apu apu;
-	Nes_Vrc6 vrc6;
-	Nes_Vrc7 vrc7;
-	Nes_Fds fds;
-	Nes_Mmc5 mmc5;
-	Nes_Namco namco;
-	Nes_Sunsoft sunsoft;
+	class Expansion;
+	template<class Chip> friend class Expansion_Chip;
+	static Expansion* new_expansion( int );
+	Expansion* chip; // selected expansion chip, or NULL
+	blip_eq_t expansion_eqs [expansion_count]; // from treble_eq()
+	int expansion_eqs_set; // by bit
 	Blip_Buffer buf;
+	Channels_Buffer channel_bufs; // when reserved
+	int split_msec;
+	bool split;
+	Nes_Nonlinear_Mixer mixer;
+	bool mixer_reserved;
+	bool nonlinear;
+	int channels_disabled; // by bit, for enable_channel()
+	Blip_Buffer* channel_output( int );
+	void route_outputs();
+	void clear_buffers();
+	void mix_expansion( sample_t*, long );
+	Write_Logger* logger;
+	cpu_stats_t stats;
+	bool stats_enabled;
+	nes_counters_t counts; // current frame
+	nes_counters_t frame_counts;
+	nes_counters_t total_counts;
 	blip_time_t time;
 	blip_time_t frame_length;
 	blip_time_t clock() { return time += 4; }
+	
+	enum { reg_cache_size = 0x20 + 9 }; // 2A03, then VRC6 or MMC5
+	short reg_cache [reg_cache_size]; // last value written, or -1 if unknown
+	bool reg_cache_enabled;
+	int sweep_enabled; // squares whose sweep can rewrite their period, by bit
+	int reg_cache_slot( cpu_addr_t ) const;
+	void clear_reg_cache();
+	
+	enum { write_queue_size = 256 };
+	queued_write_t write_queue [write_queue_size];
+	int write_count;
+	void flush_writes();
+	
+	// noncopyable
+	Simple_Apu( const Simple_Apu& );
+	Simple_Apu& operator = ( const Simple_Apu& );
 };
 
 #endif
@@ -0,0 +1,583 @@
+
+#include "Vgm_File.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (_WIN32)
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+static inline unsigned get_le16( unsigned char const* p )
+{
+	return p [0] | (p [1] << 8);
+}
+
+static inline unsigned long get_le32( unsigned char const* p )
+{
+	return (unsigned long) p [0] | ((unsigned long) p [1] << 8) |
+			((unsigned long) p [2] << 16) | ((unsigned long) p [3] << 24);
+}
+
+static inline void set_le32( unsigned char* p, unsigned long n )
+{
+	p [0] = (unsigned char) n;
+	p [1] = (unsigned char) (n >> 8);
+	p [2] = (unsigned char) (n >> 16);
+	p [3] = (unsigned char) (n >> 24);
+}
+
+// Vgm_Writer
+
+Vgm_Writer::Vgm_Writer()
+{
+	buf = NULL;
+	buf_size = 0;
+	buf_capacity = 0;
+	recording = false;
+	has_writes = false;
+	fds = false;
+	clock_rate = 1789773;
+	dropped = 0;
+	frame_start = 0;
+	samples_written = 0;
+}
+
+Vgm_Writer::~Vgm_Writer()
+{
+	free( buf );
+}
+
+blargg_err_t Vgm_Writer::reserve( long count )
+{
+	if ( buf_size + count > buf_capacity )
+	{
+		long new_capacity = buf_capacity ? buf_capacity * 2 : 64 * 1024L;
+		while ( new_capacity < buf_size + count )
+			new_capacity *= 2;
+		void* p = realloc( buf, new_capacity );
+		if ( !p )
+			return "Out of memory";
+		buf = (unsigned char*) p;
+		buf_capacity = new_capacity;
+	}
+	return NULL;
+}
+
+inline void Vgm_Writer::emit( int byte )
+{
+	// callers reserve space for whole command sequence in advance
+	assert( buf_size < buf_capacity );
+	buf [buf_size++] = (unsigned char) byte;
+}
+
+blargg_err_t Vgm_Writer::start( long rate, bool use_fds )
+{
+	buf_size = 0;
+	recording = false;
+	has_writes = false;
+	fds = use_fds;
+	clock_rate = rate;
+	dropped = 0;
+	frame_start = 0;
+	samples_written = 0;
+
+	// typical recording of a few minutes fits without reallocation
+	blargg_err_t err = reserve( 1024 * 1024L );
+	if ( err )
+		return err;
+
+	memset( buf, 0, header_size );
+	buf_size = header_size;
+	recording = true;
+	return NULL;
+}
+
+blargg_err_t Vgm_Writer::add_dmc_block( cpu_addr_t addr, void const* data, long size )
+{
+	assert( recording );
+	assert( !has_writes );
+	assert( addr >= 0x8000 && addr + size <= 0x10000 );
+
+	blargg_err_t err = reserve( size + 9 );
+	if ( err )
+		return err;
+
+	// 0x67 0x66 type size32 (includes 16-bit address) addr16 data
+	emit( 0x67 );
+	emit( 0x66 );
+	emit( 0xC2 );
+	set_le32( buf + buf_size, size + 2 );
+	buf_size += 4;
+	emit( addr & 0xFF );
+	emit( addr >> 8 );
+	memcpy( buf + buf_size, data, size );
+	buf_size += size;
+	return NULL;
+}
+
+long Vgm_Writer::wait_size( double clock ) const
+{
+	long n = (long) (clock * vgm_rate / clock_rate) - samples_written;
+	return (n / 0xFFFF + 1) * 3;
+}
+
+void Vgm_Writer::emit_wait( double clock )
+{
+	long target = (long) (clock * vgm_rate / clock_rate);
+	long n = target - samples_written;
+	samples_written = target;
+
+	while ( n > 0 )
+	{
+		if ( n <= 16 )
+		{
+			emit( 0x70 + n - 1 );
+			return;
+		}
+		if ( n == 735 || n == 1470 )
+		{
+			emit( 0x62 );
+			n -= 735;
+			continue;
+		}
+		if ( n == 882 || n == 1764 )
+		{
+			emit( 0x63 );
+			n -= 882;
+			continue;
+		}
+		long count = n < 0xFFFF ? n : 0xFFFF;
+		emit( 0x61 );
+		emit( count & 0xFF );
+		emit( count >> 8 );
+		n -= count;
+	}
+}
+
+void Vgm_Writer::log_write( blip_time_t time, cpu_addr_t addr, int data )
+{
+	if ( !recording )
+		return;
+
+	int reg;
+	if ( addr >= 0x4000 && addr <= 0x401F )
+		reg = addr - 0x4000;
+	else if ( fds && addr >= 0x4080 && addr <= 0x409E )
+		reg = addr - 0x4080 + 0x20;
+	else if ( fds && addr == 0x4023 )
+		reg = 0x3F;
+	else if ( fds && addr >= 0x4040 && addr <= 0x407F )
+		reg = addr - 0x4040 + 0x40;
+	else
+	{
+		dropped++;
+		return;
+	}
+
+	// buffer only grows when initial reservation runs out
+	long size = wait_size( frame_start + time ) + 3;
+	if ( buf_size + size > buf_capacity && reserve( size ) )
+	{
+		dropped++;
+		return;
+	}
+
+	has_writes = true;
+	emit_wait( frame_start + time );
+	emit( 0xB4 );
+	emit( reg );
+	emit( data );
+}
+
+void Vgm_Writer::log_end_frame( blip_time_t length )
+{
+	// waits are emitted lazily so that consecutive frames merge
+	frame_start += length;
+}
+
+blargg_err_t Vgm_Writer::end( const char* path )
+{
+	assert( recording );
+	recording = false;
+
+	blargg_err_t err = reserve( wait_size( frame_start ) + 1 );
+	if ( err )
+		return err;
+
+	emit_wait( frame_start );
+	emit( 0x66 );
+
+	buf [0] = 'V';
+	buf [1] = 'g';
+	buf [2] = 'm';
+	buf [3] = ' ';
+	set_le32( buf + 0x04, buf_size - 0x04 ); // EOF offset
+	set_le32( buf + 0x08, 0x161 );           // version
+	set_le32( buf + 0x18, samples_written ); // total samples
+	set_le32( buf + 0x34, header_size - 0x34 ); // VGM data offset
+	set_le32( buf + 0x84, clock_rate | (fds ? 0x80000000 : 0) );
+
+	FILE* out = fopen( path, "wb" );
+	if ( !out )
+		return "Couldn't open VGM file for writing";
+	size_t written = fwrite( buf, 1, buf_size, out );
+	if ( fclose( out ) != 0 || written != (size_t) buf_size )
+		return "Couldn't write VGM file";
+	return NULL;
+}
+
+// Vgm_Player
+
+Vgm_Player::Vgm_Player()
+{
+	file_begin = NULL;
+	file_end = NULL;
+	data_begin = NULL;
+	loop_begin = NULL;
+	pos = NULL;
+	map_handle = NULL;
+	map_size = 0;
+	total_samples = 0;
+	clock_rate_ = 1789773;
+	fds = false;
+	ended = true;
+	loop_count = 0;
+	loops_remain = 0;
+	apu = NULL;
+	clocks_per_sample = 0;
+	frame_start = 0;
+	vgm_time = 0;
+	frame_length = 29780;
+	dmc_block_count = 0;
+}
+
+Vgm_Player::~Vgm_Player()
+{
+	unload();
+}
+
+void Vgm_Player::unload()
+{
+	if ( map_handle )
+	{
+	#if defined (_WIN32)
+		UnmapViewOfFile( file_begin );
+		CloseHandle( (HANDLE) map_handle );
+	#else
+		munmap( (void*) file_begin, map_size );
+	#endif
+	}
+	map_handle = NULL;
+	map_size = 0;
+	file_begin = NULL;
+	file_end = NULL;
+	data_begin = NULL;
+	loop_begin = NULL;
+	pos = NULL;
+	ended = true;
+	dmc_block_count = 0;
+}
+
+blargg_err_t Vgm_Player::load( const char* path )
+{
+	unload();
+
+#if defined (_WIN32)
+	HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( file == INVALID_HANDLE_VALUE )
+		return "Couldn't open VGM file";
+	DWORD size = GetFileSize( file, NULL );
+	HANDLE mapping = size ? CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+	CloseHandle( file );
+	if ( !mapping )
+		return "Couldn't map VGM file";
+	void* p = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( !p )
+	{
+		CloseHandle( mapping );
+		return "Couldn't map VGM file";
+	}
+	map_handle = mapping;
+#else
+	int fd = open( path, O_RDONLY );
+	if ( fd < 0 )
+		return "Couldn't open VGM file";
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size <= 0 )
+	{
+		close( fd );
+		return "Couldn't open VGM file";
+	}
+	long size = (long) st.st_size;
+	void* p = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( p == MAP_FAILED )
+		return "Couldn't map VGM file";
+	map_handle = p;
+#endif
+
+	map_size = size;
+	file_begin = (unsigned char const*) p;
+	file_end = file_begin + size;
+
+	blargg_err_t err = parse_header();
+	if ( err )
+		unload();
+	return err;
+}
+
+blargg_err_t Vgm_Player::load_mem( void const* data, long size )
+{
+	unload();
+	file_begin = (unsigned char const*) data;
+	file_end = file_begin + size;
+
+	blargg_err_t err = parse_header();
+	if ( err )
+		unload();
+	return err;
+}
+
+blargg_err_t Vgm_Player::parse_header()
+{
+	long size = file_end - file_begin;
+	unsigned char const* h = file_begin;
+
+	if ( size >= 2 && h [0] == 0x1F && h [1] == 0x8B )
+		return "Compressed VGM (.vgz) files aren't supported";
+	if ( size < 0x40 || memcmp( h, "Vgm ", 4 ) )
+		return "Not a VGM file";
+
+	unsigned long version = get_le32( h + 0x08 );
+	unsigned long eof = get_le32( h + 0x04 ) + 0x04;
+	if ( eof < (unsigned long) size )
+		file_end = file_begin + eof;
+
+	long data_offset = 0x40;
+	if ( version >= 0x150 && get_le32( h + 0x34 ) )
+		data_offset = get_le32( h + 0x34 ) + 0x34;
+	if ( data_offset >= file_end - file_begin )
+		return "Corrupt VGM file";
+	data_begin = file_begin + data_offset;
+
+	// NES APU clock field is only present if header extends past it
+	unsigned long clock = 0;
+	if ( data_offset >= 0x88 )
+		clock = get_le32( h + 0x84 );
+	if ( !(clock & 0x3FFFFFFF) )
+		return "VGM file doesn't use NES APU";
+	fds = (clock & 0x80000000) != 0;
+	clock_rate_ = clock & 0x3FFFFFFF;
+
+	total_samples = get_le32( h + 0x18 );
+
+	loop_begin = NULL;
+	unsigned long loop = get_le32( h + 0x1C );
+	if ( loop && loop + 0x1C < (unsigned long) (file_end - file_begin) )
+		loop_begin = file_begin + loop + 0x1C;
+
+	return NULL;
+}
+
+blargg_err_t Vgm_Player::start( Simple_Apu* a, long sample_rate )
+{
+	assert( data_begin ); // file must be loaded
+	apu = a;
+
+	bool pal = clock_rate_ < 1700000;
+	blargg_err_t err = apu->sample_rate( sample_rate, pal );
+	if ( err )
+		return err;
+	err = apu->set_audio_expansion( fds ? (int) Simple_Apu::expansion_fds : (int) Simple_Apu::expansion_none );
+	if ( err )
+		return err;
+	apu->dmc_reader( read_dmc, this );
+	apu->reset();
+
+	// frame of approximately 1/60 second at file's clock rate
+	clocks_per_sample = (double) clock_rate_ / vgm_rate;
+	frame_length = clock_rate_ / 60;
+	frame_start = 0;
+	vgm_time = 0;
+	pos = data_begin;
+	ended = false;
+	loops_remain = loop_count;
+	dmc_block_count = 0;
+	return NULL;
+}
+
+void Vgm_Player::add_dmc_block( unsigned char const* block, long size )
+{
+	if ( size < 2 || dmc_block_count >= max_dmc_blocks )
+		return;
+
+	// blocks inside looped section are seen again on each loop
+	for ( int i = 0; i < dmc_block_count; i++ )
+		if ( dmc_blocks [i].data == block + 2 )
+			return;
+
+	dmc_block_t& b = dmc_blocks [dmc_block_count++];
+	b.addr = get_le16( block );
+	b.data = block + 2;
+	b.size = size - 2;
+}
+
+int Vgm_Player::read_dmc( void* data, cpu_addr_t addr )
+{
+	Vgm_Player const* self = (Vgm_Player const*) data;
+
+	// later blocks take priority, as if written over earlier ones
+	for ( int i = self->dmc_block_count; i--; )
+	{
+		dmc_block_t const& b = self->dmc_blocks [i];
+		unsigned offset = addr - b.addr;
+		if ( offset < (unsigned long) b.size )
+			return b.data [offset];
+	}
+	return 0x55;
+}
+
+void Vgm_Player::write_register( int reg, int data )
+{
+	if ( reg & 0x80 )
+		return; // second chip
+
+	cpu_addr_t addr;
+	if ( reg < 0x20 )
+	{
+		addr = 0x4000 + reg;
+		if ( addr == 0x4014 || addr == 0x4016 || addr > 0x4017 )
+			return; // OAM DMA and controller registers
+	}
+	else
+	{
+		if ( !fds )
+			return;
+		if ( reg < 0x3F )
+			addr = 0x4080 + reg - 0x20;
+		else if ( reg == 0x3F )
+			addr = 0x4023;
+		else
+			addr = 0x4040 + reg - 0x40;
+	}
+
+	blip_time_t time = (blip_time_t) (vgm_time * clocks_per_sample - frame_start);
+	apu->write_register( time, addr, data );
+}
+
+// Length of commands not otherwise handled, indexed by high nybble
+static unsigned char const command_lengths [16] = {
+	1, 1, 1, 2, 3, 3, 1, 1, 1, 5, 3, 3, 4, 4, 5, 5
+};
+
+void Vgm_Player::run_frame()
+{
+	while ( !ended && vgm_time * clocks_per_sample - frame_start < frame_length )
+	{
+		if ( pos >= file_end )
+		{
+			ended = true;
+			break;
+		}
+
+		unsigned char const* p = pos;
+		int cmd = *p;
+		long remain = file_end - p;
+		long len = command_lengths [cmd >> 4];
+
+		switch ( cmd )
+		{
+			case 0xB4:
+				len = 3;
+				if ( remain >= 3 )
+					write_register( p [1], p [2] );
+				break;
+
+			case 0x61:
+				len = 3;
+				if ( remain >= 3 )
+					vgm_time += get_le16( p + 1 );
+				break;
+
+			case 0x62:
+				vgm_time += 735;
+				break;
+
+			case 0x63:
+				vgm_time += 882;
+				break;
+
+			case 0x66:
+				if ( loop_begin && loops_remain > 0 )
+				{
+					loops_remain--;
+					pos = loop_begin;
+					continue;
+				}
+				ended = true;
+				break;
+
+			case 0x67:
+				if ( remain < 7 )
+				{
+					ended = true;
+					break;
+				}
+				len = 7 + get_le32( p + 3 );
+				if ( len > remain )
+				{
+					ended = true;
+					break;
+				}
+				if ( p [2] == 0xC2 )
+					add_dmc_block( p + 7, len - 7 );
+				break;
+
+			case 0x68: len = 12; break;
+			case 0x90: len = 5; break;
+			case 0x91: len = 5; break;
+			case 0x92: len = 6; break;
+			case 0x93: len = 11; break;
+			case 0x94: len = 2; break;
+			case 0x95: len = 5; break;
+
+			default:
+				if ( (cmd & 0xF0) == 0x70 )
+					vgm_time += (cmd & 0x0F) + 1;
+				else if ( (cmd & 0xF0) == 0x80 )
+					vgm_time += cmd & 0x0F;
+				else if ( cmd >= 0x30 && cmd <= 0x3F )
+					len = 2;
+				else if ( cmd >= 0x40 && cmd <= 0x4E )
+					len = 3;
+				else if ( cmd == 0x4F || cmd == 0x50 )
+					len = 2;
+				break;
+		}
+
+		pos += len;
+	}
+
+	apu->end_frame( frame_length );
+	frame_start += frame_length;
+}
+
+long Vgm_Player::play( Simple_Apu::sample_t* out, long count )
+{
+	assert( apu ); // start() must have been called
+
+	while ( apu->samples_avail() < count && !ended )
+		run_frame();
+
+	return apu->read_samples( out, count );
+}
+
@@ -0,0 +1,148 @@
+
+// VGM (Video Game Music) file writer and player for Simple_Apu
+
+// Covers the NES APU command (0xB4) of VGM 1.61, including the FDS flag and
+// DPCM sample data blocks (type 0xC2). VGM has no command for VRC6 or the
+// other expansion chips, so writes to them are dropped on export.
+
+#ifndef VGM_FILE_H
+#define VGM_FILE_H
+
+#include "Simple_Apu.h"
+
+// Records register writes from a Simple_Apu into a VGM file. Install with
+// Simple_Apu::write_logger() between start() and end().
+class Vgm_Writer : public Simple_Apu::Write_Logger {
+public:
+	Vgm_Writer();
+	~Vgm_Writer();
+
+	// Begin new recording, discarding any previous one. Clock rate is the
+	// APU clock rate (1789773 for NTSC, 1662607 for PAL).
+	blargg_err_t start( long clock_rate, bool fds = false );
+
+	// Add DPCM sample data at CPU address (0x8000-0xFFFF). Must be called
+	// before any register writes are logged.
+	blargg_err_t add_dmc_block( cpu_addr_t, void const* data, long size );
+
+	// End recording and write VGM file
+	blargg_err_t end( const char* path );
+
+	// True between start() and end()
+	bool is_recording() const { return recording; }
+
+	// Number of writes to registers VGM can't represent
+	long dropped_writes() const { return dropped; }
+
+	// Simple_Apu::Write_Logger
+	void log_write( blip_time_t, cpu_addr_t, int data );
+	void log_end_frame( blip_time_t length );
+
+private:
+	enum { header_size = 0x100 };
+	enum { vgm_rate = 44100 };
+
+	unsigned char* buf;
+	long buf_size;
+	long buf_capacity;
+	bool recording;
+	bool has_writes;
+	bool fds;
+	long clock_rate;
+	long dropped;
+	double frame_start;     // clocks at start of current frame
+	long samples_written;   // samples covered by emitted wait commands
+
+	// not supported
+	Vgm_Writer( const Vgm_Writer& );
+	Vgm_Writer& operator = ( const Vgm_Writer& );
+
+	blargg_err_t reserve( long count );
+	void emit( int byte );
+	long wait_size( double clock ) const;
+	void emit_wait( double clock );
+};
+
+// Plays NES APU commands from a VGM file through a Simple_Apu. The file is
+// memory-mapped and commands are dispatched straight from the mapping, so
+// playback does no allocation.
+class Vgm_Player {
+public:
+	Vgm_Player();
+	~Vgm_Player();
+
+	// Memory-map VGM file. Compressed (.vgz) files aren't supported.
+	blargg_err_t load( const char* path );
+
+	// Use VGM file already in memory. Data must remain valid until unload().
+	blargg_err_t load_mem( void const* data, long size );
+
+	// Unload file and unmap it
+	void unload();
+
+	// Set up APU for playback at specified sample rate and rewind to start.
+	// Player sets APU's DMC reader and expansion, and must outlive playback.
+	blargg_err_t start( Simple_Apu*, long sample_rate );
+
+	// Number of times to repeat looped section (0 = play once)
+	void set_loop_count( int n ) { loop_count = n; }
+
+	// Render up to count samples into out and return number rendered. Fewer
+	// than count samples are returned only at end of track.
+	long play( Simple_Apu::sample_t* out, long count );
+
+	// True if end of track has been reached
+	bool track_ended() const { return ended; }
+
+	// Length of track in samples at 44100 Hz (without loops)
+	long track_length() const { return total_samples; }
+
+	// APU clock rate specified by file
+	long clock_rate() const { return clock_rate_; }
+
+	// True if file uses FDS expansion
+	bool uses_fds() const { return fds; }
+
+private:
+	enum { vgm_rate = 44100 };
+	enum { max_dmc_blocks = 16 };
+	struct dmc_block_t {
+		unsigned addr;
+		long size;
+		unsigned char const* data;
+	};
+
+	unsigned char const* file_begin;
+	unsigned char const* file_end;
+	unsigned char const* data_begin;
+	unsigned char const* loop_begin;
+	unsigned char const* pos;
+	void* map_handle;
+	long map_size;
+	long total_samples;
+	long clock_rate_;
+	bool fds;
+	bool ended;
+	int loop_count;
+	int loops_remain;
+	Simple_Apu* apu;
+	double clocks_per_sample;
+	double frame_start;     // clocks at start of current frame
+	long vgm_time;          // position in samples at 44100 Hz
+	blip_time_t frame_length;
+	dmc_block_t dmc_blocks [max_dmc_blocks];
+	int dmc_block_count;
+
+	// not supported
+	Vgm_Player( const Vgm_Player& );
+	Vgm_Player& operator = ( const Vgm_Player& );
+
+	blargg_err_t parse_header();
+	void run_frame();
+	void write_register( int reg, int data );
+	void add_dmc_block( unsigned char const* block, long size );
+	static int read_dmc( void*, cpu_addr_t );
+};
+
+#endif
+
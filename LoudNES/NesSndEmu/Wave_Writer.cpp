@@ -0,0 +1,97 @@
+
+#include "Wave_Writer.h"
+
+#include <string.h>
+
+static void set_le16( unsigned char* p, unsigned n )
+{
+	p [0] = (unsigned char) n;
+	p [1] = (unsigned char) (n >> 8);
+}
+
+static void set_le32( unsigned char* p, unsigned long n )
+{
+	set_le16( p, (unsigned) (n & 0xFFFF) );
+	set_le16( p + 2, (unsigned) (n >> 16) );
+}
+
+Wave_Writer::Wave_Writer()
+{
+	file = NULL;
+	sample_rate = 0;
+	chan_count = 1;
+	sample_count_ = 0;
+}
+
+Wave_Writer::~Wave_Writer()
+{
+	close();
+}
+
+const char* Wave_Writer::open( const char* path, long rate, int chans )
+{
+	close();
+	file = fopen( path, "wb" );
+	if ( !file )
+		return "Couldn't open WAVE file for writing";
+
+	sample_rate = rate;
+	chan_count = chans;
+	sample_count_ = 0;
+
+	// header is filled in by close()
+	unsigned char header [header_size] = { 0 };
+	if ( !fwrite( header, sizeof header, 1, file ) )
+	{
+		close();
+		return "Couldn't write WAVE header";
+	}
+	return NULL;
+}
+
+void Wave_Writer::write( const sample_t* in, long count )
+{
+	if ( !file )
+		return;
+
+	sample_count_ += count;
+
+	// file is little-endian regardless of host
+	unsigned char buf [4096];
+	while ( count > 0 )
+	{
+		long n = count < (long) (sizeof buf / 2) ? count : (long) (sizeof buf / 2);
+		for ( long i = 0; i < n; i++ )
+			set_le16( buf + i * 2, (unsigned short) in [i] );
+		fwrite( buf, 2, n, file );
+		in += n;
+		count -= n;
+	}
+}
+
+void Wave_Writer::close()
+{
+	if ( !file )
+		return;
+
+	long data_size = sample_count_ * 2;
+	unsigned char h [header_size];
+	memcpy( h, "RIFF", 4 );
+	set_le32( h + 0x04, data_size + header_size - 8 );
+	memcpy( h + 0x08, "WAVEfmt ", 8 );
+	set_le32( h + 0x10, 16 );                 // fmt chunk size
+	set_le16( h + 0x14, 1 );                  // PCM
+	set_le16( h + 0x16, chan_count );
+	set_le32( h + 0x18, sample_rate );
+	set_le32( h + 0x1C, sample_rate * chan_count * 2 );
+	set_le16( h + 0x20, chan_count * 2 );     // frame size
+	set_le16( h + 0x22, 16 );                 // bits per sample
+	memcpy( h + 0x24, "data", 4 );
+	set_le32( h + 0x28, data_size );
+
+	fseek( file, 0, SEEK_SET );
+	fwrite( h, sizeof h, 1, file );
+	fclose( file );
+	file = NULL;
+}
+
@@ -0,0 +1,37 @@
+
+// WAVE sound file writer for recording 16-bit output
+
+#ifndef WAVE_WRITER_H
+#define WAVE_WRITER_H
+
+#include <stdio.h>
+
+class Wave_Writer {
+public:
+	typedef short sample_t;
+
+	Wave_Writer();
+	~Wave_Writer();
+
+	// Create file; returns error string, or NULL on success
+	const char* open( const char* path, long sample_rate, int chan_count = 1 );
+
+	// Append samples to file
+	void write( const sample_t*, long count );
+
+	// Number of samples written so far
+	long sample_count() const { return sample_count_; }
+
+	// Write header and close file. Called automatically by destructor.
+	void close();
+
+private:
+	enum { header_size = 0x2C };
+	FILE* file;
+	long sample_rate;
+	int chan_count;
+	long sample_count_;
+};
+
+#endif
+
@@ -1 +1,3 @@
-g++ -fPIC -O2 -shared -I. -DLINUX DllWrapper.cpp Simple_Apu.cpp nes_apu/apu_snapshot.cpp nes_apu/Blip_Buffer.cpp nes_apu/Multi_Buffer.cpp nes_apu/Nes_Apu.cpp nes_apu/Nes_Namco.cpp nes_apu/Nes_Oscs.cpp nes_apu/Nes_Vrc6.cpp nes_apu/Nes_Vrc7.cpp nes_apu/Nes_Fds.cpp nes_apu/Nes_Mmc5.cpp nes_apu/Nes_Sunsoft.cpp nes_apu/emu2413.c nes_apu/emu2149.c nes_apu/Nonlinear_Buffer.cpp -o NesSndEmu.so
+g++ -fPIC -O2 -shared -I. -DLINUX DllWrapper.cpp Simple_Apu.cpp Vgm_File.cpp nes_apu/apu_snapshot.cpp nes_apu/Blip_Buffer.cpp nes_apu/Multi_Buffer.cpp nes_apu/Nes_Apu.cpp nes_apu/Nes_Namco.cpp nes_apu/Nes_Oscs.cpp nes_apu/Nes_Vrc6.cpp nes_apu/Nes_Vrc7.cpp nes_apu/Nes_Fds.cpp nes_apu/Nes_Mmc5.cpp nes_apu/Nes_Sunsoft.cpp nes_apu/emu2413.c nes_apu/emu2149.c nes_apu/Nonlinear_Buffer.cpp -o NesSndEmu.so
+g++ -O2 -I. -DLINUX nes_render.cpp Vgm_File.cpp Nsf_Player.cpp Nes_Cpu.cpp Wave_Writer.cpp Golden_Checker.cpp Simple_Apu.cpp nes_apu/apu_snapshot.cpp nes_apu/Blip_Buffer.cpp nes_apu/Multi_Buffer.cpp nes_apu/Nes_Apu.cpp nes_apu/Nes_Namco.cpp nes_apu/Nes_Oscs.cpp nes_apu/Nes_Vrc6.cpp nes_apu/Nes_Vrc7.cpp nes_apu/Nes_Fds.cpp nes_apu/Nes_Mmc5.cpp nes_apu/Nes_Sunsoft.cpp nes_apu/emu2413.c nes_apu/emu2149.c nes_apu/Nonlinear_Buffer.cpp -o nes_render
+g++ -O2 -I. -DLINUX nes_bench.cpp nes_apu/apu_snapshot.cpp nes_apu/Blip_Buffer.cpp nes_apu/Nes_Apu.cpp nes_apu/Nes_Namco.cpp nes_apu/Nes_Oscs.cpp nes_apu/Nes_Fds.cpp nes_apu/emu2413.c nes_apu/emu2149.c -o nes_bench
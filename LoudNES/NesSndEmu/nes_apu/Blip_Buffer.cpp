@@ -1,10 +1,13 @@
 
 // Blip_Buffer 0.3.3. http://www.slack.net/~ant/libs/
 
-#include "Blip_Buffer.h"
-
+// system headers before Blip_Buffer.h, whose min/max macros break them
 #include <string.h>
 #include <math.h>
+#include <memory>
+#include <mutex>
+
+#include "Blip_Buffer.h"
 
 /* Copyright (C) 2003-2005 Shay Green. This module is free software; you
 can redistribute it and/or modify it under the terms of the GNU Lesser
@@ -112,30 +115,81 @@ long Blip_Buffer::count_samples( blip_time_t t ) const {
 	return (resampled_time( t ) >> BLIP_BUFFER_ACCURACY) - (offset_ >> BLIP_BUFFER_ACCURACY);
 }
 
-void Blip_Impulse_::init( blip_pair_t_* imps, int w, int r, int fb )
+blip_time_t Blip_Buffer::count_clocks( long count ) const
+{
+	if ( count > (long) buffer_size_ )
+		count = buffer_size_;
+	resampled_time_t time = (resampled_time_t) count << BLIP_BUFFER_ACCURACY;
+	if ( time <= offset_ )
+		return 0;
+	return (blip_time_t) ((time - offset_ + factor_ - 1) / factor_);
+}
+
+struct blip_impulses_t_ {
+	blip_impulses_t_* next;
+	long refs;
+	blip_eq_t eq;
+	int width;
+	int res;
+	int fine_bits;
+	int unit;
+	blip_pair_t_* pairs;
+};
+
+// Tables in use, and the lock guarding them (function statics, so they're ready
+// for synths constructed during static initialization)
+static blip_impulses_t_*& shared_impulses()
+{
+	static blip_impulses_t_* list = NULL;
+	return list;
+}
+
+static std::mutex& shared_impulses_mutex()
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+static void release_impulses( blip_impulses_t_* t )
+{
+	if ( !t || --t->refs )
+		return;
+	blip_impulses_t_** p = &shared_impulses();
+	while ( *p != t )
+		p = &(*p)->next;
+	*p = t->next;
+	delete [] t->pairs;
+	delete t;
+}
+
+void Blip_Impulse_::init( int w, int r, int fb )
 {
 	fine_bits = fb;
 	width = w;
-	impulses = (imp_t*) imps;
 	generate = true;
 	volume_unit_ = -1.0;
 	res = r;
 	buf = NULL;
 	
-	impulse = &impulses [width * res * 2 * (fine_bits ? 2 : 1)];
 	offset = 0;
 }
 
+Blip_Impulse_::~Blip_Impulse_()
+{
+	std::lock_guard<std::mutex> lock( shared_impulses_mutex() );
+	release_impulses( shared );
+}
+
 const int impulse_bits = 15;
 const long impulse_amp = 1L << impulse_bits;
 const long impulse_offset = impulse_amp / 2;
 
-void Blip_Impulse_::scale_impulse( int unit, imp_t* imp_in ) const
+void Blip_Impulse_::scale_impulse( int unit, imp_t* imp_in, const imp_t* impulse ) const
 {
 	long offset = ((long) unit << impulse_bits) - impulse_offset * unit +
 			(1 << (impulse_bits - 1));
 	imp_t* imp = imp_in;
-	imp_t* fimp = impulse;
+	const imp_t* fimp = impulse;
 	for ( int n = res / 2 + 1; n--; )
 	{
 		int error = unit;
@@ -165,14 +219,14 @@ void Blip_Impulse_::scale_impulse( int unit, imp_t* imp_in ) const
 
 const int max_res = 1 << blip_res_bits_;
 
-void Blip_Impulse_::fine_volume_unit()
+void Blip_Impulse_::fine_volume_unit( imp_t* impulses, const imp_t* impulse ) const
 {
 	// to do: find way of merging in-place without temporary buffer
 	
 	imp_t temp [max_res * 2 * Blip_Buffer::widest_impulse_];
-	scale_impulse( (offset & 0xffff) << fine_bits, temp );
+	scale_impulse( (offset & 0xffff) << fine_bits, temp, impulse );
 	imp_t* imp2 = impulses + res * 2 * width;
-	scale_impulse( offset & 0xffff, imp2 );
+	scale_impulse( offset & 0xffff, imp2, impulse );
 	
 	// merge impulses
 	imp_t* imp = impulses;
@@ -197,10 +251,56 @@ void Blip_Impulse_::volume_unit( double new_unit )
 	
 	offset = 0x10001 * (unsigned long) floor( volume_unit_ * 0x10000 + 0.5 );
 	
-	if ( fine_bits )
-		fine_volume_unit();
+	share_impulses();
+}
+
+void Blip_Impulse_::share_impulses()
+{
+	std::lock_guard<std::mutex> lock( shared_impulses_mutex() );
+	
+	const int unit = offset & 0xffff;
+	blip_impulses_t_* t = shared_impulses();
+	while ( t && !(t->width == width && t->res == res && t->fine_bits == fine_bits &&
+			t->unit == unit && t->eq.treble == eq.treble && t->eq.cutoff == eq.cutoff &&
+			t->eq.sample_rate == eq.sample_rate) )
+		t = t->next;
+	
+	if ( t )
+	{
+		t->refs++;
+	}
 	else
-		scale_impulse( offset & 0xffff, impulses );
+	{
+		// scaled impulses, followed by the unscaled one they're made from
+		const long scaled_size = (long) width * res * 2 * (fine_bits ? 2 : 1);
+		const long size = scaled_size + width * (res / 2 + 1);
+		
+		// throws when out of memory, before the old table is let go of
+		std::unique_ptr<blip_impulses_t_> n( BLARGG_NEW blip_impulses_t_ );
+		n->pairs = BLARGG_NEW blip_pair_t_ [size / 2];
+		t = n.release();
+		t->refs = 1;
+		t->eq = eq;
+		t->width = width;
+		t->res = res;
+		t->fine_bits = fine_bits;
+		t->unit = unit;
+		
+		imp_t* imps = (imp_t*) t->pairs;
+		imp_t* impulse = imps + scaled_size;
+		generate_impulse( impulse );
+		if ( fine_bits )
+			fine_volume_unit( imps, impulse );
+		else
+			scale_impulse( unit, imps, impulse );
+		
+		t->next = shared_impulses();
+		shared_impulses() = t;
+	}
+	
+	release_impulses( shared );
+	shared = t;
+	impulses = t->pairs;
 }
 
 static const double pi = 3.1415926535897932384626433832795029L;
@@ -214,6 +314,13 @@ void Blip_Impulse_::treble_eq( const blip_eq_t& new_eq )
 	generate = false;
 	eq = new_eq;
 	
+	// rescale
+	if ( volume_unit_ >= 0 )
+		share_impulses();
+}
+
+void Blip_Impulse_::generate_impulse( imp_t* impulse ) const
+{
 	double treble = pow( 10.0, 1.0 / 20 * eq.treble ); // dB (-6dB = 0.50)
 	if ( treble < 0.000005 )
 		treble = 0.000005;
@@ -299,13 +406,6 @@ void Blip_Impulse_::treble_eq( const blip_eq_t& new_eq )
 			*imp++ = (imp_t) floor( sum * factor + (impulse_offset + 0.5) );
 		}
 	}
-	
-	// rescale
-	double unit = volume_unit_;
-	if ( unit >= 0 ) {
-		volume_unit_ = -1;
-		volume_unit( unit );
-	}
 }
 
 void Blip_Buffer::remove_samples( long count )
@@ -324,8 +424,8 @@ void Blip_Buffer::remove_samples( long count )
 	
 	// copy remaining samples to beginning and clear old samples
 	long remain = samples_avail() + widest_impulse_ + copy_extra;
-	if ( count >= remain )
-		memmove( buffer_, buffer_ + count, remain * sizeof (buf_t_) );
+	if ( count < remain )
+		memmove( buffer_, buffer_ + count, remain * sizeof (buf_t_) ); // ranges overlap
 	else
 		memcpy(  buffer_, buffer_ + count, remain * sizeof (buf_t_) );
 	memset( buffer_ + remain, sample_offset & 0xFF, count * sizeof (buf_t_) );
@@ -81,6 +81,10 @@ public:
 	// Number of raw samples that can be mixed within frame of specified duration
 	long count_samples( blip_time_t duration ) const;
 	
+	// Number of clocks needed until 'count' samples will be available. If buffer
+	// can't even hold 'count' samples, returns number of clocks until it is full.
+	blip_time_t count_clocks( long count ) const;
+	
 	// Mix 'count' samples from 'buf' into buffer.
 	void mix_samples( const blip_sample_t* buf, long count );
 	
@@ -181,25 +185,38 @@ const int blip_res_bits_ = 5;
 
 typedef BOOST::uint32_t blip_pair_t_;
 
+struct blip_impulses_t_;
+
+// Impulse tables depend only on a synth's shape, eq and volume unit, so synths
+// with the same ones share a table, built by whichever needed it first and freed
+// along with the last to use it.
 class Blip_Impulse_ {
 	typedef BOOST::uint16_t imp_t;
 	
 	blip_eq_t eq;
 	double  volume_unit_;
-	imp_t*  impulses;
-	imp_t*  impulse;
+	blip_impulses_t_* shared;
 	int     width;
 	int     fine_bits;
 	int     res;
 	bool    generate;
 	
-	void fine_volume_unit();
-	void scale_impulse( int unit, imp_t* ) const;
+	void share_impulses();
+	void generate_impulse( imp_t* impulse ) const;
+	void fine_volume_unit( imp_t* impulses, const imp_t* impulse ) const;
+	void scale_impulse( int unit, imp_t*, const imp_t* impulse ) const;
+	
+	// noncopyable
+	Blip_Impulse_( const Blip_Impulse_& );
+	Blip_Impulse_& operator = ( const Blip_Impulse_& );
 public:
 	Blip_Buffer*    buf;
 	BOOST::uint32_t offset;
+	const blip_pair_t_* impulses;
 	
-	void init( blip_pair_t_* impulses, int width, int res, int fine_bits = 0 );
+	Blip_Impulse_() : shared( NULL ), impulses( NULL ) { }
+	~Blip_Impulse_();
+	void init( int width, int res, int fine_bits = 0 );
 	void volume_unit( double );
 	void treble_eq( const blip_eq_t& );
 };
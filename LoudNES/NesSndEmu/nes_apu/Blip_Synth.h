@@ -11,6 +11,8 @@
 	#include "Blip_Buffer.h"
 #endif
 
+#include "Nes_Counters.h"
+
 // Quality level. Higher levels are slower, and worse in a few cases.
 // Use blip_good_quality as a starting point.
 const int blip_low_quality = 1;
@@ -37,15 +39,17 @@ class Blip_Synth {
 		width = (quality < 5 ? quality * 4 : Blip_Buffer::widest_impulse_),
 		res = 1 << blip_res_bits_,
 		impulse_size = width / 2 * (fine_mode + 1),
-		base_impulses_size = width / 2 * (res / 2 + 1),
 		fine_bits = (fine_mode ? (abs_range <= 64 ? 2 : abs_range <= 128 ? 3 :
 			abs_range <= 256 ? 4 : abs_range <= 512 ? 5 : abs_range <= 1024 ? 6 :
 			abs_range <= 2048 ? 7 : 8) : 0)
 	};
-	blip_pair_t_  impulses [impulse_size * res * 2 + base_impulses_size];
 	Blip_Impulse_ impulse;
 public:
-	Blip_Synth()                            { impulse.init( impulses, width, res, fine_bits ); }
+	Blip_Synth()                            { impulse.init( width, res, fine_bits ); }
+	
+	// Impulse tables are shared between synths with the same settings. Changing
+	// them to ones no synth has yet allocates, and throws std::bad_alloc if that
+	// fails, leaving the synth to be set up again before use.
 	
 	// Configure low-pass filter (see notes.txt). Not optimized for real-time control
 	void treble_eq( const blip_eq_t& eq )   { impulse.treble_eq( eq ); }
@@ -135,6 +139,8 @@ template<int quality,int range>
 inline void Blip_Synth<quality,range>::offset_resampled( blip_resampled_time_t time,
 		int delta, Blip_Buffer* blip_buf ) const
 {
+	NES_COUNT_TRANSITION();
+	
 	typedef blip_pair_t_ pair_t;
 	
 	unsigned sample_index = (time >> BLIP_BUFFER_ACCURACY) & ~1;
@@ -145,7 +151,7 @@ inline void Blip_Synth<quality,range>::offset_resampled( blip_resampled_time_t t
 	
 	enum { shift = BLIP_BUFFER_ACCURACY - blip_res_bits_ };
 	enum { mask = res * 2 - 1 };
-	const pair_t* imp = &impulses [((time >> shift) & mask) * impulse_size];
+	const pair_t* imp = &impulse.impulses [((time >> shift) & mask) * impulse_size];
 	
 	pair_t offset = impulse.offset * delta;
 	
@@ -0,0 +1,36 @@
+
+// Host processor timestamp counter, for cheap timing of emulation code
+
+// Ticks are only meaningful as differences on one machine. Their rate is
+// unspecified; calibrate against a wall clock to convert to seconds.
+
+#ifndef HOST_TICKS_H
+#define HOST_TICKS_H
+
+#if defined (_M_IX86) || defined (_M_X64)
+	#include <intrin.h>
+	#define HOST_TICKS_RDTSC 1
+#elif defined (__i386__) || defined (__x86_64__)
+	#include <x86intrin.h>
+	#define HOST_TICKS_RDTSC 1
+#elif !defined (__aarch64__)
+	#include <chrono>
+#endif
+
+typedef unsigned long long host_ticks_t;
+
+inline host_ticks_t read_host_ticks()
+{
+#if HOST_TICKS_RDTSC
+	return __rdtsc();
+#elif defined (__aarch64__)
+	host_ticks_t t;
+	__asm__ __volatile__ ( "mrs %0, cntvct_el0" : "=r" (t) );
+	return t;
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#endif
+
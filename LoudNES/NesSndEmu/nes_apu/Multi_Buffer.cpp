@@ -139,6 +139,111 @@ long Stereo_Buffer::read_samples( blip_sample_t* out, long count )
 	return count * 2;
 }
 
+Channels_Buffer::Channels_Buffer() : Multi_Buffer( 1 )
+{
+	bufs = NULL;
+	buf_count = 0;
+	clock_rate_ = 0;
+	bass_freq_ = 16;
+}
+
+Channels_Buffer::~Channels_Buffer()
+{
+	delete [] bufs;
+}
+
+blargg_err_t Channels_Buffer::set_channel_count( int count )
+{
+	delete [] bufs;
+	bufs = NULL;
+	buf_count = 0;
+	if ( count )
+	{
+		bufs = BLARGG_NEW Blip_Buffer [count];
+		BLARGG_CHECK_ALLOC( bufs );
+		buf_count = count;
+	}
+	
+	// new buffers take the settings of the old ones
+	if ( Multi_Buffer::sample_rate() )
+		BLARGG_RETURN_ERR( sample_rate( Multi_Buffer::sample_rate(), length() ) );
+	return blargg_success;
+}
+
+blargg_err_t Channels_Buffer::sample_rate( long rate, int msec )
+{
+	for ( int i = 0; i < buf_count; i++ )
+	{
+		BLARGG_RETURN_ERR( bufs [i].sample_rate( rate, msec ) );
+		if ( clock_rate_ )
+			bufs [i].clock_rate( clock_rate_ );
+		bufs [i].bass_freq( bass_freq_ );
+	}
+	return Multi_Buffer::sample_rate( rate, msec );
+}
+
+void Channels_Buffer::clock_rate( long rate )
+{
+	clock_rate_ = rate;
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].clock_rate( rate );
+}
+
+void Channels_Buffer::bass_freq( int bass )
+{
+	bass_freq_ = bass;
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].bass_freq( bass );
+}
+
+void Channels_Buffer::clear()
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].clear();
+}
+
+Channels_Buffer::channel_t Channels_Buffer::channel( int index )
+{
+	channel_t ch;
+	ch.center = &bufs [index];
+	ch.left   = &bufs [index];
+	ch.right  = &bufs [index];
+	return ch;
+}
+
+void Channels_Buffer::end_frame( blip_time_t t, bool )
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].end_frame( t );
+}
+
+long Channels_Buffer::read_channels( blip_sample_t* const* outs, long count )
+{
+	long avail = samples_avail();
+	if ( count > avail )
+		count = avail;
+	for ( int i = 0; i < buf_count; i++ )
+	{
+		if ( outs [i] )
+			bufs [i].read_samples( outs [i], count );
+		else
+			bufs [i].remove_samples( count );
+	}
+	return count;
+}
+
+void Channels_Buffer::remove_samples( long count )
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].remove_samples( count );
+}
+
+void Channels_Buffer::remove_silence( long count )
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].remove_silence( count );
+}
+
 #include BLARGG_ENABLE_OPTIMIZER
 
 void Stereo_Buffer::mix_stereo( blip_sample_t* out, long count )
@@ -199,3 +304,55 @@ void Stereo_Buffer::mix_mono( blip_sample_t* out, long count )
 	in.end( bufs [0] );
 }
 
+
+long Channels_Buffer::read_samples( blip_sample_t* out, long count )
+{
+	long avail = samples_avail();
+	if ( count > avail )
+		count = avail;
+	for ( long i = 0; i < count; i++ )
+		out [i] = 0;
+	return mix_samples( out, count );
+}
+
+long Channels_Buffer::mix_samples( blip_sample_t* out, long count )
+{
+	long avail = samples_avail();
+	if ( count > avail )
+		count = avail;
+	
+	long remain = count;
+	while ( remain )
+	{
+		enum { chunk_size = 256 };
+		long sum [chunk_size];
+		int n = remain < chunk_size ? (int) remain : (int) chunk_size;
+		for ( int i = 0; i < n; i++ )
+			sum [i] = out [i];
+		
+		for ( int b = 0; b < buf_count; b++ )
+		{
+			Blip_Reader in;
+			int bass = in.begin( bufs [b] );
+			for ( int i = 0; i < n; i++ )
+			{
+				sum [i] += in.read();
+				in.next( bass );
+			}
+			in.end( bufs [b] );
+			bufs [b].remove_samples( n );
+		}
+		
+		for ( int i = 0; i < n; i++ )
+		{
+			long s = sum [i];
+			out [i] = (blip_sample_t) s;
+			if ( (BOOST::int16_t) s != s )
+				out [i] = 0x7FFF - (s >> 24);
+		}
+		out += n;
+		remain -= n;
+	}
+	
+	return count;
+}
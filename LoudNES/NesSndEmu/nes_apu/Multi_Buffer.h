@@ -115,6 +115,52 @@ private:
 	void mix_mono( blip_sample_t*, long );
 };
 
+// Channels_Buffer gives each channel a buffer of its own, so they can be read
+// separately. Its read_samples() mixes them all down to mono.
+class Channels_Buffer : public Multi_Buffer {
+public:
+	Channels_Buffer();
+	~Channels_Buffer();
+	
+	// Buffer used for indexed channel
+	Blip_Buffer* buffer( int index );
+	
+	// Number of channels
+	int channel_count() const;
+	
+	// Read 'count' samples of each channel into outs [index], or discard them
+	// where outs [index] is NULL. Return number of samples actually read.
+	long read_channels( blip_sample_t* const* outs, long count );
+	
+	// Discard 'count' samples of every channel
+	void remove_samples( long count );
+	
+	// Discard 'count' samples from buffers nothing has been added to since the
+	// last clear(), without the cost of remove_samples()
+	void remove_silence( long count );
+	
+	// Like read_samples(), but add the mix to what 'out' already holds
+	long mix_samples( blip_sample_t* out, long count );
+	
+	// See Multi_Buffer
+	blargg_err_t set_channel_count( int );
+	blargg_err_t sample_rate( long, int msec = blip_default_length );
+	using Multi_Buffer::sample_rate;
+	void clock_rate( long );
+	void bass_freq( int );
+	void clear();
+	channel_t channel( int index );
+	void end_frame( blip_time_t, bool unused = true );
+	
+	long samples_avail() const;
+	long read_samples( blip_sample_t*, long );
+	
+private:
+	Blip_Buffer* bufs;
+	int buf_count;
+	long clock_rate_;
+	int bass_freq_;
+};
 
 // End of public interface
 
@@ -153,5 +199,11 @@ inline long Mono_Buffer::read_samples( blip_sample_t* p, long s ) { return buf.r
 
 inline long Mono_Buffer::samples_avail() const { return buf.samples_avail(); }
 
+inline Blip_Buffer* Channels_Buffer::buffer( int index ) { return &bufs [index]; }
+
+inline int Channels_Buffer::channel_count() const { return buf_count; }
+
+inline long Channels_Buffer::samples_avail() const { return buf_count ? bufs [0].samples_avail() : 0; }
+
 #endif
 
@@ -16,13 +16,22 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
 
 #include BLARGG_SOURCE_BEGIN
 
+#if NES_EVENT_COUNTERS
+	thread_local nes_counters_t* nes_counters = NULL;
+#endif
+
+#if NES_TRACE
+	nes_trace_t nes_trace;
+	thread_local nes_trace_buffer_t* nes_trace_buffer = NULL;
+	thread_local const char* nes_trace_thread_name = NULL;
+#endif
+
 Nes_Apu::Nes_Apu()
 {
 	dmc.apu = this;
 	dmc.rom_reader = NULL;
-	square1.synth = &square_synth;
-	square2.synth = &square_synth;
 	irq_notifier_ = NULL;
+	osc_ticks_ = NULL;
 	
 	oscs [0] = &square1;
 	oscs [1] = &square2;
@@ -41,10 +50,23 @@ Nes_Apu::~Nes_Apu()
 
 void Nes_Apu::treble_eq( const blip_eq_t& eq )
 {
-	square_synth.treble_eq( eq );
-	triangle.synth.treble_eq( eq );
-	noise.synth.treble_eq( eq );
-	dmc.synth.treble_eq( eq );
+	synths_t* sets [2] = { &linear_synths, &mixer_synths };
+	for ( int i = 0; i < 2; i++ )
+	{
+		sets [i]->square.treble_eq( eq );
+		sets [i]->triangle.treble_eq( eq );
+		sets [i]->noise.treble_eq( eq );
+		sets [i]->dmc.treble_eq( eq );
+	}
+}
+
+void Nes_Apu::use_synths( const synths_t& s )
+{
+	square1.synth = &s.square;
+	square2.synth = &s.square;
+	triangle.synth = &s.triangle;
+	noise.synth = &s.noise;
+	dmc.synth = &s.dmc;
 }
 
 void Nes_Apu::buffer_cleared()
@@ -59,23 +81,42 @@ void Nes_Apu::buffer_cleared()
 void Nes_Apu::enable_nonlinear( double v )
 {
 	dmc.nonlinear = true;
-	square_synth.volume( 1.3 * 0.25751258 / 0.742467605 * 0.25 * v );
+	use_synths( linear_synths );
+	linear_synths.square.volume( 1.3 * 0.25751258 / 0.742467605 * 0.25 * v );
 	
 	const double tnd = 0.75 / 202 * 0.48;
-	triangle.synth.volume_unit( 3 * tnd );
-	noise.synth.volume_unit( 2 * tnd );
-	dmc.synth.volume_unit( tnd );
+	linear_synths.triangle.volume_unit( 3 * tnd );
+	linear_synths.noise.volume_unit( 2 * tnd );
+	linear_synths.dmc.volume_unit( tnd );
 	
 	buffer_cleared();
 }
 
+// Amplitude units are in output sample steps, so the mixer can index its tables by them.
+// The mixer's synths are a set of their own, so once they're set up, switching to and
+// from them doesn't regenerate, allocate or lock anything.
+void Nes_Apu::prepare_nonlinear_mixer( int pulse_unit, int triangle_unit, int noise_unit, int dmc_unit )
+{
+	mixer_synths.square.volume_unit( pulse_unit / 65536.0 );
+	mixer_synths.triangle.volume_unit( triangle_unit / 65536.0 );
+	mixer_synths.noise.volume_unit( noise_unit / 65536.0 );
+	mixer_synths.dmc.volume_unit( dmc_unit / 65536.0 );
+}
+
+void Nes_Apu::enable_nonlinear_mixer( bool b )
+{
+	dmc.nonlinear = b;
+	use_synths( b ? mixer_synths : linear_synths );
+}
+
 void Nes_Apu::volume( double v )
 {
 	dmc.nonlinear = false;
-	square_synth.volume( 0.1128 * v );
-	triangle.synth.volume( 0.12765 * v );
-	noise.synth.volume( 0.0741 * v );
-	dmc.synth.volume( 0.42545 * v );
+	use_synths( linear_synths );
+	linear_synths.square.volume( 0.1128 * v );
+	linear_synths.triangle.volume( 0.12765 * v );
+	linear_synths.noise.volume( 0.0741 * v );
+	linear_synths.dmc.volume( 0.42545 * v );
 }
 
 void Nes_Apu::output( Blip_Buffer* buffer )
@@ -131,9 +172,36 @@ void Nes_Apu::irq_changed()
 
 // frames
 
+void Nes_Apu::run_oscs_timed( cpu_time_t time )
+{
+	host_ticks_t t0 = read_host_ticks();
+	NES_COUNT_OSC( 0 );
+	square1.run( last_time, time );
+	host_ticks_t t1 = read_host_ticks();
+	NES_COUNT_OSC( 1 );
+	square2.run( last_time, time );
+	host_ticks_t t2 = read_host_ticks();
+	NES_COUNT_OSC( 2 );
+	triangle.run( last_time, time );
+	host_ticks_t t3 = read_host_ticks();
+	NES_COUNT_OSC( 3 );
+	noise.run( last_time, time );
+	host_ticks_t t4 = read_host_ticks();
+	NES_COUNT_OSC( 4 );
+	dmc.run( last_time, time );
+	host_ticks_t t5 = read_host_ticks();
+	
+	osc_ticks_ [0] += t1 - t0;
+	osc_ticks_ [1] += t2 - t1;
+	osc_ticks_ [2] += t3 - t2;
+	osc_ticks_ [3] += t4 - t3;
+	osc_ticks_ [4] += t5 - t4;
+}
+
 void Nes_Apu::run_until( cpu_time_t end_time )
 {
 	require( end_time >= last_time );
+	NES_COUNT_RUN( chip_apu );
 	
 	if ( end_time == last_time )
 		return;
@@ -147,11 +215,23 @@ void Nes_Apu::run_until( cpu_time_t end_time )
 		frame_delay -= time - last_time;
 		
 		// run oscs to present
-		square1.run( last_time, time );
-		square2.run( last_time, time );
-		triangle.run( last_time, time );
-		noise.run( last_time, time );
-		dmc.run( last_time, time );
+		if ( osc_ticks_ )
+		{
+			run_oscs_timed( time );
+		}
+		else
+		{
+			NES_COUNT_OSC( 0 );
+			square1.run( last_time, time );
+			NES_COUNT_OSC( 1 );
+			square2.run( last_time, time );
+			NES_COUNT_OSC( 2 );
+			triangle.run( last_time, time );
+			NES_COUNT_OSC( 3 );
+			noise.run( last_time, time );
+			NES_COUNT_OSC( 4 );
+			dmc.run( last_time, time );
+		}
 		last_time = time;
 		
 		if ( time == end_time )
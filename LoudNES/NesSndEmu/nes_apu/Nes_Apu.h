@@ -9,6 +9,8 @@
 typedef long     cpu_time_t; // CPU clock cycle count
 typedef unsigned cpu_addr_t; // 16-bit memory address
 
+#include "Host_Ticks.h" // before blargg_common.h, whose min/max macros break system headers
+#include "Nes_Trace.h"
 #include "Nes_Oscs.h"
 
 struct apu_snapshot_t;
@@ -55,6 +57,10 @@ public:
 	// any audible click.
 	void reset( bool pal_timing = false, int initial_dmc_dac = 0 );
 	
+	// Add host ticks spent running each oscillator to ticks [osc_count]
+	// (indexed as for osc_output()), or stop timing if NULL (the default)
+	void osc_ticks( host_ticks_t* ticks ) { osc_ticks_ = ticks; }
+	
 	// Save/load snapshot of exact emulation state
 	void save_snapshot( apu_snapshot_t* out ) const;
 	void load_snapshot( apu_snapshot_t const& );
@@ -107,6 +113,9 @@ public:
 private:
 	friend class Nes_Nonlinearizer;
 	void enable_nonlinear( double volume );
+	friend class Nes_Nonlinear_Mixer;
+	void prepare_nonlinear_mixer( int pulse_unit, int triangle_unit, int noise_unit, int dmc_unit );
+	void enable_nonlinear_mixer( bool );
 private:
 	// noncopyable
 	Nes_Apu( const Nes_Apu& );
@@ -130,12 +139,22 @@ private:
 	bool irq_flag;
 	void (*irq_notifier_)( void* user_data );
 	void* irq_data;
-	Nes_Square::Synth square_synth; // shared by squares
+	struct synths_t {
+		Nes_Square::Synth square; // shared by squares
+		Nes_Triangle::Synth triangle;
+		Nes_Noise::Synth noise;
+		Nes_Dmc::Synth dmc;
+	};
+	synths_t linear_synths;
+	synths_t mixer_synths; // at Nes_Nonlinear_Mixer's units, once prepared
+	void use_synths( const synths_t& );
+	host_ticks_t* osc_ticks_;
 	
 	short shadow_regs[shadow_regs_count];
 
 	void irq_changed();
 	void state_restored();
+	void run_oscs_timed( cpu_time_t );
 	
 	friend struct Nes_Dmc;
 };
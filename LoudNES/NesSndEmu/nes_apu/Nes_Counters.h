@@ -0,0 +1,144 @@
+
+// Optional emulator event counters, for finding costly write and synthesis patterns
+
+// Compiled in only when NES_EVENT_COUNTERS is defined to 1; otherwise the counting
+// macros do nothing. Simple_Apu makes its counters current for the calling thread
+// while it runs the chips, and keeps per-frame counts and running totals.
+
+#ifndef NES_COUNTERS_H
+#define NES_COUNTERS_H
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef NES_EVENT_COUNTERS
+	#define NES_EVENT_COUNTERS 0
+#endif
+
+struct nes_counters_t {
+	// Chips, numbered as Simple_Apu expansions with the 2A03 first
+	enum { chip_apu, chip_vrc6, chip_vrc7, chip_fds, chip_mmc5, chip_namco, chip_sunsoft, chip_count };
+
+	// Oscillators, numbered as Simple_Apu::enable_channel() channels. Namco's are
+	// mixed before synthesis, so their transitions all count as the first.
+	enum { osc_count = 16 };
+
+	enum { reg_slots = 64 };
+	struct reg_count_t {
+		unsigned addr;
+		unsigned long count;
+	};
+
+	unsigned long frames;
+	unsigned long writes;
+	reg_count_t reg_writes [reg_slots]; // by register, unsorted; unused slots have zero count
+	unsigned long other_writes;         // writes to registers that didn't fit
+	unsigned long cached_writes;        // dropped by Simple_Apu's register cache
+	unsigned long transitions [osc_count]; // Blip_Synth offsets
+	unsigned long run_calls [chip_count];  // run_until() calls, or mixes for VRC7 and Sunsoft 5B
+	int osc; // oscillator now running
+
+	void clear() { memset( this, 0, sizeof *this ); }
+
+	void count_write( unsigned addr, unsigned long n = 1 )
+	{
+		writes += n;
+		for ( int i = 0; i < reg_slots; i++ )
+		{
+			reg_count_t& r = reg_writes [(addr + i) % reg_slots];
+			if ( r.addr == addr || !r.count )
+			{
+				r.addr = addr;
+				r.count += n;
+				return;
+			}
+		}
+		other_writes += n;
+	}
+
+	// Add counts from another set, as for running totals
+	void add( nes_counters_t const& other )
+	{
+		frames += other.frames;
+		for ( int i = 0; i < reg_slots; i++ )
+			if ( other.reg_writes [i].count )
+				count_write( other.reg_writes [i].addr, other.reg_writes [i].count );
+		writes += other.other_writes;
+		other_writes += other.other_writes;
+		cached_writes += other.cached_writes;
+		for ( int i = 0; i < osc_count; i++ )
+			transitions [i] += other.transitions [i];
+		for ( int i = 0; i < chip_count; i++ )
+			run_calls [i] += other.run_calls [i];
+	}
+
+	// Print counts, with per-frame averages
+	void print( FILE* out ) const
+	{
+		static const char* const chip_names [chip_count] =
+				{ "2A03", "VRC6", "VRC7", "FDS", "MMC5", "Namco", "Sunsoft 5B" };
+		double per_frame = frames ? 1.0 / frames : 0;
+
+		fprintf( out, "%lu frames, %lu register writes (%.2f per frame)\n", frames, writes, writes * per_frame );
+
+		// registers in address order
+		reg_count_t regs [reg_slots];
+		int reg_count = 0;
+		for ( int i = 0; i < reg_slots; i++ )
+		{
+			if ( !reg_writes [i].count )
+				continue;
+			int j = reg_count++;
+			for ( ; j && regs [j - 1].addr > reg_writes [i].addr; j-- )
+				regs [j] = regs [j - 1];
+			regs [j] = reg_writes [i];
+		}
+		for ( int i = 0; i < reg_count; i++ )
+			fprintf( out, "  $%04X %10lu  %8.2f per frame\n", regs [i].addr, regs [i].count, regs [i].count * per_frame );
+		if ( other_writes )
+			fprintf( out, "  other %10lu\n", other_writes );
+		if ( cached_writes )
+			fprintf( out, "  %lu unchanged writes dropped (%.2f per frame)\n", cached_writes, cached_writes * per_frame );
+
+		for ( int i = 0; i < osc_count; i++ )
+			if ( transitions [i] )
+				fprintf( out, "  osc %-2d %9lu transitions  %8.2f per frame\n", i, transitions [i], transitions [i] * per_frame );
+		for ( int i = 0; i < chip_count; i++ )
+			if ( run_calls [i] )
+				fprintf( out, "  %-10s %6lu runs  %8.2f per frame\n", chip_names [i], run_calls [i], run_calls [i] * per_frame );
+	}
+};
+
+#if NES_EVENT_COUNTERS
+	// Counters of the Simple_Apu running on this thread, or NULL
+	extern thread_local nes_counters_t* nes_counters;
+
+	// Makes counters current for the calling thread until end of scope
+	struct nes_counters_scope {
+		nes_counters_t* prev;
+		nes_counters_scope( nes_counters_t* c ) { prev = nes_counters; nes_counters = c; }
+		~nes_counters_scope() { nes_counters = prev; }
+	};
+
+	#define NES_COUNTERS_SCOPE( c ) nes_counters_scope nes_counters_scope_( c )
+	#define NES_COUNT_WRITE( addr ) \
+		do { if ( nes_counters ) nes_counters->count_write( addr ); } while ( 0 )
+	#define NES_COUNT_CACHED_WRITE() \
+		do { if ( nes_counters ) nes_counters->cached_writes++; } while ( 0 )
+	#define NES_COUNT_RUN( chip ) \
+		do { if ( nes_counters ) nes_counters->run_calls [nes_counters_t::chip]++; } while ( 0 )
+	#define NES_COUNT_OSC( index ) \
+		do { if ( nes_counters ) nes_counters->osc = (index); } while ( 0 )
+	#define NES_COUNT_TRANSITION() \
+		do { if ( nes_counters ) nes_counters->transitions [nes_counters->osc]++; } while ( 0 )
+#else
+	#define NES_COUNTERS_SCOPE( c )     ((void) 0)
+	#define NES_COUNT_WRITE( addr )     ((void) 0)
+	#define NES_COUNT_CACHED_WRITE()    ((void) 0)
+	#define NES_COUNT_RUN( chip )       ((void) 0)
+	#define NES_COUNT_OSC( index )      ((void) 0)
+	#define NES_COUNT_TRANSITION()      ((void) 0)
+#endif
+
+#endif
+
@@ -125,6 +125,8 @@ void Nes_Fds::end_frame(cpu_time_t time)
 void Nes_Fds::run_until(cpu_time_t time)
 {
 	require(time >= last_time);
+	NES_COUNT_RUN(chip_fds);
+	NES_COUNT_OSC(Nes_Apu::osc_count);
 	run_fds(time);
 	last_time = time;
 }
@@ -37,7 +37,8 @@ void Nes_Mmc5::reset()
 	write_register(0, 0x5015, 0x00);
 	osc_enables = 0;
 
-	for (cpu_addr_t addr = start_addr; addr <= 0x4013; addr++)
+	// squares' registers
+	for (cpu_addr_t addr = start_addr; addr < start_addr + 8; addr++)
 		write_register(0, addr, (addr & 3) ? 0x00 : 0x10);
 }
 
@@ -120,6 +121,7 @@ void Nes_Mmc5::end_frame(cpu_time_t end_time)
 void Nes_Mmc5::run_until(cpu_time_t end_time)
 {
 	require(end_time >= last_time);
+	NES_COUNT_RUN(chip_mmc5);
 
 	if (end_time == last_time)
 		return;
@@ -133,7 +135,9 @@ void Nes_Mmc5::run_until(cpu_time_t end_time)
 		frame_delay -= time - last_time;
 
 		// run oscs to present
+		NES_COUNT_OSC(Nes_Apu::osc_count);
 		square1.run(last_time, time);
+		NES_COUNT_OSC(Nes_Apu::osc_count + 1);
 		square2.run(last_time, time);
 		last_time = time;
 
@@ -76,6 +76,8 @@ void Nes_Namco::end_frame( cpu_time_t time )
 void Nes_Namco::run_until(cpu_time_t end_time)
 {
 	require(end_time >= last_time);
+	NES_COUNT_RUN(chip_namco);
+	NES_COUNT_OSC(Nes_Apu::osc_count);
 
 	int active_oscs = ((reg[0x7f] >> 4) & 7) + 1;
 
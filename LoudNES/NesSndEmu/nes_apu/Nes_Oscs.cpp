@@ -181,7 +181,7 @@ void Nes_Triangle::run( cpu_time_t time, cpu_time_t end_time )
 	
 	int delta = update_amp( calc_amp() );
 	if ( delta )
-		synth.offset( time, delta, output );
+		synth->offset( time, delta, output );
 	
 	time += delay;
 	const int timer_period = period() + 1;
@@ -192,6 +192,7 @@ void Nes_Triangle::run( cpu_time_t time, cpu_time_t end_time )
 	else if ( time < end_time )
 	{
 		Blip_Buffer* const output = this->output;
+		const Synth* synth = this->synth;
 		
 		int phase = this->phase;
 		int volume = 1;
@@ -206,7 +207,7 @@ void Nes_Triangle::run( cpu_time_t time, cpu_time_t end_time )
 				volume = -volume;
 			}
 			else {
-				synth.offset_inline( time, volume, output );
+				synth->offset_inline( time, volume, output );
 			}
 			
 			time += timer_period;
@@ -365,7 +366,7 @@ void Nes_Dmc::run( cpu_time_t time, cpu_time_t end_time )
 	
 	int delta = update_amp( dac );
 	if ( delta )
-		synth.offset( time, delta, output );
+		synth->offset( time, delta, output );
 	
 	time += delay;
 	if ( time < end_time )
@@ -380,6 +381,7 @@ void Nes_Dmc::run( cpu_time_t time, cpu_time_t end_time )
 		else
 		{
 			Blip_Buffer* const output = this->output;
+			const Synth* synth = this->synth;
 			const int period = this->period;
 			int bits = this->bits;
 			int dac = this->dac;
@@ -392,7 +394,7 @@ void Nes_Dmc::run( cpu_time_t time, cpu_time_t end_time )
 					bits >>= 1;
 					if ( unsigned (dac + step) <= 0x7F ) {
 						dac += step;
-						synth.offset_inline( time, step, output );
+						synth->offset_inline( time, step, output );
 					}
 				}
 				
@@ -432,6 +434,61 @@ static const short noise_period_table [16] = {
 	0x0CA, 0x0FE, 0x17C, 0x1FC, 0x2FA, 0x3F8, 0x7F2, 0xFE4
 };
 
+// Noise register stepped many times at once, for when it's muted. A step is linear
+// over GF(2), so each power of two of steps is a fixed 15x15 bit matrix, held as the
+// image of each register bit. Stepping count times takes one matrix per set bit.
+struct noise_jumps_t {
+	enum { bits = 15 };
+	enum { max_log2 = 31 };
+	unsigned short image [2] [max_log2] [bits]; // by mode, log2 of steps, register bit
+	
+	static int apply( unsigned short const* image, int noise )
+	{
+		int result = 0;
+		for ( int bit = 0; noise; bit++, noise >>= 1 )
+			if ( noise & 1 )
+				result ^= image [bit];
+		return result;
+	}
+	
+	int advance( int mode, int noise, int count ) const
+	{
+		for ( int k = 0; count; k++, count >>= 1 )
+			if ( count & 1 )
+				noise = apply( image [mode] [k], noise );
+		return noise;
+	}
+	
+	noise_jumps_t()
+	{
+		for ( int mode = 0; mode < 2; mode++ )
+		{
+			const int tap = (mode ? 8 : 13);
+			for ( int bit = 0; bit < bits; bit++ )
+			{
+				int noise = 1 << bit;
+				int feedback = (noise << tap) ^ (noise << 14);
+				image [mode] [0] [bit] = (feedback & 0x4000) | (noise >> 1);
+			}
+			
+			for ( int k = 1; k < max_log2; k++ )
+				for ( int bit = 0; bit < bits; bit++ )
+					image [mode] [k] [bit] = apply( image [mode] [k - 1], image [mode] [k - 1] [bit] );
+		}
+	}
+};
+
+static noise_jumps_t const& noise_jumps()
+{
+	static noise_jumps_t const jumps;
+	return jumps;
+}
+
+Nes_Noise::Nes_Noise()
+{
+	noise_jumps(); // build them now rather than on the first muted run
+}
+
 void Nes_Noise::run( cpu_time_t time, cpu_time_t end_time )
 {
 	if ( !output )
@@ -441,7 +498,7 @@ void Nes_Noise::run( cpu_time_t time, cpu_time_t end_time )
 	int amp = (noise & 1) ? volume : 0;
 	int delta = update_amp( amp );
 	if ( delta )
-		synth.offset( time, delta, output );
+		synth->offset( time, delta, output );
 	
 	time += delay;
 	if ( time < end_time )
@@ -452,18 +509,17 @@ void Nes_Noise::run( cpu_time_t time, cpu_time_t end_time )
 		if ( !volume )
 		{
 			// round to next multiple of period
-			time += (end_time - time + period - 1) / period * period;
+			int count = (end_time - time + period - 1) / period;
+			time += count * period;
 			
-			// approximate noise cycling while muted, by shuffling up noise register
-			// to do: precise muted noise cycling?
-			if ( !(regs [2] & mode_flag) ) {
-				int feedback = (noise << 13) ^ (noise << 14);
-				noise = (feedback & 0x4000) | (noise >> 1);
-			}
+			// cycle noise register as when audible, so the sequence doesn't
+			// depend on how often the oscillator is run
+			noise = noise_jumps().advance( regs [2] & mode_flag ? 1 : 0, noise, count );
 		}
 		else
 		{
 			Blip_Buffer* const output = this->output;
+			const Synth* synth = this->synth;
 			
 			// using resampled time avoids conversion in synth.offset()
 			Blip_Buffer::resampled_time_t rperiod = output->resampled_duration( period );
@@ -480,7 +536,7 @@ void Nes_Noise::run( cpu_time_t time, cpu_time_t end_time )
 				if ( (noise + 1) & 2 ) {
 					// bits 0 and 1 of noise differ
 					delta = -delta;
-					synth.offset_resampled( rtime, delta, output );
+					synth->offset_resampled( rtime, delta, output );
 				}
 				
 				rtime += rperiod;
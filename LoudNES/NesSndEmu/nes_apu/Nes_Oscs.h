@@ -76,7 +76,8 @@ struct Nes_Triangle : Nes_Osc
 	enum { phase_range = 16 };
 	int phase;
 	int linear_counter;
-	Blip_Synth<blip_good_quality,15> synth;
+	typedef Blip_Synth<blip_good_quality,15> Synth;
+	const Synth* synth;
 	
 	int calc_amp() const;
 	void run( cpu_time_t, cpu_time_t );
@@ -92,8 +93,10 @@ struct Nes_Triangle : Nes_Osc
 struct Nes_Noise : Nes_Envelope
 {
 	int noise;
-	Blip_Synth<blip_med_quality,15> synth;
+	typedef Blip_Synth<blip_med_quality,15> Synth;
+	const Synth* synth;
 	
+	Nes_Noise();
 	void run( cpu_time_t, cpu_time_t );
 	void reset() {
 		noise = 1 << 14;
@@ -128,7 +131,8 @@ struct Nes_Dmc : Nes_Osc
 	
 	Nes_Apu* apu;
 	
-	Blip_Synth<blip_med_quality,127> synth;
+	typedef Blip_Synth<blip_med_quality,127> Synth;
+	const Synth* synth;
 	
 	void start();
 	void write_register( int, int );
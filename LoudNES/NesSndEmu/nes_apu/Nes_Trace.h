@@ -0,0 +1,217 @@
+
+// Optional timeline tracing of emulator and plugin work, saved as Chrome trace JSON
+
+// Compiled in only when NES_TRACE is defined to 1; otherwise the tracing macros do
+// nothing. Between nes_trace_start() and nes_trace_stop(), each thread records its
+// scoped events into its own buffer, without locks. nes_trace_write() saves them in
+// the Trace Event format, which chrome://tracing and ui.perfetto.dev both open.
+
+#ifndef NES_TRACE_H
+#define NES_TRACE_H
+
+#ifndef NES_TRACE
+	#define NES_TRACE 0
+#endif
+
+#if NES_TRACE
+
+#include "Host_Ticks.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+struct nes_trace_event_t {
+	const char* name; // must be static
+	host_ticks_t begin;
+	host_ticks_t end;
+};
+
+// Events of one thread. Only that thread writes them; others may read up to count.
+struct nes_trace_buffer_t {
+	enum { capacity = 1 << 16 }; // later events are dropped
+	nes_trace_event_t events [capacity];
+	std::atomic<long> count;
+	std::atomic<long> dropped;
+	std::atomic<unsigned> recording; // recording the events belong to
+	const char* thread_name;
+	int tid;
+	nes_trace_buffer_t* next;
+};
+
+struct nes_trace_t {
+	std::atomic<unsigned> recording; // odd while recording
+	std::atomic<nes_trace_buffer_t*> buffers;
+	std::atomic<int> thread_count;
+	host_ticks_t start_ticks;
+	host_ticks_t stop_ticks;
+	std::chrono::steady_clock::time_point start_time;
+	std::chrono::steady_clock::time_point stop_time;
+};
+
+// Defined in Nes_Apu.cpp
+extern nes_trace_t nes_trace;
+extern thread_local nes_trace_buffer_t* nes_trace_buffer;
+extern thread_local const char* nes_trace_thread_name;
+
+// Start a new recording, replacing the previous one
+inline void nes_trace_start()
+{
+	unsigned recording = nes_trace.recording.load();
+	if ( recording & 1 )
+		return;
+	nes_trace.start_time = std::chrono::steady_clock::now();
+	nes_trace.start_ticks = read_host_ticks();
+	nes_trace.recording.store( recording + 1 );
+}
+
+inline void nes_trace_stop()
+{
+	unsigned recording = nes_trace.recording.load();
+	if ( !(recording & 1) )
+		return;
+	nes_trace.stop_ticks = read_host_ticks();
+	nes_trace.stop_time = std::chrono::steady_clock::now();
+	nes_trace.recording.store( recording + 1 );
+}
+
+inline bool nes_trace_recording()
+{
+	return nes_trace.recording.load( std::memory_order_relaxed ) & 1;
+}
+
+// Buffer for the calling thread. Allocated on the thread's first event of any
+// recording, and kept for the life of the process.
+inline nes_trace_buffer_t* nes_trace_thread_buffer()
+{
+	nes_trace_buffer_t* b = nes_trace_buffer;
+	if ( !b )
+	{
+		b = new nes_trace_buffer_t;
+		b->count.store( 0, std::memory_order_relaxed );
+		b->dropped.store( 0, std::memory_order_relaxed );
+		b->recording.store( 0, std::memory_order_relaxed );
+		b->thread_name = NULL;
+		b->tid = ++nes_trace.thread_count;
+		b->next = nes_trace.buffers.load();
+		while ( !nes_trace.buffers.compare_exchange_weak( b->next, b ) ) { }
+		nes_trace_buffer = b;
+	}
+	return b;
+}
+
+inline void nes_trace_record( const char* name, host_ticks_t begin, unsigned recording )
+{
+	host_ticks_t end = read_host_ticks();
+	nes_trace_buffer_t* b = nes_trace_thread_buffer();
+	if ( b->recording.load( std::memory_order_relaxed ) != recording )
+	{
+		// first event of a new recording
+		b->count.store( 0, std::memory_order_relaxed );
+		b->dropped.store( 0, std::memory_order_relaxed );
+		b->recording.store( recording, std::memory_order_release );
+	}
+	if ( nes_trace_thread_name )
+		b->thread_name = nes_trace_thread_name;
+
+	long n = b->count.load( std::memory_order_relaxed );
+	if ( n >= nes_trace_buffer_t::capacity )
+	{
+		b->dropped.store( b->dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+		return;
+	}
+	nes_trace_event_t& e = b->events [n];
+	e.name = name;
+	e.begin = begin;
+	e.end = end;
+	b->count.store( n + 1, std::memory_order_release );
+}
+
+// Records an event lasting from construction to end of scope
+struct nes_trace_scope {
+	const char* name;
+	unsigned recording;
+	host_ticks_t begin;
+	nes_trace_scope( const char* n )
+	{
+		name = n;
+		recording = nes_trace.recording.load( std::memory_order_relaxed );
+		begin = (recording & 1) ? read_host_ticks() : 0;
+	}
+	~nes_trace_scope()
+	{
+		if ( recording & 1 )
+			nes_trace_record( name, begin, recording );
+	}
+};
+
+inline void nes_trace_write_string( FILE* out, const char* s )
+{
+	putc( '"', out );
+	for ( ; *s; s++ )
+	{
+		if ( *s == '"' || *s == '\\' )
+			putc( '\\', out );
+		putc( *s, out );
+	}
+	putc( '"', out );
+}
+
+// Write the last recording to path, as Chrome trace JSON. Call after nes_trace_stop().
+// Returns false if the file couldn't be written or nothing has been recorded.
+inline bool nes_trace_write( const char* path )
+{
+	unsigned recording = nes_trace.recording.load();
+	if ( !recording || (recording & 1) )
+		return false;
+	recording -= 1;
+
+	FILE* out = fopen( path, "w" );
+	if ( !out )
+		return false;
+
+	// calibrate ticks against the wall clock over the recording
+	double seconds = std::chrono::duration<double>( nes_trace.stop_time - nes_trace.start_time ).count();
+	double ticks = (double) (nes_trace.stop_ticks - nes_trace.start_ticks);
+	double usec_per_tick = ticks > 0 ? seconds * 1e6 / ticks : 0;
+
+	fprintf( out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf( out, "{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":\"LoudNES\"}}" );
+	long dropped = 0;
+	for ( nes_trace_buffer_t* b = nes_trace.buffers.load(); b; b = b->next )
+	{
+		if ( b->recording.load( std::memory_order_acquire ) != recording )
+			continue;
+		long count = b->count.load( std::memory_order_acquire );
+		dropped += b->dropped.load( std::memory_order_relaxed );
+
+		fprintf( out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", b->tid );
+		if ( b->thread_name )
+			nes_trace_write_string( out, b->thread_name );
+		else
+			fprintf( out, "\"thread %d\"", b->tid );
+		fprintf( out, "}}" );
+
+		for ( long i = 0; i < count; i++ )
+		{
+			nes_trace_event_t const& e = b->events [i];
+			fprintf( out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":", b->tid );
+			nes_trace_write_string( out, e.name );
+			fprintf( out, ",\"ts\":%.3f,\"dur\":%.3f}",
+					(double) (long long) (e.begin - nes_trace.start_ticks) * usec_per_tick,
+					(double) (e.end - e.begin) * usec_per_tick );
+		}
+	}
+	fprintf( out, "\n],\"otherData\":{\"dropped_events\":\"%ld\"}}\n", dropped );
+
+	return fclose( out ) == 0;
+}
+
+	#define NES_TRACE_SCOPE( name ) nes_trace_scope nes_trace_scope_( name )
+	#define NES_TRACE_THREAD( name ) (void) (nes_trace_thread_name = (name))
+#else
+	#define NES_TRACE_SCOPE( name )  ((void) 0)
+	#define NES_TRACE_THREAD( name ) ((void) 0)
+#endif
+
+#endif
+
@@ -63,8 +63,12 @@ void Nes_Vrc6::output( Blip_Buffer* buf )
 void Nes_Vrc6::run_until( cpu_time_t time )
 {
 	require( time >= last_time );
+	NES_COUNT_RUN( chip_vrc6 );
+	NES_COUNT_OSC( Nes_Apu::osc_count );
 	run_square( oscs [0], time );
+	NES_COUNT_OSC( Nes_Apu::osc_count + 1 );
 	run_square( oscs [1], time );
+	NES_COUNT_OSC( Nes_Apu::osc_count + 2 );
 	run_saw( time );
 	last_time = time;
 }
@@ -5,6 +5,8 @@
 
 #include "Nes_Apu.h"
 
+#include <math.h>
+
 /* Library Copyright (C) 2003-2005 Shay Green. This library is free software;
 you can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -120,6 +122,144 @@ long Nonlinear_Buffer::read_samples( blip_sample_t* out, long count )
 	return count;
 }
 
+// Nes_Nonlinear_Mixer
+
+// Curve tables, indexed by buffer level plus a margin for band-limited overshoot
+// below zero, where the curves are extended with their slope at zero. Sizes must
+// be powers of two.
+enum { pulse_table_size = 4096 };
+enum { pulse_margin = 512 };
+enum { tnd_table_size = 8192 };
+enum { tnd_margin = 1024 };
+
+struct nonlinear_tables_t {
+	BOOST::int32_t pulse [pulse_table_size];
+	BOOST::int32_t tnd [tnd_table_size];
+	
+	nonlinear_tables_t()
+	{
+		// full scale of Nes_Apu::volume()'s linear mix, which the curves' sum also reaches
+		const double gain = (0.1128 * 2 + 0.12765 + 0.0741 + 0.42545) * 0x10000;
+		
+		for ( int i = 0; i < pulse_table_size; i++ )
+		{
+			double n = double (i - pulse_margin) / Nes_Nonlinear_Mixer::pulse_unit;
+			double out = (n > 0 ? 95.88 / (8128 / n + 100) : 95.88 / 8128 * n);
+			pulse [i] = (BOOST::int32_t) floor( out * gain + 0.5 );
+		}
+		
+		for ( int i = 0; i < tnd_table_size; i++ )
+		{
+			// triangle / 8227 + noise / 12241 + dmc / 22638
+			double x = double (i - tnd_margin) / Nes_Nonlinear_Mixer::dmc_unit / 22638;
+			double out = (x > 0 ? 159.79 / (1 / x + 100) : 159.79 * x);
+			tnd [i] = (BOOST::int32_t) floor( out * gain + 0.5 );
+		}
+	}
+};
+
+static nonlinear_tables_t const& nonlinear_tables()
+{
+	static nonlinear_tables_t const tables;
+	return tables;
+}
+
+Nes_Nonlinear_Mixer::Nes_Nonlinear_Mixer()
+{
+	nonlinear_tables(); // build them now rather than on the first mix
+	clear();
+}
+
+void Nes_Nonlinear_Mixer::prepare( Nes_Apu& apu )
+{
+	apu.prepare_nonlinear_mixer( pulse_unit, triangle_unit, noise_unit, dmc_unit );
+}
+
+void Nes_Nonlinear_Mixer::enable( Nes_Apu& apu, bool b )
+{
+	if ( b )
+		prepare( apu );
+	apu.enable_nonlinear_mixer( b );
+}
+
+blargg_err_t Nes_Nonlinear_Mixer::sample_rate( long rate, int msec )
+{
+	BLARGG_RETURN_ERR( pulse.sample_rate( rate, msec ) );
+	BLARGG_RETURN_ERR( tnd.sample_rate( rate, msec ) );
+	clear();
+	return blargg_success;
+}
+
+void Nes_Nonlinear_Mixer::clock_rate( long rate )
+{
+	pulse.clock_rate( rate );
+	tnd.clock_rate( rate );
+}
+
+void Nes_Nonlinear_Mixer::clear()
+{
+	pulse_level = 0;
+	tnd_level = 0;
+	last_out = 0;
+	if ( pulse.length() )
+	{
+		pulse.clear();
+		tnd.clear();
+	}
+}
+
+void Nes_Nonlinear_Mixer::end_frame( blip_time_t length )
+{
+	pulse.end_frame( length );
+	tnd.end_frame( length );
+}
+
+long Nes_Nonlinear_Mixer::mix_samples( Blip_Buffer& out, long count )
+{
+	long avail = pulse.samples_avail();
+	if ( count > avail )
+		count = avail;
+	
+	if ( count )
+	{
+		// Integrating the buffers' deltas gives each group's band-limited level, before
+		// the high-pass filter applied as samples are read. That running sum is the
+		// critical path, so the loop stays scalar; the lookups are off it.
+		const int zero_offset = 0x7f7f; // to do: use private constant from Blip_Buffer.h
+		
+		nonlinear_tables_t const& tables = nonlinear_tables();
+		BOOST::uint16_t const* pulse_in = pulse.buffer_;
+		BOOST::uint16_t const* tnd_in = tnd.buffer_;
+		BOOST::uint16_t* p = out.buffer_;
+		long pulse_level = this->pulse_level;
+		long tnd_level = this->tnd_level;
+		long last_out = this->last_out;
+		
+		for ( long n = count; n--; )
+		{
+			pulse_level += (long) *pulse_in++ - zero_offset;
+			tnd_level += (long) *tnd_in++ - zero_offset;
+			
+			// as in Nes_Nonlinearizer, masked rather than clamped; levels stay well
+			// within the margins, and this keeps any that don't inside the tables
+			long s = tables.pulse [(pulse_level + pulse_margin) & (pulse_table_size - 1)] +
+					tables.tnd [(tnd_level + tnd_margin) & (tnd_table_size - 1)];
+			*p = (BOOST::uint16_t) (*p + (s - last_out));
+			p++;
+			last_out = s;
+		}
+		
+		this->pulse_level = pulse_level;
+		this->tnd_level = tnd_level;
+		this->last_out = last_out;
+		
+		pulse.remove_samples( count );
+		tnd.remove_samples( count );
+	}
+	
+	return count;
+}
+
 // Nes_Nonlinearizer
 
 Nes_Nonlinearizer::Nes_Nonlinearizer()
@@ -33,6 +33,54 @@ private:
 	bool nonlinear;
 };
 
+// Mixes the APU's squares and its triangle, noise and DMC through the hardware's
+// two nonlinear DAC curves, looked up in tables shared by all mixers. Each group
+// is synthesized linearly into a buffer of its own, then its level is run through
+// its curve and added into another buffer, so other sound chips mixed there stay
+// linear.
+class Nes_Nonlinear_Mixer {
+public:
+	Nes_Nonlinear_Mixer();
+
+	// Set up the APU's volumes for pulse_buffer() and tnd_buffer() ahead of time.
+	// Generates impulse tables the first time for an APU, so enable() needn't.
+	void prepare( Nes_Apu& );
+	
+	// Switch the APU to the volumes for pulse_buffer() and tnd_buffer(), or back
+	// to its own. Oscillators still need assigning to the buffers.
+	void enable( Nes_Apu&, bool = true );
+
+	// Buffers for squares, and for triangle, noise and DMC
+	Blip_Buffer* pulse_buffer() { return &pulse; }
+	Blip_Buffer* tnd_buffer() { return &tnd; }
+
+	// See Blip_Buffer.h. Output levels depend on the APU's amplitudes lining up with
+	// what has been added to the buffers, so clear() must be followed by
+	// Nes_Apu::buffer_cleared().
+	blargg_err_t sample_rate( long rate, int msec = blip_default_length );
+	void clock_rate( long );
+	void clear();
+	void end_frame( blip_time_t );
+
+	// Mix at most 'count' samples into 'out', which must have at least as many
+	// available, removing them from both buffers. Return number of samples mixed.
+	long mix_samples( Blip_Buffer& out, long count );
+
+	// Amplitude units in the buffers, chosen so the triangle, noise and DMC weights
+	// of the TND curve are close to whole numbers
+	enum { pulse_unit = 64 };
+	enum { triangle_unit = 88 };
+	enum { noise_unit = 59 };
+	enum { dmc_unit = 32 };
+
+private:
+	Blip_Buffer pulse;
+	Blip_Buffer tnd;
+	long pulse_level;
+	long tnd_level;
+	long last_out;
+};
+
 class Nonlinear_Buffer : public Multi_Buffer {
 public:
 	Nonlinear_Buffer();
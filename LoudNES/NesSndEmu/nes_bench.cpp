@@ -0,0 +1,517 @@
+
+// Microbenchmarks for the emulator core
+
+// usage: nes_bench [-f text|csv|json] [-r rate] [-s seconds] [-n repeats] [filter]
+// Each case runs one part of the core in isolation over the given amount of
+// emulated time and reports the best of several repeats, in ns per emulated
+// CPU clock and ns per output sample. Only the code under test is timed;
+// buffer reads and setup are outside the timed region. filter restricts the
+// run to cases whose name starts with it. Use csv or json output to compare
+// runs before and after a change.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "nes_apu/Nes_Apu.h"
+#include "nes_apu/Nes_Namco.h"
+#include "nes_apu/Nes_Fds.h"
+#include "nes_apu/emu2413.h"
+#include "nes_apu/emu2149.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+const long clock_rate = 1789773;
+const blip_time_t frame_length = 29780;
+
+struct Bench_Config {
+	long sample_rate;
+	double seconds;
+	int repeats;
+};
+
+struct Bench_Result {
+	const char* name;
+	int param;     // period, rate index or channel count, depending on case
+	int volume;
+	long clocks;   // emulated CPU clocks per repeat
+	long samples;  // output samples per repeat
+	double best_ns;
+	double median_ns;
+};
+
+// Runs one repeat of a case and returns nanoseconds spent in timed code
+typedef double (*bench_func_t)( Bench_Config const&, int param, int volume );
+
+static inline double elapsed_ns( bench_clock::time_point start )
+{
+	return std::chrono::duration<double, std::nano>( bench_clock::now() - start ).count();
+}
+
+static long frame_count( Bench_Config const& config )
+{
+	long count = (long) (config.seconds * clock_rate / frame_length);
+	return count > 0 ? count : 1;
+}
+
+static void init_buffer( Blip_Buffer& buf, Bench_Config const& config )
+{
+	buf.clock_rate( clock_rate );
+	if ( buf.sample_rate( config.sample_rate ) )
+	{
+		fprintf( stderr, "Out of memory\n" );
+		exit( EXIT_FAILURE );
+	}
+}
+
+static blip_sample_t sample_buf [16384];
+
+static void drain( Blip_Buffer& buf )
+{
+	while ( buf.samples_avail() )
+		buf.read_samples( sample_buf, sizeof sample_buf / sizeof *sample_buf );
+}
+
+// Blip_Synth
+
+static double bench_synth_offset( Bench_Config const& config, int period, int volume )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Blip_Synth<blip_good_quality,15> synth;
+	synth.volume( 0.1 );
+	synth.output( &buf );
+
+	double ns = 0;
+	int delta = volume;
+	for ( long n = frame_count( config ); n--; )
+	{
+		bench_clock::time_point start = bench_clock::now();
+		for ( blip_time_t t = 0; t < frame_length; t += period )
+		{
+			synth.offset( t, delta, &buf );
+			delta = -delta;
+		}
+		ns += elapsed_ns( start );
+		buf.end_frame( frame_length );
+		drain( buf );
+	}
+	return ns;
+}
+
+static double bench_synth_offset_resampled( Bench_Config const& config, int period, int volume )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Blip_Synth<blip_good_quality,15> synth;
+	synth.volume( 0.1 );
+	synth.output( &buf );
+
+	double ns = 0;
+	int delta = volume;
+	for ( long n = frame_count( config ); n--; )
+	{
+		bench_clock::time_point start = bench_clock::now();
+		blip_resampled_time_t t = buf.resampled_time( 0 );
+		blip_resampled_time_t step = buf.resampled_duration( period );
+		for ( blip_time_t clocks = 0; clocks < frame_length; clocks += period )
+		{
+			synth.offset_resampled( t, delta, &buf );
+			delta = -delta;
+			t += step;
+		}
+		ns += elapsed_ns( start );
+		buf.end_frame( frame_length );
+		drain( buf );
+	}
+	return ns;
+}
+
+// Blip_Buffer
+
+static double bench_read_samples( Bench_Config const& config, int period, int volume )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Blip_Synth<blip_good_quality,15> synth;
+	synth.volume( 0.1 );
+	synth.output( &buf );
+
+	double ns = 0;
+	int delta = volume;
+	for ( long n = frame_count( config ); n--; )
+	{
+		for ( blip_time_t t = 0; t < frame_length; t += period )
+		{
+			synth.offset( t, delta, &buf );
+			delta = -delta;
+		}
+		buf.end_frame( frame_length );
+
+		bench_clock::time_point start = bench_clock::now();
+		drain( buf );
+		ns += elapsed_ns( start );
+	}
+	return ns;
+}
+
+// Nes_Apu oscillators, each run alone through Nes_Apu::end_frame()
+
+static int bench_dmc_reader( void*, cpu_addr_t addr )
+{
+	return (addr * 0x9D) >> 3 & 0xFF; // varied bits so DAC moves
+}
+
+static double run_apu( Bench_Config const& config, int osc, int const* regs )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Nes_Apu apu;
+	apu.dmc_reader( bench_dmc_reader );
+	apu.output( NULL );
+	apu.osc_output( osc, &buf );
+	apu.reset();
+	for ( int i = 0; regs [i] >= 0; i += 2 )
+		apu.write_register( 0, regs [i], regs [i + 1] );
+
+	double ns = 0;
+	for ( long n = frame_count( config ); n--; )
+	{
+		bench_clock::time_point start = bench_clock::now();
+		apu.end_frame( frame_length );
+		ns += elapsed_ns( start );
+		buf.end_frame( frame_length );
+		drain( buf );
+	}
+	return ns;
+}
+
+static double bench_square( Bench_Config const& config, int period, int volume )
+{
+	int const regs [] = {
+		0x4015, 0x01,
+		0x4000, 0xB0 | volume,
+		0x4001, 0x08,
+		0x4002, period & 0xFF,
+		0x4003, period >> 8 | 0xF8,
+		-1
+	};
+	return run_apu( config, 0, regs );
+}
+
+static double bench_triangle( Bench_Config const& config, int period, int volume )
+{
+	// triangle has no volume; zero silences it with the linear counter
+	int const regs [] = {
+		0x4015, 0x04,
+		0x4008, volume ? 0xFF : 0x80,
+		0x400A, period & 0xFF,
+		0x400B, period >> 8 | 0xF8,
+		-1
+	};
+	return run_apu( config, 2, regs );
+}
+
+static double bench_noise( Bench_Config const& config, int period, int volume )
+{
+	int const regs [] = {
+		0x4015, 0x08,
+		0x400C, 0x30 | volume,
+		0x400E, period,
+		0x400F, 0xF8,
+		-1
+	};
+	return run_apu( config, 3, regs );
+}
+
+static double bench_dmc( Bench_Config const& config, int rate, int /*volume*/ )
+{
+	// looped sample
+	int const regs [] = {
+		0x4010, 0x40 | rate,
+		0x4011, 0x40,
+		0x4012, 0x00,
+		0x4013, 0xFF,
+		0x4015, 0x10,
+		-1
+	};
+	return run_apu( config, 4, regs );
+}
+
+// Expansion chips
+
+static double bench_namco( Bench_Config const& config, int channels, int volume )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Nes_Namco namco;
+	namco.output( &buf );
+	namco.reset();
+
+	// 32-sample saw wave at start of RAM
+	namco.write_addr( 0x80 );
+	for ( int i = 0; i < 16; i++ )
+		namco.write_data( 0, (i * 2) | ((i * 2 + 1) << 4) );
+
+	for ( int i = 0; i < channels; i++ )
+	{
+		int freq = 0x1000 + i * 0x321;
+		namco.write_addr( 0x80 | (0x78 - i * 8) );
+		namco.write_data( 0, freq & 0xFF );
+		namco.write_data( 0, 0 );
+		namco.write_data( 0, freq >> 8 & 0xFF );
+		namco.write_data( 0, 0 );
+		namco.write_data( 0, 0xE0 ); // 32 samples
+		namco.write_data( 0, 0 );
+		namco.write_data( 0, 0 );    // wave address
+		namco.write_data( 0, (i == 0 ? (channels - 1) << 4 : 0) | volume );
+	}
+
+	double ns = 0;
+	for ( long n = frame_count( config ); n--; )
+	{
+		bench_clock::time_point start = bench_clock::now();
+		namco.end_frame( frame_length );
+		ns += elapsed_ns( start );
+		buf.end_frame( frame_length );
+		drain( buf );
+	}
+	return ns;
+}
+
+static double bench_fds( Bench_Config const& config, int period, int volume )
+{
+	Blip_Buffer buf;
+	init_buffer( buf, config );
+	Nes_Fds fds;
+	fds.output( &buf );
+	fds.reset();
+
+	// sine-ish wave, with modulation when volume is odd
+	fds.write_register( 0, 0x4089, 0x80 );
+	for ( int i = 0; i < 64; i++ )
+		fds.write_register( 0, 0x4040 + i, i < 32 ? i * 2 : 127 - i * 2 );
+	fds.write_register( 0, 0x4089, 0x00 );
+	fds.write_register( 0, 0x4080, 0x80 | (volume * 2) );
+	fds.write_register( 0, 0x4082, period & 0xFF );
+	fds.write_register( 0, 0x4083, period >> 8 & 0x0F );
+	if ( volume & 1 )
+	{
+		fds.write_register( 0, 0x4087, 0x80 );
+		for ( int i = 0; i < 32; i++ )
+			fds.write_register( 0, 0x4088, i & 7 );
+		fds.write_register( 0, 0x4084, 0x80 | 0x10 );
+		fds.write_register( 0, 0x4086, 0x40 );
+		fds.write_register( 0, 0x4087, 0x00 );
+	}
+
+	double ns = 0;
+	for ( long n = frame_count( config ); n--; )
+	{
+		bench_clock::time_point start = bench_clock::now();
+		fds.end_frame( frame_length );
+		ns += elapsed_ns( start );
+		buf.end_frame( frame_length );
+		drain( buf );
+	}
+	return ns;
+}
+
+static long sample_count( Bench_Config const& config )
+{
+	return (long) ((double) frame_count( config ) * frame_length * config.sample_rate / clock_rate);
+}
+
+static double bench_opll( Bench_Config const& config, int channels, int volume )
+{
+	OPLL* opll = OPLL_new( 3579545, config.sample_rate );
+	OPLL_reset( opll );
+	OPLL_setChipMode( opll, 1 );
+	OPLL_resetPatch( opll, OPLL_VRC7_TONE );
+	for ( int i = 0; i < channels; i++ )
+	{
+		int fnum = 0x100 + i * 0x21;
+		OPLL_writeReg( opll, 0x10 + i, fnum & 0xFF );
+		OPLL_writeReg( opll, 0x30 + i, (1 + i) << 4 | (15 - volume) );
+		OPLL_writeReg( opll, 0x20 + i, 0x10 | 4 << 1 | fnum >> 8 );
+	}
+
+	long count = sample_count( config );
+	int sum = 0;
+	bench_clock::time_point start = bench_clock::now();
+	for ( long n = count; n--; )
+		sum += OPLL_calc( opll );
+	double ns = elapsed_ns( start );
+
+	OPLL_delete( opll );
+	sample_buf [0] = (blip_sample_t) sum; // keep calls from being optimized away
+	return ns;
+}
+
+static double bench_psg( Bench_Config const& config, int period, int volume )
+{
+	PSG* psg = PSG_new( clock_rate, config.sample_rate );
+	PSG_reset( psg );
+	PSG_set_quality( psg, 1 );
+	PSG_writeReg( psg, 0, period & 0xFF );
+	PSG_writeReg( psg, 1, period >> 8 & 0x0F );
+	PSG_writeReg( psg, 7, 0x3E ); // tone A only
+	PSG_writeReg( psg, 8, volume );
+
+	long count = sample_count( config );
+	int sum = 0;
+	bench_clock::time_point start = bench_clock::now();
+	for ( long n = count; n--; )
+		sum += PSG_calc( psg );
+	double ns = elapsed_ns( start );
+
+	PSG_delete( psg );
+	sample_buf [0] = (blip_sample_t) sum;
+	return ns;
+}
+
+struct Bench_Case {
+	const char* name;
+	bench_func_t func;
+	int const* params; // terminated by -1
+	int const* volumes;
+};
+
+static int const transition_periods [] = { 2, 8, 32, 128, 1024, -1 };
+static int const square_periods [] = { 8, 0x40, 0x100, 0x400, 0x7FF, -1 };
+static int const triangle_periods [] = { 3, 0x40, 0x100, 0x400, 0x7FF, -1 };
+static int const noise_periods [] = { 0, 4, 8, 12, 15, -1 };
+static int const dmc_rates [] = { 0, 8, 15, -1 };
+static int const namco_channels [] = { 1, 4, 8, -1 };
+static int const fds_periods [] = { 0x040, 0x200, 0x800, 0xFFF, -1 };
+static int const opll_channels [] = { 1, 3, 6, -1 };
+static int const psg_periods [] = { 0x010, 0x100, 0xFFF, -1 };
+static int const on_off [] = { 0, 15, -1 };
+static int const loud [] = { 15, -1 };
+static int const fds_volumes [] = { 0, 32, 31, -1 }; // odd enables modulation
+
+static Bench_Case const cases [] = {
+	{ "blip_synth_offset",           bench_synth_offset,           transition_periods, loud },
+	{ "blip_synth_offset_resampled", bench_synth_offset_resampled, transition_periods, loud },
+	{ "blip_buffer_read_samples",    bench_read_samples,           transition_periods, loud },
+	{ "nes_square_run",              bench_square,                 square_periods,     on_off },
+	{ "nes_triangle_run",            bench_triangle,               triangle_periods,   on_off },
+	{ "nes_noise_run",               bench_noise,                  noise_periods,      on_off },
+	{ "nes_dmc_run",                 bench_dmc,                    dmc_rates,          loud },
+	{ "nes_namco_run_until",         bench_namco,                  namco_channels,     on_off },
+	{ "nes_fds_run_fds",             bench_fds,                    fds_periods,        fds_volumes },
+	{ "opll_calc",                   bench_opll,                   opll_channels,      on_off },
+	{ "psg_calc",                    bench_psg,                    psg_periods,        on_off },
+};
+
+static Bench_Result run_case( Bench_Config const& config, Bench_Case const& c, int param, int volume )
+{
+	std::vector<double> times;
+	c.func( config, param, volume ); // warm up caches and tables
+	for ( int i = 0; i < config.repeats; i++ )
+		times.push_back( c.func( config, param, volume ) );
+	std::sort( times.begin(), times.end() );
+
+	Bench_Result r;
+	r.name = c.name;
+	r.param = param;
+	r.volume = volume;
+	r.clocks = frame_count( config ) * frame_length;
+	r.samples = sample_count( config );
+	r.best_ns = times [0];
+	r.median_ns = times [times.size() / 2];
+	return r;
+}
+
+enum { format_text, format_csv, format_json };
+
+static void print_header( int format, Bench_Config const& config )
+{
+	if ( format == format_csv )
+		printf( "name,param,volume,clocks,samples,ns_per_clock,ns_per_sample,median_ns_per_sample\n" );
+	else if ( format == format_json )
+		printf( "{\"sample_rate\":%ld,\"seconds\":%g,\"repeats\":%d,\"results\":[\n",
+				config.sample_rate, config.seconds, config.repeats );
+	else
+		printf( "%-28s %6s %6s %12s %12s %12s\n", "name", "param", "volume",
+				"ns/clock", "ns/sample", "median" );
+}
+
+static void print_result( int format, Bench_Result const& r, bool first )
+{
+	double per_clock = r.best_ns / r.clocks;
+	double per_sample = r.best_ns / r.samples;
+	double median_per_sample = r.median_ns / r.samples;
+	if ( format == format_csv )
+		printf( "%s,%d,%d,%ld,%ld,%.4f,%.3f,%.3f\n", r.name, r.param, r.volume,
+				r.clocks, r.samples, per_clock, per_sample, median_per_sample );
+	else if ( format == format_json )
+		printf( "%s{\"name\":\"%s\",\"param\":%d,\"volume\":%d,\"clocks\":%ld,\"samples\":%ld,"
+				"\"ns_per_clock\":%.4f,\"ns_per_sample\":%.3f,\"median_ns_per_sample\":%.3f}",
+				first ? "" : ",\n", r.name, r.param, r.volume, r.clocks, r.samples,
+				per_clock, per_sample, median_per_sample );
+	else
+		printf( "%-28s %6d %6d %12.4f %12.3f %12.3f\n", r.name, r.param, r.volume,
+				per_clock, per_sample, median_per_sample );
+	fflush( stdout );
+}
+
+int main( int argc, char** argv )
+{
+	Bench_Config config;
+	config.sample_rate = 44100;
+	config.seconds = 2.0;
+	config.repeats = 5;
+	int format = format_text;
+	const char* filter = "";
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv [i], "-f" ) && i + 1 < argc )
+		{
+			const char* f = argv [++i];
+			format = !strcmp( f, "csv" ) ? format_csv : !strcmp( f, "json" ) ? format_json : format_text;
+		}
+		else if ( !strcmp( argv [i], "-r" ) && i + 1 < argc )
+			config.sample_rate = atol( argv [++i] );
+		else if ( !strcmp( argv [i], "-s" ) && i + 1 < argc )
+			config.seconds = atof( argv [++i] );
+		else if ( !strcmp( argv [i], "-n" ) && i + 1 < argc )
+			config.repeats = atoi( argv [++i] );
+		else if ( argv [i] [0] != '-' )
+			filter = argv [i];
+		else
+		{
+			fprintf( stderr, "usage: %s [-f text|csv|json] [-r rate] [-s seconds] [-n repeats] [filter]\n", argv [0] );
+			return EXIT_FAILURE;
+		}
+	}
+	if ( config.repeats < 1 )
+		config.repeats = 1;
+
+	print_header( format, config );
+	bool first = true;
+	for ( size_t i = 0; i < sizeof cases / sizeof *cases; i++ )
+	{
+		Bench_Case const& c = cases [i];
+		if ( strncmp( c.name, filter, strlen( filter ) ) )
+			continue;
+
+		for ( int const* p = c.params; *p >= 0; p++ )
+		{
+			for ( int const* v = c.volumes; *v >= 0; v++ )
+			{
+				print_result( format, run_case( config, c, *p, *v ), first );
+				first = false;
+			}
+		}
+	}
+	if ( format == format_json )
+		printf( "\n]}\n" );
+
+	return EXIT_SUCCESS;
+}
+
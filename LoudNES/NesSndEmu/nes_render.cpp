@@ -0,0 +1,377 @@
+
+// Offline renderer: plays VGM and NSF files through Simple_Apu and writes WAVE files
+
+// usage: nes_render [-r rate] [-l loops] [-t seconds] [-n track] [-c] [-g dir [-e tolerance] [-u]] file [file2 ...]
+// Each file.vgm is rendered to file.wav next to it. Each track of file.nsf is
+// rendered to file-NN.wav for the given number of seconds, or only track
+// number -n (1-based) if given.
+
+// With -g, nothing is written next to the inputs. Instead each file or track is
+// rendered once per part (full mix, each chip, each channel alone), once more
+// through the nonlinear mixer, and checked against golden references in dir;
+// see Golden_Checker.h. -e allows a per-sample difference for lossy changes,
+// and -u rewrites the references. Exits with failure if any part doesn't match.
+
+// -c prints emulator event counts for each file (register writes, synthesized
+// transitions, chip catch-up runs). Build with -DNES_EVENT_COUNTERS=1 for these.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "Vgm_File.h"
+#include "Nsf_Player.h"
+#include "Wave_Writer.h"
+#include "Golden_Checker.h"
+
+// Path with extension replaced by suffix
+static std::string out_path_for( const char* in_path, const char* suffix )
+{
+	std::string out_path = in_path;
+	std::string::size_type dot = out_path.rfind( '.' );
+	if ( dot != std::string::npos && out_path.find( '/', dot ) == std::string::npos )
+		out_path.erase( dot );
+	return out_path + suffix;
+}
+
+static bool has_extension( const char* path, const char* ext )
+{
+	size_t len = strlen( path );
+	size_t ext_len = strlen( ext );
+	if ( len < ext_len )
+		return false;
+	for ( size_t i = 0; i < ext_len; i++ )
+		if ( tolower( path [len - ext_len + i] ) != ext [i] )
+			return false;
+	return true;
+}
+
+const long buf_size = 4096;
+static Simple_Apu::sample_t buf [buf_size];
+
+typedef std::vector<Simple_Apu::sample_t> sample_vector;
+
+// Channel mask for golden parts, by Simple_Apu::enable_channel() index
+const unsigned long all_channels = ~0UL;
+
+static void mute_channels( Simple_Apu& apu, unsigned long mask )
+{
+	for ( int i = 0; i < apu.channel_count(); i++ )
+		if ( !(mask >> i & 1) )
+			apu.enable_channel( i, false );
+}
+
+// Rendered audio goes to a WAVE file, or to memory for golden checks
+struct Render_Out {
+	Wave_Writer* wave;
+	sample_vector* mem;
+
+	void write( Simple_Apu::sample_t const* in, long count )
+	{
+		if ( wave )
+			wave->write( in, count );
+		else
+			mem->insert( mem->end(), in, in + count );
+	}
+};
+
+static const char* play_vgm( Simple_Apu& apu, Vgm_Player& player, const char* in_path,
+		long sample_rate, int loops, unsigned long mask, Render_Out out )
+{
+	const char* err = player.load( in_path );
+	if ( err )
+		return err;
+
+	player.set_loop_count( loops );
+	err = player.start( &apu, sample_rate );
+	if ( err )
+		return err;
+	mute_channels( apu, mask );
+
+	while ( !player.track_ended() )
+	{
+		long count = player.play( buf, buf_size );
+		out.write( buf, count );
+	}
+
+	player.unload();
+	return NULL;
+}
+
+// File must already be loaded
+static const char* play_nsf_track( Simple_Apu& apu, Nsf_Player& player, int track,
+		long sample_rate, double seconds, unsigned long mask, Render_Out out )
+{
+	const char* err = player.start_track( &apu, track, sample_rate );
+	if ( err )
+		return err;
+	mute_channels( apu, mask );
+
+	long remain = (long) (seconds * sample_rate);
+	while ( remain > 0 )
+	{
+		long count = player.play( buf, remain < buf_size ? remain : buf_size );
+		out.write( buf, count );
+		remain -= count;
+	}
+	return NULL;
+}
+
+// Renders the full mix, the nonlinear mix, each chip and then each channel alone with
+// render( mask, out ), and checks each against golden reference name.part
+template<class Render>
+static const char* check_parts( Simple_Apu& apu, Golden_Checker& golden, std::string const& name,
+		long sample_rate, Render render )
+{
+	static const char* const apu_names [Nes_Apu::osc_count] = { "sq1", "sq2", "tri", "noise", "dmc" };
+	const unsigned long apu_mask = (1 << Nes_Apu::osc_count) - 1;
+
+	sample_vector samples;
+	Render_Out out = { NULL, &samples };
+	const char* err = render( all_channels, out );
+	if ( err )
+		return err;
+	golden.check( (name + ".mix").c_str(), samples.data(), (long) samples.size(), sample_rate );
+
+	err = apu.nonlinear_mixing( true );
+	if ( !err )
+	{
+		samples.clear();
+		err = render( all_channels, out );
+		apu.nonlinear_mixing( false );
+	}
+	if ( err )
+		return err;
+	golden.check( (name + ".nonlinear").c_str(), samples.data(), (long) samples.size(), sample_rate );
+
+	int channel_count = apu.channel_count();
+	for ( int part = -2; part < channel_count && !err; part++ )
+	{
+		std::string part_name = name;
+		unsigned long mask;
+		if ( part == -2 )
+		{
+			if ( channel_count == Nes_Apu::osc_count )
+				continue; // same as the mix
+			part_name += ".2a03";
+			mask = apu_mask;
+		}
+		else if ( part == -1 )
+		{
+			if ( channel_count == Nes_Apu::osc_count )
+				continue;
+			part_name += ".expansion";
+			mask = all_channels & ~apu_mask;
+		}
+		else
+		{
+			char suffix [16];
+			if ( part < Nes_Apu::osc_count )
+				sprintf( suffix, ".%s", apu_names [part] );
+			else
+				sprintf( suffix, ".exp%d", part - Nes_Apu::osc_count + 1 );
+			part_name += suffix;
+			mask = 1UL << part;
+		}
+
+		samples.clear();
+		err = render( mask, out );
+		if ( !err )
+			golden.check( part_name.c_str(), samples.data(), (long) samples.size(), sample_rate );
+	}
+	return err;
+}
+
+// Reference name for an input file, without directory or extension
+static std::string golden_name( const char* in_path, const char* suffix )
+{
+	std::string name = out_path_for( in_path, suffix );
+	std::string::size_type slash = name.find_last_of( "/\\" );
+	return slash == std::string::npos ? name : name.substr( slash + 1 );
+}
+
+static const char* render_vgm( Simple_Apu& apu, Vgm_Player& player,
+		const char* in_path, long sample_rate, int loops, Golden_Checker* golden )
+{
+	if ( golden )
+	{
+		return check_parts( apu, *golden, golden_name( in_path, "" ), sample_rate,
+				[&]( unsigned long mask, Render_Out out ) {
+					return play_vgm( apu, player, in_path, sample_rate, loops, mask, out );
+				} );
+	}
+
+	std::string out_path = out_path_for( in_path, ".wav" );
+
+	Wave_Writer wave;
+	const char* err = wave.open( out_path.c_str(), sample_rate );
+	if ( err )
+		return err;
+
+	Render_Out out = { &wave, NULL };
+	err = play_vgm( apu, player, in_path, sample_rate, loops, all_channels, out );
+	if ( err )
+		return err;
+
+	printf( "%s: %.1f sec\n", out_path.c_str(), (double) wave.sample_count() / sample_rate );
+	return NULL;
+}
+
+static const char* render_nsf( Simple_Apu& apu, Nsf_Player& player,
+		const char* in_path, long sample_rate, double seconds, int only_track, Golden_Checker* golden )
+{
+	const char* err = player.load( in_path );
+	if ( err )
+		return err;
+
+	int first = 0;
+	int last = player.track_count() - 1;
+	if ( only_track )
+	{
+		if ( only_track > player.track_count() )
+			return "No such track";
+		first = last = only_track - 1;
+	}
+
+	for ( int track = first; track <= last && !err; track++ )
+	{
+		char suffix [16];
+		sprintf( suffix, "-%02d", track + 1 );
+
+		if ( golden )
+		{
+			err = check_parts( apu, *golden, golden_name( in_path, suffix ), sample_rate,
+					[&]( unsigned long mask, Render_Out out ) {
+						return play_nsf_track( apu, player, track, sample_rate, seconds, mask, out );
+					} );
+			continue;
+		}
+
+		std::string out_path = out_path_for( in_path, (std::string( suffix ) + ".wav").c_str() );
+
+		Wave_Writer wave;
+		err = wave.open( out_path.c_str(), sample_rate );
+		if ( err )
+			break;
+
+		Render_Out out = { &wave, NULL };
+		err = play_nsf_track( apu, player, track, sample_rate, seconds, all_channels, out );
+		if ( err )
+			break;
+
+		printf( "%s: %.1f sec\n", out_path.c_str(), (double) wave.sample_count() / sample_rate );
+	}
+
+	if ( !err && player.unofficial_count() )
+		printf( "%s: driver used unofficial instructions; output may be wrong\n", in_path );
+
+	player.unload();
+	return err;
+}
+
+int main( int argc, char** argv )
+{
+	long sample_rate = 44100;
+	int loops = 0;
+	double seconds = 150;
+	int only_track = 0;
+	const char* golden_dir = NULL;
+	int tolerance = 0;
+	bool update = false;
+	bool counters = false;
+	int failed = 0;
+	int files = 0;
+
+	// apu and player are reused for every file, so batches don't reallocate
+	static Simple_Apu apu;
+	static Vgm_Player player;
+	static Nsf_Player nsf_player;
+	Golden_Checker* golden = NULL;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv [i], "-r" ) && i + 1 < argc )
+		{
+			sample_rate = atol( argv [++i] );
+			continue;
+		}
+		if ( !strcmp( argv [i], "-l" ) && i + 1 < argc )
+		{
+			loops = atoi( argv [++i] );
+			continue;
+		}
+		if ( !strcmp( argv [i], "-t" ) && i + 1 < argc )
+		{
+			seconds = atof( argv [++i] );
+			continue;
+		}
+		if ( !strcmp( argv [i], "-n" ) && i + 1 < argc )
+		{
+			only_track = atoi( argv [++i] );
+			continue;
+		}
+		if ( !strcmp( argv [i], "-g" ) && i + 1 < argc )
+		{
+			golden_dir = argv [++i];
+			continue;
+		}
+		if ( !strcmp( argv [i], "-e" ) && i + 1 < argc )
+		{
+			tolerance = atoi( argv [++i] );
+			continue;
+		}
+		if ( !strcmp( argv [i], "-u" ) )
+		{
+			update = true;
+			continue;
+		}
+		if ( !strcmp( argv [i], "-c" ) )
+		{
+			if ( !Simple_Apu::event_counters )
+				fprintf( stderr, "-c: built without NES_EVENT_COUNTERS\n" );
+			counters = true;
+			continue;
+		}
+
+		if ( golden_dir && !golden )
+			golden = new Golden_Checker( golden_dir, tolerance, update );
+
+		files++;
+		apu.clear_counters();
+		const char* err;
+		if ( has_extension( argv [i], ".nsf" ) )
+			err = render_nsf( apu, nsf_player, argv [i], sample_rate, seconds, only_track, golden );
+		else
+			err = render_vgm( apu, player, argv [i], sample_rate, loops, golden );
+		if ( err )
+		{
+			fprintf( stderr, "%s: %s\n", argv [i], err );
+			failed++;
+		}
+		else if ( counters && Simple_Apu::event_counters )
+		{
+			printf( "%s: ", argv [i] );
+			apu.total_counters().print( stdout );
+		}
+	}
+
+	if ( !files )
+	{
+		fprintf( stderr, "usage: %s [-r rate] [-l loops] [-t seconds] [-n track] "
+				"[-c] [-g dir [-e tolerance] [-u]] file.vgm|file.nsf ...\n", argv [0] );
+		return EXIT_FAILURE;
+	}
+
+	if ( golden )
+	{
+		printf( "%d failed, %d written\n", golden->failed(), golden->written() );
+		failed += golden->failed();
+		delete golden;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
@@ -0,0 +1,155 @@
+//
+//  NesVoiceAllocator.h
+//  LoudNES
+//
+//  Assigns notes to a fixed number of voices in constant time, without allocating.
+//  Free voices queue up in the order they were freed, so release tails ring as long
+//  as they can. Sounding voices are listed oldest first, and by default the oldest
+//  is stolen when none is free.
+//
+
+#pragma once
+
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class NesVoiceAllocator
+{
+public:
+  static constexpr int kMaxVoices = 16;
+
+  enum EPolicy {
+    kOldestSteal = 0,  // longest-free voice, or else the oldest note's
+    kRoundRobin,       // each voice in turn, whether or not it's sounding
+    kLowestNote,       // longest-free voice; when all sound, the lowest notes win
+  };
+
+  NesVoiceAllocator() {
+    Reset(1);
+  }
+
+  // Frees every voice
+  void Reset(int numVoices, EPolicy policy = kOldestSteal) {
+    mNumVoices = clamp(numVoices, 1, kMaxVoices);
+    mPolicy = policy;
+    mFreeHead = 0;
+    mNumFree = mNumVoices;
+    mNextVoice = 0;
+    for (int v = 0; v < mNumVoices; v++) {
+      mFree[v] = v;
+      mKeys[v] = -1;
+    }
+    mOldest = mNewest = -1;
+    for (auto& voice : mVoiceForKey) voice = -1;
+    mSoundingKeys[0] = mSoundingKeys[1] = 0;
+  }
+
+  // Voice for a new note. A key that is already sounding keeps its voice. Otherwise
+  // the policy picks one, and if it was sounding, stolenKey is set to the key it was
+  // playing; stolenKey is -1 otherwise. Returns -1 if the note isn't to be played,
+  // which only happens with kLowestNote.
+  int NoteOn(int key, int& stolenKey) {
+    key &= 0x7f;
+    stolenKey = -1;
+    int voice = mVoiceForKey[key];
+    if (voice >= 0) {
+      Unlink(voice);
+    } else if (mPolicy == kRoundRobin) {
+      voice = mNextVoice;
+      mNextVoice = (mNextVoice + 1) % mNumVoices;
+      if (mKeys[voice] >= 0) Steal(voice, stolenKey);
+    } else if (mNumFree) {
+      voice = mFree[mFreeHead];
+      mFreeHead = (mFreeHead + 1) % kMaxVoices;
+      mNumFree--;
+    } else if (mPolicy == kLowestNote) {
+      const int highest = HighestSoundingKey();
+      if (key > highest) return -1;
+      voice = mVoiceForKey[highest];
+      Steal(voice, stolenKey);
+    } else {
+      voice = mOldest;
+      Steal(voice, stolenKey);
+    }
+    mKeys[voice] = key;
+    mVoiceForKey[key] = voice;
+    mSoundingKeys[key >> 6] |= 1ull << (key & 63);
+    Append(voice);
+    return voice;
+  }
+
+  // Voice that was playing key, now free, or -1 if key wasn't sounding
+  int NoteOff(int key) {
+    key &= 0x7f;
+    const int voice = mVoiceForKey[key];
+    if (voice < 0) return -1;
+    mVoiceForKey[key] = -1;
+    mKeys[voice] = -1;
+    mSoundingKeys[key >> 6] &= ~(1ull << (key & 63));
+    Unlink(voice);
+    // round robin takes voices in turn, so doesn't queue free ones
+    if (mPolicy != kRoundRobin) {
+      mFree[(mFreeHead + mNumFree) % kMaxVoices] = voice;
+      mNumFree++;
+    }
+    return voice;
+  }
+
+  bool IsSounding(int key) const { return mVoiceForKey[key & 0x7f] >= 0; }
+
+  // Key a voice is playing, or -1 if it's free
+  int GetKey(int voice) const { return mKeys[voice]; }
+
+  int NumVoices() const { return mNumVoices; }
+
+private:
+  void Steal(int voice, int& stolenKey) {
+    stolenKey = mKeys[voice];
+    mVoiceForKey[stolenKey] = -1;
+    mSoundingKeys[stolenKey >> 6] &= ~(1ull << (stolenKey & 63));
+    Unlink(voice);
+  }
+
+  int HighestSoundingKey() const {
+    const int word = mSoundingKeys[1] ? 1 : 0;
+    const uint64_t bits = mSoundingKeys[word];
+#if defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanReverse64(&bit, bits);
+    return word * 64 + (int) bit;
+#else
+    return word * 64 + 63 - __builtin_clzll(bits);
+#endif
+  }
+
+  void Unlink(int voice) {
+    if (mPrev[voice] >= 0) mNext[mPrev[voice]] = mNext[voice];
+    else mOldest = mNext[voice];
+    if (mNext[voice] >= 0) mPrev[mNext[voice]] = mPrev[voice];
+    else mNewest = mPrev[voice];
+  }
+
+  void Append(int voice) {
+    mPrev[voice] = mNewest;
+    mNext[voice] = -1;
+    if (mNewest >= 0) mNext[mNewest] = voice;
+    else mOldest = voice;
+    mNewest = voice;
+  }
+
+  int mNumVoices;
+  EPolicy mPolicy;
+  int mFree[kMaxVoices];  // ring of free voices, longest-free first
+  int mFreeHead;
+  int mNumFree;
+  int mNextVoice;         // for kRoundRobin
+  int mPrev[kMaxVoices];  // sounding voices, oldest to newest
+  int mNext[kMaxVoices];
+  int mOldest;
+  int mNewest;
+  int mKeys[kMaxVoices];
+  int8_t mVoiceForKey[128];
+  uint64_t mSoundingKeys[2];  // bit per key, for kLowestNote
+};
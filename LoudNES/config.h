@@ -13,7 +13,7 @@
 #define BUNDLE_MFR "MattMontag"
 #define BUNDLE_DOMAIN "com"
 
-#define PLUG_CHANNEL_IO "0-2"
+#define PLUG_CHANNEL_IO "0-2 0-2.2.2.2.2.2.2.2.2" // main mix, then optionally a pair per NES channel
 #define SHARED_RESOURCES_SUBPATH "LoudNES"
 
 #define PLUG_LATENCY 0
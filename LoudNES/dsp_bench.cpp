@@ -0,0 +1,652 @@
+//
+//  dsp_bench.cpp
+//  LoudNES
+//
+//  Headless benchmark for LoudNESDSP::ProcessBlock. Plays a scripted arrangement
+//  (chords, arpeggios, DPCM and noise drums, pitch bends) through LoudNESDSP<float>
+//  and LoudNESDSP<double> at a range of block sizes and sample rates, and reports
+//  mean, p99 and max time per block against the block's real-time budget.
+//
+//  usage: dsp_bench [-f text|csv|json] [-o file] [-s seconds] [-t float|double] [-r rate] [-b block] [-k ticks] [-p voices] [-j workers] [-n] [-c] [-T trace]
+//         dsp_bench -g dir [-e tolerance] [-u] [-o file] [-s seconds] [-t float|double]
+//
+//  The DSP classes log to stdout, so use -o to get clean csv or json. -c adds the
+//  DSP's own CPU accounting (see LoudNES_CpuStats.h) to text output, and emulator
+//  event counts when built with -DNES_EVENT_COUNTERS=1. -T writes a timeline of the
+//  run as Chrome trace JSON, when built with -DNES_TRACE=1; use -r and -b to keep it
+//  within the trace buffers. -k sets the engine tick rate: 50, 60 (default), 120 or
+//  240 Hz, or 1/16, 1/16T, 1/32 or 1/32T synced to the scenario's 120 bpm. -p plays
+//  the arrangement in poly mode, with up to the given number of voices per channel.
+//  -j sets the number of render worker threads; 0 renders on the calling thread only.
+//  -n mixes the 2A03 through the nonlinear mixer.
+//
+//  -g is a regression check instead of a benchmark: the arrangement is rendered
+//  once per part (full mix, each chip, each channel alone), with default and with
+//  restored instrument state, plus poly, paraphonic, MPE and nonlinear mixes and
+//  sparse noise hits, and compared against references in dir. See
+//  NesSndEmu/Golden_Checker.h for -e and -u. Exits with failure on any mismatch.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "NesSndEmu/Golden_Checker.h"
+#include "LoudNES_DSP.h"
+
+using BenchClock = std::chrono::steady_clock;
+
+static const int kBlockSizes[] = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
+static const int kSampleRates[] = {44100, 48000, 88200, 96000, 176400, 192000};
+
+// MIDI channels map to NES channels unless omni mode is on
+enum EBenchChannel {
+  kChPulse1 = 0,
+  kChPulse2,
+  kChTriangle,
+  kChNoise,
+  kChDpcm,
+  kChVrc6Pulse1,
+  kChVrc6Pulse2,
+  kChVrc6Saw
+};
+
+// Four bar loop at 120 bpm on a grid of 64 ticks per beat
+class BenchScenario
+{
+public:
+  static constexpr double kTempo = 120.;
+
+  BenchScenario(double sampleRate)
+  : mSamplesPerTick(sampleRate * 0.5 / 64.)
+  {}
+
+  // Host beat position at a sample position, as for ProcessBlock's qnPos
+  double BeatAt(long pos) const { return pos / (mSamplesPerTick * 64.); }
+
+  // Sends messages falling in [blockStart, blockStart + nFrames) with block offsets
+  template<typename Send>
+  void Emit(long blockStart, int nFrames, Send&& send)
+  {
+    while (true) {
+      long pos = std::lround(mNextTick * mSamplesPerTick);
+      if (pos >= blockStart + nFrames) break;
+      EmitTick(mNextTick, (int) (pos - blockStart), send);
+      mNextTick++;
+    }
+  }
+
+private:
+  template<typename Send>
+  void EmitTick(long tick, int offset, Send& send)
+  {
+    static const int kChords[4][3] = {{48, 52, 55}, {45, 48, 52}, {41, 45, 48}, {43, 47, 50}};
+    static const int kChordChannels[3] = {kChPulse1, kChPulse2, kChVrc6Pulse1};
+    IMidiMsg msg;
+
+    // chord and bass every two beats
+    if (tick % 128 == 0) {
+      const int* prev = kChords[(tick / 128 + 3) % 4];
+      const int* chord = kChords[(tick / 128) % 4];
+      for (int i = 0; i < 3; i++) {
+        msg.MakeNoteOffMsg(prev[i] + 12, offset, kChordChannels[i]); send(msg);
+        msg.MakeNoteOnMsg(chord[i] + 12, 100, offset, kChordChannels[i]); send(msg);
+      }
+      msg.MakeNoteOffMsg(prev[0] - 12, offset, kChTriangle); send(msg);
+      msg.MakeNoteOnMsg(chord[0] - 12, 127, offset, kChTriangle); send(msg);
+      msg.MakeNoteOffMsg(prev[2], offset, kChVrc6Pulse2); send(msg);
+      msg.MakeNoteOnMsg(chord[2], 80, offset, kChVrc6Pulse2); send(msg);
+    }
+
+    // sixteenth note arpeggio on the saw
+    if (tick % 16 == 0) {
+      const int* chord = kChords[(tick / 128) % 4];
+      int step = (int) (tick / 16);
+      msg.MakeNoteOffMsg(chord[(step + 2) % 3] + 24, offset, kChVrc6Saw); send(msg);
+      msg.MakeNoteOnMsg(chord[step % 3] + 24, 90 + (step % 4) * 10, offset, kChVrc6Saw); send(msg);
+    }
+
+    // DPCM kick and snare on beats, noise hats on eighths
+    if (tick % 64 == 0) {
+      int note = (tick / 64) % 2 ? 38 : 36;
+      msg.MakeNoteOnMsg(note, 127, offset, kChDpcm); send(msg);
+    }
+    if (tick % 64 == 32) {
+      msg.MakeNoteOffMsg((tick / 64) % 2 ? 38 : 36, offset, kChDpcm); send(msg);
+    }
+    if (tick % 32 == 0) {
+      msg.MakeNoteOnMsg(60 + (int) (tick / 32) % 3, 70, offset, kChNoise); send(msg);
+    }
+    if (tick % 32 == 8) {
+      msg.MakeNoteOffMsg(60 + (int) (tick / 32) % 3, offset, kChNoise); send(msg);
+    }
+
+    // slow vibrato-like bends on the pulses, at a typical controller rate
+    if (tick % 2 == 0) {
+      double bend = 0.25 * std::sin(tick * (2. * M_PI / 256.));
+      msg.MakePitchWheelMsg(bend, kChPulse1, offset); send(msg);
+      msg.MakePitchWheelMsg(-bend, kChPulse2, offset); send(msg);
+    }
+  }
+
+  double mSamplesPerTick;
+  long mNextTick = 0;
+};
+
+// Passes the arrangement on as an MPE controller would play it: each note on a member
+// channel of its own, pressed as hard as it was struck, with the pulses' bends going to
+// their own notes, and pressing them harder as they bend
+template<typename Send>
+class BenchMpeSender
+{
+public:
+  explicit BenchMpeSender(Send& send)
+  : mSend(send)
+  {
+    for (auto& members : mMembers) for (int& member : members) member = -1;
+    for (int& source : mSources) source = -1;
+  }
+
+  void operator()(const IMidiMsg& msg)
+  {
+    const int ch = msg.Channel();
+    const int key = msg.NoteNumber();
+    IMidiMsg out;
+    switch (msg.StatusMsg()) {
+      case IMidiMsg::kNoteOn:
+        if (msg.Velocity()) {
+          const int member = mNextMember;
+          mNextMember = mNextMember % 15 + 1;
+          mMembers[ch][key] = member;
+          mSources[member] = ch;
+          out.MakePitchWheelMsg(mBends[ch], member, msg.mOffset); mSend(out);
+          out.MakeNoteOnMsg(key, msg.Velocity(), msg.mOffset, member); mSend(out);
+          out.MakeChannelATMsg(msg.Velocity(), msg.mOffset, member); mSend(out);
+          break;
+        }
+        // note on with zero velocity is note off
+        // fall through
+      case IMidiMsg::kNoteOff: {
+        const int member = mMembers[ch][key];
+        if (member < 0) break;
+        mMembers[ch][key] = -1;
+        mSources[member] = -1;
+        out.MakeNoteOffMsg(key, msg.mOffset, member); mSend(out);
+        break;
+      }
+      case IMidiMsg::kPitchWheel:
+        // the arrangement's bends are on the plugin's 2 semitone range
+        mBends[ch] = msg.PitchWheel() * 2. / NesMpeQueue::kBendSemitones;
+        for (int member = 1; member < NesMpeQueue::kNumMidiChannels; member++) {
+          if (mSources[member] != ch) continue;
+          out.MakePitchWheelMsg(mBends[ch], member, msg.mOffset); mSend(out);
+          out.MakeChannelATMsg(64 + (int) (std::fabs(msg.PitchWheel()) * 200.), msg.mOffset, member); mSend(out);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+private:
+  Send& mSend;
+  int mMembers[16][128];  // member channel each arrangement note is on
+  int mSources[NesMpeQueue::kNumMidiChannels];  // arrangement channel of each member's note
+  double mBends[16] = {};
+  int mNextMember = 1;
+};
+
+struct BenchResult
+{
+  const char* type;
+  int sampleRate;
+  int blockSize;
+  long blocks;
+  double meanUs;
+  double p99Us;
+  double maxUs;
+  double budgetUs;
+  LoudNESCpuStats cpu;
+  nes_counters_t counters;
+};
+
+template<typename T>
+static BenchResult RunConfig(LoudNESDSP<T>& dsp, const char* type, int sampleRate, int blockSize, double seconds)
+{
+  dsp.Reset(sampleRate, blockSize);
+
+  std::vector<T> left(blockSize), right(blockSize);
+  T* outputs[2] = {left.data(), right.data()};
+  BenchScenario scenario(sampleRate);
+  auto send = [&dsp](const IMidiMsg& msg) { dsp.ProcessMidiMsg(msg); };
+
+  // half a second of warm-up so caches, tables and voices settle
+  long warmupBlocks = max(1L, (long) (0.5 * sampleRate / blockSize));
+  long blocks = max(1L, (long) (seconds * sampleRate / blockSize));
+  std::vector<double> times;
+  times.reserve(blocks);
+
+  LoudNESCpuStats cpuStart;
+  long pos = 0;
+  for (long b = 0; b < warmupBlocks + blocks; b++) {
+    if (b == warmupBlocks) {
+      dsp.GetCpuStats(cpuStart);
+      dsp.mNesApu->clear_counters();
+    }
+    scenario.Emit(pos, blockSize, send);
+    auto start = BenchClock::now();
+    dsp.ProcessBlock(nullptr, outputs, 2, blockSize, scenario.BeatAt(pos), true, BenchScenario::kTempo);
+    double ns = std::chrono::duration<double, std::nano>(BenchClock::now() - start).count();
+    if (b >= warmupBlocks) times.push_back(ns);
+    pos += blockSize;
+  }
+
+  double sum = 0;
+  for (double t : times) sum += t;
+  std::sort(times.begin(), times.end());
+
+  BenchResult r;
+  r.type = type;
+  r.sampleRate = sampleRate;
+  r.blockSize = blockSize;
+  r.blocks = blocks;
+  r.meanUs = sum / times.size() / 1000.;
+  r.p99Us = times[min(times.size() - 1, (size_t) (times.size() * 0.99))] / 1000.;
+  r.maxUs = times.back() / 1000.;
+  r.budgetUs = 1e6 * blockSize / sampleRate;
+  dsp.GetCpuStats(r.cpu);
+  r.cpu = r.cpu.Since(cpuStart);
+  r.counters = dsp.mNesApu->total_counters();
+  return r;
+}
+
+#pragma mark - Golden mode
+
+static const int kGoldenRate = 44100;
+static const int kGoldenBlock = 512;
+static const int kGoldenPolyVoices = 4;
+
+struct GoldenPart
+{
+  const char* name;
+  unsigned channels;  // mask of NES channels left enabled
+};
+
+static const GoldenPart kGoldenParts[] = {
+  {"mix", 0xFF}, {"2a03", 0x1F}, {"vrc6", 0xE0},
+  {"pulse1", 1 << kChPulse1}, {"pulse2", 1 << kChPulse2}, {"triangle", 1 << kChTriangle},
+  {"noise", 1 << kChNoise}, {"dpcm", 1 << kChDpcm}, {"vrc6pulse1", 1 << kChVrc6Pulse1},
+  {"vrc6pulse2", 1 << kChVrc6Pulse2}, {"saw", 1 << kChVrc6Saw}
+};
+
+// Channel state as a preset would save it, with envelope shapes in place of the flat defaults
+template<typename T>
+static void MakeGoldenState(IByteChunk& chunk)
+{
+  LoudNESDSP<T> dsp;
+  for (auto channel : dsp.mNesChannels->allChannels) {
+    if (channel->mChannel != NesApu::Channel::Dpcm) {
+      NesEnvelopes& envs = channel->mEnvs;
+      for (int i = 0; i < kMaxSteps; i++) {
+        envs.volume.SetValue(i, max(15 - i / 2, 4));
+        envs.duty.SetValue(i, (i / 4) % 4);
+        envs.arp.SetValue(i, i < 6 ? (i % 3) * 4 : 0);
+        envs.pitch.SetValue(i, (i % 8) - 4);
+      }
+    }
+    channel->Serialize(chunk);
+  }
+}
+
+// Parameters a host would restore alongside the state chunk
+template<typename T>
+static void ApplyGoldenParams(LoudNESDSP<T>& dsp)
+{
+  dsp.SetParam(ParamFromCh(kChPulse1, kParamEnv1Length), 24);
+  dsp.SetParam(ParamFromCh(kChPulse1, kParamEnv1LoopPoint), 20);
+  dsp.SetParam(ParamFromCh(kChPulse2, kParamEnv2SpeedDiv), 3);
+  dsp.SetParam(ParamFromCh(kChPulse2, kParamChLegato), 1.);
+  dsp.SetParam(ParamFromCh(kChNoise, kParamChKeyTrack), 0.);
+  dsp.SetParam(ParamFromCh(kChVrc6Saw, kParamChVelSens), 0.);
+  dsp.SetParam(ParamFromCh(kChVrc6Saw, kParamEnv3Length), 6);
+  dsp.SetParam(kParamNoteGlideTime, 20.);
+}
+
+// Pans, as percentages, from hard left to hard right
+static const double kGoldenPans[kNumChannels] = {-75., 75., 0., -30., 30., -100., 100., 50.};
+
+// With split set, also renders every NES channel's output pair, into split[channel].
+// With right set, pans the channels halfway through, and renders the right output into it.
+template<typename T>
+static void RenderGolden(const IByteChunk* state, unsigned channels, int voices, int paraMode, bool mpe, double seconds, std::vector<short>& out,
+                         std::vector<short>* split = nullptr, std::vector<short>* right = nullptr, bool nonlinear = false)
+{
+  // a worker per extra voice, so poly renders must match whichever thread ran each engine
+  auto dsp = std::make_unique<LoudNESDSP<T>>(voices - 1);
+  // in omni mode, all of the arrangement's notes go through the paraphonic pool
+  dsp->SetParam(kParamOmniMode, paraMode != kParaOff);
+  dsp->SetParam(kParamPolyVoices, voices);
+  dsp->SetParam(kParamParaMode, paraMode);
+  dsp->SetParam(kParamMpe, mpe);
+  dsp->SetParam(kParamNonlinearMix, nonlinear);
+  const int numOutputs = split ? 2 + 2 * kNumChannels : 2;
+  dsp->Reset(kGoldenRate, kGoldenBlock, numOutputs);
+  if (state) {
+    int pos = 0;
+    for (auto channel : dsp->mNesChannels->allChannels) pos = channel->Deserialize(*state, pos);
+    ApplyGoldenParams(*dsp);
+  }
+  for (int ch = 0; ch < kNumChannels; ch++) dsp->SetChannelEnabled(NesApu::Channel(ch), (channels >> ch) & 1);
+
+  std::vector<std::vector<T>> buffers(numOutputs, std::vector<T>(kGoldenBlock));
+  std::vector<T*> outputs;
+  for (auto& buffer : buffers) outputs.push_back(buffer.data());
+  auto toShort = [](T s) { return (short) clamp(std::lround(s * 32767.), -32768L, 32767L); };
+  BenchScenario scenario(kGoldenRate);
+  auto send = [&dsp](const IMidiMsg& msg) { dsp->ProcessMidiMsg(msg); };
+  BenchMpeSender<decltype(send)> mpeSend(send);
+
+  out.clear();
+  if (split) for (int ch = 0; ch < kNumChannels; ch++) split[ch].clear();
+  if (right) right->clear();
+  long blocks = (long) (seconds * kGoldenRate / kGoldenBlock);
+  for (long b = 0; b < blocks; b++) {
+    if (right && b == blocks / 2) {
+      for (int ch = 0; ch < kNumChannels; ch++) dsp->SetParam(ParamFromCh(ch, kParamChPan), kGoldenPans[ch]);
+    }
+    if (mpe) scenario.Emit(b * kGoldenBlock, kGoldenBlock, mpeSend);
+    else scenario.Emit(b * kGoldenBlock, kGoldenBlock, send);
+    dsp->ProcessBlock(nullptr, outputs.data(), numOutputs, kGoldenBlock, scenario.BeatAt(b * kGoldenBlock), true, BenchScenario::kTempo);
+    for (T s : buffers[0]) out.push_back(toShort(s));
+    if (right) for (T s : buffers[1]) right->push_back(toShort(s));
+    if (split) {
+      for (int ch = 0; ch < kNumChannels; ch++) {
+        for (T s : buffers[2 + 2 * ch]) split[ch].push_back(toShort(s));
+      }
+    }
+  }
+}
+
+// Short noise hits with long silences between, so its shift register spends most of
+// the render being advanced while muted, and each hit shows the phase it resumed at
+template<typename T>
+static void RenderNoiseGaps(const IByteChunk& state, double seconds, std::vector<short>& out)
+{
+  // in samples; the spacing isn't a multiple of the block size, so hits land at any offset
+  const long kHitSpacing = 16411, kHitLength = 1200;
+
+  auto dsp = std::make_unique<LoudNESDSP<T>>(0);
+  dsp->Reset(kGoldenRate, kGoldenBlock);
+  int pos = 0;
+  for (auto channel : dsp->mNesChannels->allChannels) pos = channel->Deserialize(state, pos);
+  for (int ch = 0; ch < kNumChannels; ch++) dsp->SetChannelEnabled(NesApu::Channel(ch), ch == kChNoise);
+
+  std::vector<T> left(kGoldenBlock), right(kGoldenBlock);
+  T* outputs[2] = {left.data(), right.data()};
+  IMidiMsg msg;
+  out.clear();
+  long blocks = (long) (seconds * kGoldenRate / kGoldenBlock);
+  for (long b = 0; b < blocks; b++) {
+    long start = b * kGoldenBlock;
+    for (long hit = start / kHitSpacing; hit * kHitSpacing < start + kGoldenBlock; hit++) {
+      // the duty envelope switches the noise mode, so hits alternate short and long sequences
+      int note = 48 + (int) (hit * 7 % 25);
+      long on = hit * kHitSpacing, off = on + kHitLength;
+      if (on >= start) {
+        msg.MakeNoteOnMsg(note, 100, (int) (on - start), kChNoise);
+        dsp->ProcessMidiMsg(msg);
+      }
+      if (off >= start && off < start + kGoldenBlock) {
+        msg.MakeNoteOffMsg(note, (int) (off - start), kChNoise);
+        dsp->ProcessMidiMsg(msg);
+      }
+    }
+    dsp->ProcessBlock(nullptr, outputs, 2, kGoldenBlock);
+    for (T s : left) out.push_back((short) clamp(std::lround(s * 32767.), -32768L, 32767L));
+  }
+}
+
+template<typename T>
+static void CheckGolden(Golden_Checker& golden, const char* type, double seconds)
+{
+  IByteChunk state;
+  MakeGoldenState<T>(state);
+
+  std::vector<short> samples;
+  for (bool restored : {false, true}) {
+    for (const GoldenPart& part : kGoldenParts) {
+      RenderGolden<T>(restored ? &state : nullptr, part.channels, 1, kParaOff, false, seconds, samples);
+      std::string name = std::string("dsp-") + type + (restored ? "-state." : ".") + part.name;
+      golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+    }
+  }
+
+  RenderNoiseGaps<T>(state, seconds, samples);
+  std::string name = std::string("dsp-") + type + "-state.noisegaps";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+
+  RenderGolden<T>(&state, 0xFF, kGoldenPolyVoices, kParaOff, false, seconds, samples);
+  name = std::string("dsp-") + type + "-poly.mix";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+
+  static const char* const kParaNames[kNumParaModes] = {"", "roundrobin", "oldest", "lowest"};
+  for (int mode = kParaOff + 1; mode < kNumParaModes; mode++) {
+    RenderGolden<T>(&state, 0xFF, 1, mode, false, seconds, samples);
+    name = std::string("dsp-") + type + "-para." + kParaNames[mode];
+    golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+  }
+
+  // MPE, through the poly allocators and through the paraphonic pool
+  RenderGolden<T>(&state, 0xFF, kGoldenPolyVoices, kParaOff, true, seconds, samples);
+  name = std::string("dsp-") + type + "-mpe.poly";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+  RenderGolden<T>(&state, 0xFF, 1, kParaRoundRobin, true, seconds, samples);
+  name = std::string("dsp-") + type + "-mpe.para";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+
+  // Split outputs come from the same emulation as the solo renders, so each channel's
+  // pair must match its solo reference exactly. The mix is their sum, so has its own.
+  std::vector<short> split[kNumChannels];
+  RenderGolden<T>(&state, 0xFF, 1, kParaOff, false, seconds, samples, split);
+  name = std::string("dsp-") + type + "-split.mix";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+  for (const GoldenPart& part : kGoldenParts) {
+    for (int ch = 0; ch < kNumChannels; ch++) {
+      if (part.channels != 1u << ch) continue;
+      name = std::string("dsp-") + type + "-state." + part.name;
+      golden.check(name.c_str(), split[ch].data(), (long) split[ch].size(), kGoldenRate);
+    }
+  }
+
+  // Panning splits the engines as it starts, halfway through
+  std::vector<short> right;
+  RenderGolden<T>(&state, 0xFF, kGoldenPolyVoices, kParaOff, false, seconds, samples, nullptr, &right);
+  name = std::string("dsp-") + type + "-pan.left";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+  name = std::string("dsp-") + type + "-pan.right";
+  golden.check(name.c_str(), right.data(), (long) right.size(), kGoldenRate);
+
+  RenderGolden<T>(&state, 0xFF, kGoldenPolyVoices, kParaOff, false, seconds, samples, nullptr, nullptr, true);
+  name = std::string("dsp-") + type + "-nonlinear.mix";
+  golden.check(name.c_str(), samples.data(), (long) samples.size(), kGoldenRate);
+}
+
+#pragma mark - Benchmark output
+
+enum EFormat { kFormatText, kFormatCsv, kFormatJson };
+
+static void PrintHeader(FILE* out, EFormat format, double seconds)
+{
+  if (format == kFormatCsv)
+    fprintf(out, "type,sample_rate,block_size,blocks,mean_us,p99_us,max_us,budget_us,realtime_factor,worst_utilization\n");
+  else if (format == kFormatJson)
+    fprintf(out, "{\"seconds\":%g,\"results\":[\n", seconds);
+  else
+    fprintf(out, "%-6s %7s %6s %10s %10s %10s %10s %9s %9s\n", "type", "rate", "block",
+           "mean us", "p99 us", "max us", "budget us", "rt factor", "worst %");
+}
+
+// Percent of real time by group, from the DSP's own counters
+static void PrintCpuStats(FILE* out, const LoudNESCpuStats& cpu)
+{
+  double channels = 0, oscs = 0;
+  for (int i = 0; i < kNumChannels; i++) channels += cpu.Load(kCpuChannelBase + i);
+  for (int i = 0; i < Nes_Apu::osc_count; i++) oscs += cpu.Load(kCpuOscBase + i);
+  fprintf(out, "       process %.3f%%  channels %.3f%%  2A03 %.3f%%  expansion %.3f%%  read %.3f%%\n",
+          cpu.Load(kCpuProcess) * 100., channels * 100., oscs * 100., cpu.Load(kCpuExpansion) * 100.,
+          cpu.Load(kCpuRead) * 100.);
+}
+
+static void PrintResult(FILE* out, EFormat format, const BenchResult& r, bool first, bool cpuStats)
+{
+  double realtime = r.budgetUs / r.meanUs;
+  double worst = r.maxUs / r.budgetUs;
+  if (format == kFormatCsv)
+    fprintf(out, "%s,%d,%d,%ld,%.3f,%.3f,%.3f,%.3f,%.1f,%.4f\n", r.type, r.sampleRate, r.blockSize,
+           r.blocks, r.meanUs, r.p99Us, r.maxUs, r.budgetUs, realtime, worst);
+  else if (format == kFormatJson)
+    fprintf(out, "%s{\"type\":\"%s\",\"sample_rate\":%d,\"block_size\":%d,\"blocks\":%ld,\"mean_us\":%.3f,"
+           "\"p99_us\":%.3f,\"max_us\":%.3f,\"budget_us\":%.3f,\"realtime_factor\":%.1f,\"worst_utilization\":%.4f}",
+           first ? "" : ",\n", r.type, r.sampleRate, r.blockSize, r.blocks, r.meanUs, r.p99Us,
+           r.maxUs, r.budgetUs, realtime, worst);
+  else
+    fprintf(out, "%-6s %7d %6d %10.2f %10.2f %10.2f %10.2f %9.1f %8.2f%%\n", r.type, r.sampleRate,
+           r.blockSize, r.meanUs, r.p99Us, r.maxUs, r.budgetUs, realtime, worst * 100.);
+  if (format == kFormatText && cpuStats) {
+    PrintCpuStats(out, r.cpu);
+    if (Simple_Apu::event_counters) r.counters.print(out);
+  }
+  fflush(out);
+}
+
+template<typename T>
+static void RunType(FILE* out, const char* type, EFormat format, double seconds, int onlyRate, int onlyBlock, int tickRate, int voices, int workers, bool nonlinear, bool cpuStats, bool& first)
+{
+  for (int sampleRate : kSampleRates) {
+    if (onlyRate && sampleRate != onlyRate) continue;
+    // one instance per rate; hosts call Reset again when the block size changes
+    auto dsp = std::make_unique<LoudNESDSP<T>>(workers);
+    dsp->SetParam(kParamTickRate, tickRate);
+    dsp->SetParam(kParamPolyVoices, voices);
+    dsp->SetParam(kParamNonlinearMix, nonlinear);
+    for (int blockSize : kBlockSizes) {
+      if (onlyBlock && blockSize != onlyBlock) continue;
+      PrintResult(out, format, RunConfig(*dsp, type, sampleRate, blockSize, seconds), first, cpuStats);
+      first = false;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  EFormat format = kFormatText;
+  double seconds = 10.;
+  const char* type = nullptr;
+  int onlyRate = 0;
+  int onlyBlock = 0;
+  const char* outPath = nullptr;
+  bool cpuStats = false;
+  const char* goldenDir = nullptr;
+  int tolerance = 0;
+  bool update = false;
+  const char* tracePath = nullptr;
+  int tickRate = kTickRate60;
+  int voices = 1;
+  int workers = LoudNESWorkerPool::DefaultWorkers(kMaxPolyVoices);
+  bool nonlinear = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+      const char* f = argv[++i];
+      format = !strcmp(f, "csv") ? kFormatCsv : !strcmp(f, "json") ? kFormatJson : kFormatText;
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      outPath = argv[++i];
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      type = argv[++i];
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      onlyRate = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      onlyBlock = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-c")) {
+      cpuStats = true;
+    } else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+      goldenDir = argv[++i];
+    } else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+      tolerance = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-u")) {
+      update = true;
+    } else if (!strcmp(argv[i], "-T") && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+      static const char* const kTickRateNames[kNumTickRates] = {"50", "60", "120", "240", "1/16", "1/16T", "1/32", "1/32T"};
+      const char* name = argv[++i];
+      for (int r = 0; r < kNumTickRates; r++) {
+        if (!strcmp(name, kTickRateNames[r])) tickRate = r;
+      }
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      voices = atoi(argv[++i]);
+      voices = clamp(voices, 1, kMaxPolyVoices);
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+      workers = clamp(workers, 0, kMaxPolyVoices - 1);
+    } else if (!strcmp(argv[i], "-n")) {
+      nonlinear = true;
+    } else {
+      fprintf(stderr, "usage: %s [-f text|csv|json] [-o file] [-s seconds] [-t float|double] [-r rate] [-b block] [-k ticks] [-p voices] [-j workers] [-n] [-c] [-T trace]\n"
+                      "       %s -g dir [-e tolerance] [-u] [-o file] [-s seconds] [-t float|double]\n", argv[0], argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  FILE* out = outPath ? fopen(outPath, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "Couldn't open %s\n", outPath);
+    return EXIT_FAILURE;
+  }
+
+  if (goldenDir) {
+    Golden_Checker golden(goldenDir, tolerance, update, out);
+    if (!type || !strcmp(type, "float"))
+      CheckGolden<float>(golden, "float", seconds);
+    if (!type || !strcmp(type, "double"))
+      CheckGolden<double>(golden, "double", seconds);
+    fprintf(out, "%d failed, %d written\n", golden.failed(), golden.written());
+    if (out != stdout)
+      fclose(out);
+    return golden.failed() ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+#if NES_TRACE
+  NES_TRACE_THREAD("dsp_bench");
+  if (tracePath) nes_trace_start();
+#else
+  if (tracePath) fprintf(stderr, "Tracing needs a build with -DNES_TRACE=1\n");
+#endif
+
+  PrintHeader(out, format, seconds);
+  bool first = true;
+  if (!type || !strcmp(type, "float"))
+    RunType<float>(out, "float", format, seconds, onlyRate, onlyBlock, tickRate, voices, workers, nonlinear, cpuStats, first);
+  if (!type || !strcmp(type, "double"))
+    RunType<double>(out, "double", format, seconds, onlyRate, onlyBlock, tickRate, voices, workers, nonlinear, cpuStats, first);
+  if (format == kFormatJson)
+    fprintf(out, "\n]}\n");
+
+#if NES_TRACE
+  if (tracePath) {
+    nes_trace_stop();
+    if (!nes_trace_write(tracePath)) fprintf(stderr, "Couldn't write trace to %s\n", tracePath);
+  }
+#endif
+  if (out != stdout)
+    fclose(out);
+
+  return EXIT_SUCCESS;
+}